@@ -0,0 +1,82 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Vookoo headless example
+//
+// Renders a triangle into an offscreen Window with no surface and reads the
+// pixels back. Useful for batch rendering and for checking the renderer on a
+// machine with no display. Exits with 1 if no frame came back or the triangle
+// is missing from it.
+//
+
+// No GLFW or SDL: the window is offscreen.
+#define VKU_NO_WINDOW
+#include <vku/vku_framework.hpp>
+#include <vku/vku.hpp>
+
+int main() {
+  vku::Framework fw{"headless"};
+  if (!fw.ok()) {
+    std::cout << "Framework creation failed" << std::endl;
+    exit(1);
+  }
+
+  auto device = fw.device();
+
+  // Read every frame back to the CPU.
+  vku::WindowOptions options;
+  options.desiredSwapChainImageFormat = vk::Format::eR8G8B8A8Unorm;
+  options.readbackInterval = 1;
+  const uint32_t width = 256, height = 256;
+  vku::Window window{fw.instance(), device, fw.physicalDevice(), fw.graphicsQueueFamilyIndex(), width, height, options};
+  if (!window.ok()) {
+    std::cout << "Window creation failed" << std::endl;
+    exit(1);
+  }
+
+  vku::ShaderModule vert{device, BINARY_DIR "headless.vert.spv"};
+  vku::ShaderModule frag{device, BINARY_DIR "headless.frag.spv"};
+
+  vku::PipelineLayoutMaker plm{};
+  auto pipelineLayout = plm.createUnique(device);
+
+  // The triangle's vertices come from gl_VertexIndex, so there is no vertex buffer.
+  vku::PipelineMaker pm{width, height};
+  auto pipeline = pm
+    .shader(vk::ShaderStageFlagBits::eVertex, vert)
+    .shader(vk::ShaderStageFlagBits::eFragment, frag)
+    .createUnique(device, fw.pipelineCache(), *pipelineLayout, window.renderPass());
+
+  window.setStaticCommands(
+    [&pipeline](vk::CommandBuffer cb, int imageIndex, vk::RenderPassBeginInfo &rpbi) {
+      cb.begin(vk::CommandBufferBeginInfo{});
+      cb.beginRenderPass(rpbi, vk::SubpassContents::eInline);
+      cb.bindPipeline(vk::PipelineBindPoint::eGraphics, *pipeline);
+      cb.draw(3, 1, 0, 0);
+      cb.endRenderPass();
+      cb.end();
+    }
+  );
+
+  // Check the centre of each frame is covered by the triangle and the corner is cleared.
+  int frames = 0, good = 0;
+  window.setReadbackCallback(
+    [&](uint64_t frame, const void *pixels, uint32_t w, uint32_t h, vk::Format format) {
+      auto p = (const uint8_t *)pixels;
+      const uint8_t *centre = p + ((h / 2) * w + w / 2) * 4;
+      const uint8_t *corner = p;
+      ++frames;
+      if (memcmp(centre, corner, 4) != 0) ++good;
+    }
+  );
+
+  const int numFrames = 10;
+  for (int i = 0; i != numFrames; ++i) {
+    window.draw(device, fw.graphicsQueue());
+  }
+
+  // Deliver the frames still in flight.
+  window.waitIdle();
+
+  std::cout << frames << " frames read back, " << good << " with the triangle\n";
+  return frames == numFrames && good == frames ? 0 : 1;
+}
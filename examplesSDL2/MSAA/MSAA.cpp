@@ -76,8 +76,8 @@ int main() {
             rpm.attachmentBegin(window.swapchainImageFormat());
             rpm.attachmentSamples(msaa ? SAMPLESx4 : SAMPLESx1);
             rpm.attachmentLoadOp(vk::AttachmentLoadOp::eClear);
-            rpm.attachmentStoreOp(msaa ? vk::AttachmentStoreOp::eDontCare
-                                       : vk::AttachmentStoreOp::eStore);
+            rpm.attachmentStoreOp(vk::AttachmentStoreOp::eStore);
+            rpm.attachmentTransient(msaa);
             rpm.attachmentFinalLayout(msaa ? vk::ImageLayout::eColorAttachmentOptimal
                                            : vk::ImageLayout::ePresentSrcKHR);
 
@@ -29,6 +29,29 @@
 #include <functional>
 #include <cstddef>
 #include <cmath>
+#include <map>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <stdexcept>
+#include <limits>
+#include <numeric>
+#include <span>
+#include <atomic>
+#include <future>
+#include <condition_variable>
+#include <exception>
+
+// MappedFile uses mmap where there is one. Define VKU_NO_MMAP to keep the
+// POSIX headers out and read files instead.
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(VKU_NO_MMAP)
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+  #define VKU_DETAIL_MMAP
+#endif
 
 #ifdef VOOKOO_SPIRV_SUPPORT
   //#include <unified1/spirv.hpp11>
@@ -60,24 +83,204 @@ inline int findMemoryTypeIndex(const vk::PhysicalDeviceMemoryProperties &memprop
   return -1;
 }
 
-/// Execute commands immediately and wait for the device to finish.
+/// Execute commands immediately and wait for them to finish.
+/// Only this submission is waited on (using a fence), other queues keep running.
 inline void executeImmediately(vk::Device device, vk::CommandPool commandPool, vk::Queue queue, const std::function<void (vk::CommandBuffer cb)> &func) {
   vk::CommandBufferAllocateInfo cbai{ commandPool, vk::CommandBufferLevel::ePrimary, 1 };
 
   auto cbs = device.allocateCommandBuffers(cbai);
-  cbs[0].begin(vk::CommandBufferBeginInfo{});
+  cbs[0].begin(vk::CommandBufferBeginInfo{vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
   func(cbs[0]);
   cbs[0].end();
 
+  vk::UniqueFence fence = device.createFenceUnique(vk::FenceCreateInfo{});
   vk::SubmitInfo submit;
   submit.commandBufferCount = (uint32_t)cbs.size();
   submit.pCommandBuffers = cbs.data();
-  queue.submit(submit, vk::Fence{});
-  device.waitIdle();
+  queue.submit(submit, *fence);
+  {vk::Result result = device.waitForFences(*fence, VK_TRUE, std::numeric_limits<uint64_t>::max());}
 
   device.freeCommandBuffers(commandPool, cbs);
 }
 
+/// Runs one-shot command buffers from a small recycled pool of command buffers and fences.
+/// Unlike executeImmediately, nothing is allocated per call and submit() does not block
+/// unless every command buffer in the pool is still in use.
+/// example:
+///     vku::ImmediateExecutor executor{device, fw.graphicsQueue(), fw.graphicsQueueFamilyIndex()};
+///     auto handle = executor.submit([&](vk::CommandBuffer cb) { ... });
+///     ...
+///     handle.wait();
+class ImmediateExecutor {
+public:
+  /// A waitable handle for a submission.
+  class Handle {
+  public:
+    Handle() {
+    }
+
+    Handle(ImmediateExecutor *executor, uint32_t slot, uint64_t serial) : executor_(executor), slot_(slot), serial_(serial) {
+    }
+
+    /// Block until the commands have finished.
+    void wait() const { if (executor_) executor_->wait(slot_, serial_); }
+
+    /// Return true if the commands have finished. Does not block.
+    bool ready() const { return !executor_ || executor_->ready(slot_, serial_); }
+  private:
+    ImmediateExecutor *executor_ = nullptr;
+    uint32_t slot_ = 0;
+    uint64_t serial_ = 0;
+  };
+
+  ImmediateExecutor() {
+  }
+
+  ImmediateExecutor(vk::Device device, vk::Queue queue, uint32_t queueFamilyIndex, uint32_t numCommandBuffers = 4) : device_(device), queue_(queue), queueFamilyIndex_(queueFamilyIndex) {
+    for (uint32_t i = 0; i != numCommandBuffers; ++i) {
+      addSlot();
+    }
+  }
+
+  ImmediateExecutor(const ImmediateExecutor &) = delete;
+  ImmediateExecutor &operator=(const ImmediateExecutor &) = delete;
+
+  ~ImmediateExecutor() {
+    if (device_ && !fences_.empty()) {
+      std::vector<vk::Fence> fences;
+      for (auto &f : fences_) fences.push_back(*f);
+      {vk::Result result = device_.waitForFences(fences, VK_TRUE, std::numeric_limits<uint64_t>::max());}
+    }
+  }
+
+  /// Record and submit commands without waiting for them to finish.
+  /// The lock is only held to pick a command buffer and to submit, so func
+  /// may itself call submit() and other threads are not held up by it.
+  /// Each command buffer has its own pool, so threads never share one while recording.
+  Handle submit(const std::function<void (vk::CommandBuffer cb)> &func) {
+    uint32_t slot = 0;
+    vk::Fence fence;
+    vk::CommandBuffer cb;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      // Take the next command buffer that no other thread is recording, adding one if all are.
+      uint32_t n = (uint32_t)commandBuffers_.size();
+      uint32_t i = 0;
+      while (i != n && recording_[(next_ + i) % n]) ++i;
+      slot = i != n ? (next_ + i) % n : addSlot();
+      next_ = (slot + 1) % (uint32_t)commandBuffers_.size();
+      recording_[slot] = true;
+      fence = *fences_[slot];
+      cb = *commandBuffers_[slot];
+    }
+
+    try {
+      // Wait for the oldest submission if it is still using this command buffer.
+      check(device_.waitForFences(fence, VK_TRUE, std::numeric_limits<uint64_t>::max()));
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        serials_[slot] = 0;
+      }
+      device_.resetFences(fence);
+
+      cb.begin(vk::CommandBufferBeginInfo{vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+      func(cb);
+      cb.end();
+    } catch (...) {
+      // Leave the slot signalled and free so that it can be used again.
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (device_.getFenceStatus(fence) != vk::Result::eSuccess) {
+        cb.reset(vk::CommandBufferResetFlags{});
+        queue_.submit(vk::SubmitInfo{}, fence);
+      }
+      recording_[slot] = false;
+      throw;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    vk::SubmitInfo submit;
+    submit.commandBufferCount = 1;
+    submit.pCommandBuffers = &cb;
+    queue_.submit(submit, fence);
+    serials_[slot] = ++serial_;
+    recording_[slot] = false;
+    return Handle{this, slot, serial_};
+  }
+
+  /// Record and submit commands and wait for them to finish.
+  void execute(const std::function<void (vk::CommandBuffer cb)> &func) {
+    submit(func).wait();
+  }
+
+  /// Wait for every submission to finish.
+  void waitAll() {
+    std::vector<uint64_t> serials;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      serials = serials_;
+    }
+    for (uint32_t slot = 0; slot != (uint32_t)serials.size(); ++slot) {
+      if (serials[slot]) wait(slot, serials[slot]);
+    }
+  }
+
+private:
+  // Add a command pool, command buffer and signalled fence. Called with the lock held.
+  uint32_t addSlot() {
+    typedef vk::CommandPoolCreateFlagBits ccbits;
+    vk::CommandPoolCreateInfo cpci{ ccbits::eTransient|ccbits::eResetCommandBuffer, queueFamilyIndex_ };
+    commandPools_.push_back(device_.createCommandPoolUnique(cpci));
+    vk::CommandBufferAllocateInfo cbai{ *commandPools_.back(), vk::CommandBufferLevel::ePrimary, 1 };
+    commandBuffers_.push_back(std::move(device_.allocateCommandBuffersUnique(cbai)[0]));
+    fences_.emplace_back(device_.createFenceUnique(vk::FenceCreateInfo{vk::FenceCreateFlagBits::eSignaled}));
+    serials_.push_back(0);
+    recording_.push_back(false);
+    return (uint32_t)commandBuffers_.size() - 1;
+  }
+
+  // The fence of a slot still holding this serial, or null if it has finished.
+  // A slot that has been reused must have finished its previous submission.
+  vk::Fence pendingFence(uint32_t slot, uint64_t serial) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return serials_[slot] == serial ? *fences_[slot] : vk::Fence{};
+  }
+
+  // The fence may be reset and reused by another submit while we wait on it,
+  // so wait in short steps and stop as soon as the slot no longer holds our serial.
+  // Once the fence has been seen signalled, our submission has finished either way.
+  void wait(uint32_t slot, uint64_t serial) {
+    const uint64_t step = 1000000; // 1ms
+    for (vk::Fence fence = pendingFence(slot, serial); fence; fence = pendingFence(slot, serial)) {
+      vk::Result result = device_.waitForFences(fence, VK_TRUE, step);
+      if (result == vk::Result::eSuccess) return;
+      if (result != vk::Result::eTimeout) check(result);
+    }
+  }
+
+  bool ready(uint32_t slot, uint64_t serial) {
+    vk::Fence fence = pendingFence(slot, serial);
+    return !fence || device_.getFenceStatus(fence) == vk::Result::eSuccess || !pendingFence(slot, serial);
+  }
+
+  static void check(vk::Result result) {
+    if (result != vk::Result::eSuccess) {
+      throw std::runtime_error("vku::ImmediateExecutor: " + vk::to_string(result));
+    }
+  }
+
+  vk::Device device_;
+  vk::Queue queue_;
+  uint32_t queueFamilyIndex_ = 0;
+  std::vector<vk::UniqueCommandPool> commandPools_; // one per slot
+  std::vector<vk::UniqueCommandBuffer> commandBuffers_;
+  std::vector<vk::UniqueFence> fences_;
+  std::vector<uint64_t> serials_;
+  std::vector<bool> recording_;
+  uint32_t next_ = 0;
+  uint64_t serial_ = 0;
+  std::mutex mutex_;
+};
+
 /// Scale a value by mip level, but do not reduce to zero.
 inline uint32_t mipScale(uint32_t value, uint32_t mipLevel) {
   return std::max(value >> mipLevel, (uint32_t)1);
@@ -303,6 +506,21 @@ inline BlockParams getBlockParams(vk::Format format) {
   return BlockParams{0, 0, 0};
 }
 
+/// The aspects of every subresource of an image of this format.
+inline vk::ImageAspectFlags getFormatAspect(vk::Format format) {
+  using iafb = vk::ImageAspectFlagBits;
+  switch (format) {
+    case vk::Format::eD16Unorm:
+    case vk::Format::eX8D24UnormPack32:
+    case vk::Format::eD32Sfloat: return iafb::eDepth;
+    case vk::Format::eS8Uint: return iafb::eStencil;
+    case vk::Format::eD16UnormS8Uint:
+    case vk::Format::eD24UnormS8Uint:
+    case vk::Format::eD32SfloatS8Uint: return iafb::eDepth|iafb::eStencil;
+    default: return iafb::eColor;
+  }
+}
+
 /// Factory for instances.
 class InstanceMaker {
 public:
@@ -440,6 +658,20 @@ public:
 	  return *this;
   }
 
+  /// required to use ePipelineStatistics queries (see QueryStats)
+  DeviceMaker &enablePipelineStatisticsQuery(bool value)
+  {
+	  physicalDeviceFeatures_.setPipelineStatisticsQuery(value);
+	  return *this;
+  }
+
+  /// required for exact sample counts from occlusion queries
+  DeviceMaker &enableOcclusionQueryPrecise(bool value)
+  {
+	  physicalDeviceFeatures_.setOcclusionQueryPrecise(value);
+	  return *this;
+  }
+
   /// required to enable and use multiview
   DeviceMaker &enableMultiView(bool value)
   {
@@ -459,6 +691,47 @@ public:
     return *this;
   }
 
+  DeviceMaker &enableTimelineSemaphore(bool value) {
+    timelineSemaphoreFeatures_.setTimelineSemaphore(value);
+    // Core in Vulkan 1.2.
+    return *this;
+  }
+
+  /// Descriptor indexing features used by BindlessHeap. Core in Vulkan 1.2.
+  /// If supported is given (see PhysicalDevice::getFeatures2), only features it has are enabled.
+  DeviceMaker &enableDescriptorIndexing(bool value, const vk::PhysicalDeviceDescriptorIndexingFeatures *supported = nullptr) {
+    auto &s = supported ? *supported : bindlessFeatures();
+    descriptorIndexingFeatures_
+      .setRuntimeDescriptorArray(value && s.runtimeDescriptorArray)
+      .setDescriptorBindingPartiallyBound(value && s.descriptorBindingPartiallyBound)
+      .setDescriptorBindingVariableDescriptorCount(value && s.descriptorBindingVariableDescriptorCount)
+      .setDescriptorBindingUpdateUnusedWhilePending(value && s.descriptorBindingUpdateUnusedWhilePending)
+      .setDescriptorBindingSampledImageUpdateAfterBind(value && s.descriptorBindingSampledImageUpdateAfterBind)
+      .setDescriptorBindingStorageImageUpdateAfterBind(value && s.descriptorBindingStorageImageUpdateAfterBind)
+      .setDescriptorBindingStorageBufferUpdateAfterBind(value && s.descriptorBindingStorageBufferUpdateAfterBind)
+      .setShaderSampledImageArrayNonUniformIndexing(value && s.shaderSampledImageArrayNonUniformIndexing)
+      .setShaderStorageImageArrayNonUniformIndexing(value && s.shaderStorageImageArrayNonUniformIndexing)
+      .setShaderStorageBufferArrayNonUniformIndexing(value && s.shaderStorageBufferArrayNonUniformIndexing);
+    descriptorIndexing_ = value;
+    return *this;
+  }
+
+  /// The descriptor indexing features that enableDescriptorIndexing() asks for.
+  static const vk::PhysicalDeviceDescriptorIndexingFeatures &bindlessFeatures() {
+    static const vk::PhysicalDeviceDescriptorIndexingFeatures features = vk::PhysicalDeviceDescriptorIndexingFeatures{}
+      .setRuntimeDescriptorArray(true)
+      .setDescriptorBindingPartiallyBound(true)
+      .setDescriptorBindingVariableDescriptorCount(true)
+      .setDescriptorBindingUpdateUnusedWhilePending(true)
+      .setDescriptorBindingSampledImageUpdateAfterBind(true)
+      .setDescriptorBindingStorageImageUpdateAfterBind(true)
+      .setDescriptorBindingStorageBufferUpdateAfterBind(true)
+      .setShaderSampledImageArrayNonUniformIndexing(true)
+      .setShaderStorageImageArrayNonUniformIndexing(true)
+      .setShaderStorageBufferArrayNonUniformIndexing(true);
+    return features;
+  }
+
   /// Create a new logical device.
   vk::UniqueDevice createUnique(vk::PhysicalDevice physical_device) {
     auto dci = vk::DeviceCreateInfo{
@@ -481,6 +754,14 @@ public:
       *tail = &dynamicRenderingFeatures_;
       tail  = reinterpret_cast<void **>(&dynamicRenderingFeatures_.pNext);
     }
+    if (descriptorIndexing_) {
+      *tail = &descriptorIndexingFeatures_;
+      tail  = reinterpret_cast<void **>(&descriptorIndexingFeatures_.pNext);
+    }
+    if (timelineSemaphoreFeatures_.timelineSemaphore) {
+      *tail = &timelineSemaphoreFeatures_;
+      tail  = reinterpret_cast<void **>(&timelineSemaphoreFeatures_.pNext);
+    }
     dci.pNext = &physicalDeviceMultiviewFeatures_;
 
     return physical_device.createDeviceUnique(dci);
@@ -494,6 +775,9 @@ private:
   vk::PhysicalDeviceMultiviewFeatures physicalDeviceMultiviewFeatures_;
   vk::PhysicalDeviceSynchronization2Features synchronization2Features_;
   vk::PhysicalDeviceDynamicRenderingFeatures dynamicRenderingFeatures_;
+  vk::PhysicalDeviceDescriptorIndexingFeatures descriptorIndexingFeatures_;
+  vk::PhysicalDeviceTimelineSemaphoreFeatures timelineSemaphoreFeatures_;
+  bool descriptorIndexing_ = false;
 };
 
 class DebugCallback {
@@ -595,6 +879,16 @@ public:
   RenderpassMaker& attachmentInitialLayout(vk::ImageLayout value) { s.attachmentDescriptions.back().initialLayout = value; return *this;};
   RenderpassMaker& attachmentFinalLayout(vk::ImageLayout value) { s.attachmentDescriptions.back().finalLayout = value; return *this;};
 
+  /// Don't store an attachment whose contents die with the render pass,
+  /// eg. attachmentTransient(image.transient()).
+  RenderpassMaker& attachmentTransient(bool value = true) {
+    if (value) {
+      s.attachmentDescriptions.back().storeOp = vk::AttachmentStoreOp::eDontCare;
+      s.attachmentDescriptions.back().stencilStoreOp = vk::AttachmentStoreOp::eDontCare;
+    }
+    return *this;
+  }
+
   /// Start a subpass description.
   /// After this you can can call subpassColorAttachment many times
   /// and subpassDepthStencilAttachment once.
@@ -709,6 +1003,79 @@ private:
   State s;
 };
 
+/// Read only view of a whole file. Memory mapped where the platform has mmap,
+/// otherwise read into a word aligned buffer.
+class MappedFile {
+public:
+  MappedFile() {
+  }
+
+  MappedFile(const std::string &filename) {
+#ifdef VKU_DETAIL_MMAP
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *p = ::mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        data_ = p;
+        size_ = (size_t)st.st_size;
+        mapped_ = true;
+      }
+    }
+    ::close(fd);
+#else
+    auto file = std::ifstream(filename, std::ios::binary);
+    if (!file.good()) return;
+    file.seekg(0, std::ios::end);
+    size_ = (size_t)file.tellg();
+    buffer_.resize((size_ + 3) / 4);
+    file.seekg(0, std::ios::beg);
+    file.read((char *)buffer_.data(), size_);
+    data_ = buffer_.data();
+#endif
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  MappedFile(MappedFile &&rhs) { *this = std::move(rhs); }
+
+  MappedFile &operator=(MappedFile &&rhs) {
+    if (this != &rhs) {
+      release();
+      buffer_ = std::move(rhs.buffer_);
+      data_ = rhs.mapped_ ? rhs.data_ : buffer_.data();
+      size_ = rhs.size_;
+      mapped_ = rhs.mapped_;
+      rhs.data_ = nullptr;
+      rhs.size_ = 0;
+      rhs.mapped_ = false;
+    }
+    return *this;
+  }
+
+  ~MappedFile() { release(); }
+
+  const void *data() const { return data_; }
+  size_t size() const { return size_; }
+  bool ok() const { return data_ != nullptr; }
+private:
+  void release() {
+#ifdef VKU_DETAIL_MMAP
+    if (mapped_) ::munmap((void*)data_, size_);
+#endif
+    data_ = nullptr;
+    size_ = 0;
+    mapped_ = false;
+  }
+
+  const void *data_ = nullptr;
+  size_t size_ = 0;
+  bool mapped_ = false;
+  std::vector<uint32_t> buffer_;
+};
+
 /// Class for building shader modules and extracting metadata from shaders.
 class ShaderModule {
 public:
@@ -717,38 +1084,53 @@ public:
 
   /// Construct a shader module from a file
   ShaderModule(const vk::Device &device, const std::string &filename) {
-    auto file = std::ifstream(filename, std::ios::binary);
-    if (!file.good()) {
+    MappedFile file(filename);
+    if (!file.ok()) {
       return;
     }
+    *this = ShaderModule(device, (const uint32_t*)file.data(), file.size());
+  }
 
-    file.seekg(0, std::ios::end);
-    int length = (int)file.tellg();
-
-    s.opcodes_.resize((size_t)(length / 4));
-    file.seekg(0, std::ios::beg);
-    file.read((char *)s.opcodes_.data(), s.opcodes_.size() * 4);
-
+  /// Construct a shader module from a memory
+  template<class InIter>
+  ShaderModule(const vk::Device &device, InIter begin, InIter end) {
+    s.opcodes_.assign(begin, end);
     vk::ShaderModuleCreateInfo ci;
     ci.codeSize = s.opcodes_.size() * 4;
     ci.pCode = s.opcodes_.data();
     s.module_ = device.createShaderModuleUnique(ci);
+    s.codeSize_ = ci.codeSize;
 
     s.ok_ = true;
   }
 
-  /// Construct a shader module from a memory
-  template<class InIter>
-  ShaderModule(const vk::Device &device, InIter begin, InIter end) {
-    s.opcodes_.assign(begin, end);
+  /// Construct a shader module from SPIR-V in memory. codeSize is in bytes.
+  /// If keepOpcodes is false there is no host copy, so no reflection.
+  ShaderModule(const vk::Device &device, const uint32_t *code, size_t codeSize, bool keepOpcodes = true) {
+    codeSize &= ~(size_t)3;
+    if (keepOpcodes) s.opcodes_.assign(code, code + codeSize / 4);
     vk::ShaderModuleCreateInfo ci;
-    ci.codeSize = s.opcodes_.size() * 4;
-    ci.pCode = s.opcodes_.data();
+    ci.codeSize = codeSize;
+    ci.pCode = code;
     s.module_ = device.createShaderModuleUnique(ci);
+    s.codeSize_ = codeSize;
 
     s.ok_ = true;
   }
 
+  /// Free the host copy of the SPIR-V, eg. once reflection is done.
+  /// getVariables() and write() will have nothing to work with afterwards.
+  void dropOpcodes() { std::vector<uint32_t>().swap(s.opcodes_); }
+
+  /// True if the SPIR-V is still held on the host.
+  bool hasOpcodes() const { return !s.opcodes_.empty(); }
+
+  /// The host copy of the SPIR-V, empty after dropOpcodes().
+  const std::vector<uint32_t> &opcodes() const { return s.opcodes_; }
+
+  /// Size of the SPIR-V in bytes.
+  size_t codeSize() const { return s.codeSize_; }
+
 #ifdef VOOKOO_SPIRV_SUPPORT
   /// A variable in a shader.
   struct Variable {
@@ -777,6 +1159,7 @@ public:
   /// This exposes the Uniforms, inputs, outputs, push constants.
   /// See spv::StorageClass for more details.
   std::vector<Variable> getVariables() const {
+    if (s.opcodes_.size() < 5) return {};
     auto bound = s.opcodes_[3];
 
     std::unordered_map<int, int> bindings;
@@ -828,6 +1211,7 @@ public:
   /// Write a C++ consumable dump of the shader.
   /// Todo: make this more idiomatic.
   std::ostream &write(std::ostream &os) {
+    if (s.opcodes_.size() < 5) return os;
     os << "static const uint32_t shader[] = {\n";
     char tmp[256];
     auto p = s.opcodes_.begin();
@@ -852,12 +1236,133 @@ private:
   struct State {
     std::vector<uint32_t> opcodes_;
     vk::UniqueShaderModule module_;
+    size_t codeSize_ = 0;
     bool ok_ = false;
   };
 
   State s;
 };
 
+/// Shared, de-duplicated shader modules.
+/// Files are memory mapped and the SPIR-V is hashed, so identical code loaded from
+/// any number of files or pipeline variants makes one vk::ShaderModule.
+/// A hash match is always confirmed by comparing the code itself.
+///
+///   vku::ShaderLibrary shaders(device);
+///   auto vert = shaders.load("shader.vert.spv");
+///   pm.shader(vk::ShaderStageFlagBits::eVertex, *vert);
+class ShaderLibrary {
+public:
+  /// If keepOpcodes is false, modules are made straight from the mapped file with no host copy.
+  /// The library then keeps the file mapped, or a copy of in-memory code, to check for collisions.
+  ShaderLibrary(vk::Device device, bool keepOpcodes = true) : device_(device), keepOpcodes_(keepOpcodes) {
+  }
+
+  /// Load a .spv file. Returns null if the file can not be read.
+  std::shared_ptr<ShaderModule> load(const std::string &filename) {
+    MappedFile file(filename);
+    if (!file.ok()) {
+      std::cout << "vku::ShaderLibrary: can't read " << filename << "\n";
+      return nullptr;
+    }
+    return get((const uint32_t*)file.data(), file.size(), &file);
+  }
+
+  /// Get a module for SPIR-V in memory, making it only if this code has not been seen before.
+  std::shared_ptr<ShaderModule> get(const uint32_t *code, size_t codeSize) {
+    return get(code, codeSize, nullptr);
+  }
+
+  /// Drop the host copies of the SPIR-V in every module, eg. once all reflection is done.
+  /// Modules that are not backed by a mapped file keep one copy here for comparison.
+  void dropOpcodes() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &b : modules_) {
+      for (auto &e : b.second) {
+        if (!e.file.ok() && e.code.empty()) e.code = e.module->opcodes();
+        e.module->dropOpcodes();
+      }
+    }
+  }
+
+  /// Forget modules that nobody else holds. Returns the number released.
+  size_t trim() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t n = 0;
+    for (auto i = modules_.begin(); i != modules_.end(); ) {
+      auto &b = i->second;
+      auto e = std::remove_if(b.begin(), b.end(), [](const Entry &e) { return e.module.use_count() == 1; });
+      n += b.end() - e;
+      b.erase(e, b.end());
+      i = b.empty() ? modules_.erase(i) : std::next(i);
+    }
+    return n;
+  }
+
+  /// Number of distinct modules held.
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t n = 0;
+    for (auto &b : modules_) n += b.second.size();
+    return n;
+  }
+
+  /// Number of loads that found an existing module.
+  size_t hits() const { return hits_; }
+
+  /// Number of loads that made a new module.
+  size_t misses() const { return misses_; }
+private:
+  // A module and whatever holds its code when the module has no host copy.
+  struct Entry {
+    std::shared_ptr<ShaderModule> module;
+    MappedFile file;
+    std::vector<uint32_t> code;
+
+    const void *data() const {
+      return module->hasOpcodes() ? (const void*)module->opcodes().data() : file.ok() ? file.data() : (const void*)code.data();
+    }
+  };
+
+  std::shared_ptr<ShaderModule> get(const uint32_t *code, size_t codeSize, MappedFile *file) {
+    codeSize &= ~(size_t)3;
+    uint64_t key = hash(code, codeSize);
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &bucket = modules_[key];
+    for (auto &e : bucket) {
+      if (e.module->codeSize() == codeSize && !memcmp(e.data(), code, codeSize)) {
+        ++hits_;
+        return e.module;
+      }
+    }
+    ++misses_;
+    Entry e;
+    e.module = std::make_shared<ShaderModule>(device_, code, codeSize, keepOpcodes_);
+    if (!keepOpcodes_) {
+      if (file) e.file = std::move(*file);
+      else e.code.assign(code, code + codeSize / 4);
+    }
+    bucket.push_back(std::move(e));
+    return bucket.back().module;
+  }
+
+  // FNV-1a over 32 bit words.
+  static uint64_t hash(const uint32_t *code, size_t codeSize) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i != codeSize / 4; ++i) {
+      h = (h ^ code[i]) * 0x100000001b3ull;
+    }
+    return h ^ codeSize;
+  }
+
+  vk::Device device_;
+  bool keepOpcodes_;
+  mutable std::mutex mutex_;
+  std::unordered_map<uint64_t, std::vector<Entry>> modules_;
+  size_t hits_ = 0;
+  size_t misses_ = 0;
+};
+
 /// A class for building pipeline layouts.
 /// Pipeline layouts describe the descriptor sets and push constants used by the shaders.
 class PipelineLayoutMaker {
@@ -891,6 +1396,66 @@ private:
   std::vector<vk::PushConstantRange> pushConstantRanges_;
 };
 
+/// Pipeline cache hit/miss counters.
+/// Pass one to PipelineMaker::cacheStats() or ComputePipelineMaker::cacheStats() and
+/// pipeline creation chains a vk::PipelineCreationFeedbackCreateInfo (core in 1.3)
+/// and records whether the driver found the pipeline in the cache.
+/// The counters are atomic so one object can be shared between threads.
+class PipelineCacheStats {
+public:
+  PipelineCacheStats() {
+  }
+
+  void record(const vk::PipelineCreationFeedback &feedback, std::chrono::steady_clock::time_point start) {
+    record(feedback, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+  }
+
+  /// Record with an explicit time, used when several pipelines are created in one call.
+  void record(const vk::PipelineCreationFeedback &feedback, uint64_t ns) {
+    using fb = vk::PipelineCreationFeedbackFlagBits;
+    if (!(feedback.flags & fb::eValid)) {
+      ++unknown_; unknownNs_ += ns;
+    } else if (feedback.flags & fb::eApplicationPipelineCacheHit) {
+      ++hits_; hitNs_ += ns;
+    } else {
+      ++misses_; missNs_ += ns;
+    }
+  }
+
+  uint64_t hits() const { return hits_; }
+  uint64_t misses() const { return misses_; }
+  /// Pipelines where the driver gave no feedback.
+  uint64_t unknown() const { return unknown_; }
+  double hitMs() const { return hitNs_ * 1e-6; }
+  double missMs() const { return missNs_ * 1e-6; }
+
+  /// Rough estimate of compile time saved by the cache:
+  /// each hit would otherwise have cost an average miss.
+  double estimatedSavedMs() const {
+    if (!misses_ || !hits_) return 0;
+    double perMiss = missMs() / misses_, perHit = hitMs() / hits_;
+    return std::max(0.0, (perMiss - perHit) * hits_);
+  }
+
+  void reset() {
+    hits_ = misses_ = unknown_ = 0;
+    hitNs_ = missNs_ = unknownNs_ = 0;
+  }
+
+  void dump(std::ostream &os) const {
+    os << "Pipeline cache: " << hits() << " hits (" << hitMs() << "ms) " << misses() << " misses (" << missMs() << "ms)";
+    if (unknown()) os << " " << unknown() << " without feedback";
+    os << ", ~" << estimatedSavedMs() << "ms saved\n";
+  }
+private:
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> misses_{0};
+  std::atomic<uint64_t> unknown_{0};
+  std::atomic<uint64_t> hitNs_{0};
+  std::atomic<uint64_t> missNs_{0};
+  std::atomic<uint64_t> unknownNs_{0};
+};
+
 
 struct SpecConst {
   uint32_t    constantID;
@@ -958,7 +1523,28 @@ public:
                             const vk::PipelineCache &pipelineCache,
                             const vk::PipelineLayout &pipelineLayout,
                             const vk::RenderPass &renderPass, bool defaultBlend=true) {
+    vk::GraphicsPipelineCreateInfo pipelineInfo = createInfo(pipelineLayout, renderPass, defaultBlend);
+
+    vk::PipelineCreationFeedback feedback{};
+    vk::PipelineCreationFeedbackCreateInfo feedbackInfo{};
+    if (cacheStats_) {
+      feedbackInfo.pPipelineCreationFeedback = &feedback;
+      feedbackInfo.pNext = pipelineInfo.pNext;
+      pipelineInfo.pNext = &feedbackInfo;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto [result, pipeline] = device.createGraphicsPipelineUnique(pipelineCache, pipelineInfo);
+    // TODO check result for vk::Result::ePipelineCompileRequiredEXT
+    if (cacheStats_) cacheStats_->record(feedback, start);
+    return std::move(pipeline);
+  }
 
+  /// Build the create info without creating the pipeline.
+  /// The result points into this maker, so the maker must outlive its use.
+  /// PipelineCompiler uses this to create many pipelines in one call.
+  const vk::GraphicsPipelineCreateInfo &createInfo(const vk::PipelineLayout &pipelineLayout,
+                            const vk::RenderPass &renderPass, bool defaultBlend=true) {
     // Add default colour blend attachment if necessary.
     if (colorBlendAttachments_.empty() && defaultBlend) {
       vk::PipelineColorBlendAttachmentState blend{};
@@ -978,37 +1564,43 @@ public:
     colorBlendState_.attachmentCount = count;
     colorBlendState_.pAttachments = count ? colorBlendAttachments_.data() : nullptr;
 
-    vk::PipelineViewportStateCreateInfo viewportState{
+    viewportState_ = vk::PipelineViewportStateCreateInfo{
         {}, 1, &viewport_, 1, &scissor_};
 
-    vk::PipelineVertexInputStateCreateInfo vertexInputState;
-    vertexInputState.vertexAttributeDescriptionCount = (uint32_t)vertexAttributeDescriptions_.size();
-    vertexInputState.pVertexAttributeDescriptions = vertexAttributeDescriptions_.data();
-    vertexInputState.vertexBindingDescriptionCount = (uint32_t)vertexBindingDescriptions_.size();
-    vertexInputState.pVertexBindingDescriptions = vertexBindingDescriptions_.data();
+    vertexInputState_ = vk::PipelineVertexInputStateCreateInfo{};
+    vertexInputState_.vertexAttributeDescriptionCount = (uint32_t)vertexAttributeDescriptions_.size();
+    vertexInputState_.pVertexAttributeDescriptions = vertexAttributeDescriptions_.data();
+    vertexInputState_.vertexBindingDescriptionCount = (uint32_t)vertexBindingDescriptions_.size();
+    vertexInputState_.pVertexBindingDescriptions = vertexBindingDescriptions_.data();
 
-    vk::PipelineDynamicStateCreateInfo dynState{{}, (uint32_t)dynamicState_.size(), dynamicState_.data()};
+    dynState_ = vk::PipelineDynamicStateCreateInfo{{}, (uint32_t)dynamicState_.size(), dynamicState_.data()};
 
-    vk::GraphicsPipelineCreateInfo pipelineInfo{};
-    pipelineInfo.pVertexInputState = &vertexInputState;
+    vk::GraphicsPipelineCreateInfo &pipelineInfo = pipelineInfo_;
+    pipelineInfo = vk::GraphicsPipelineCreateInfo{};
+    pipelineInfo.pVertexInputState = &vertexInputState_;
     pipelineInfo.stageCount = (uint32_t)modules_.size();
     pipelineInfo.pStages = modules_.data();
     pipelineInfo.pInputAssemblyState = &inputAssemblyState_;
-    pipelineInfo.pViewportState = &viewportState;
+    pipelineInfo.pViewportState = &viewportState_;
     pipelineInfo.pRasterizationState = &rasterizationState_;
     pipelineInfo.pMultisampleState = &multisampleState_;
     pipelineInfo.pColorBlendState = &colorBlendState_;
     pipelineInfo.pDepthStencilState = &depthStencilState_;
     pipelineInfo.pNext = pipelineNext_;
+    // Chain the dynamic rendering formats here rather than in a setter so that
+    // the chain always points into this maker, even after it has been moved.
+    if (!renderPass && hasRenderingFormats()) {
+      renderingInfo_.colorAttachmentCount    = (uint32_t)colorFormats_.size();
+      renderingInfo_.pColorAttachmentFormats = colorFormats_.data();
+      renderingInfo_.pNext                   = pipelineNext_;
+      pipelineInfo.pNext = &renderingInfo_;
+    }
     pipelineInfo.layout = pipelineLayout;
     pipelineInfo.renderPass = renderPass;
-    pipelineInfo.pDynamicState = dynamicState_.empty() ? nullptr : &dynState;
+    pipelineInfo.pDynamicState = dynamicState_.empty() ? nullptr : &dynState_;
     pipelineInfo.subpass = subpass_;
     pipelineInfo.pTessellationState = &tessellationState_;
-
-    auto [result, pipeline] = device.createGraphicsPipelineUnique(pipelineCache, pipelineInfo);
-    // TODO check result for vk::Result::ePipelineCompileRequiredEXT
-    return std::move(pipeline);
+    return pipelineInfo;
   }
 
   /// Add a shader module to the pipeline.
@@ -1191,6 +1783,7 @@ public:
 
   PipelineMaker &dynamicState(vk::DynamicState value) { dynamicState_.push_back(value); return *this; }
   PipelineMaker &pipelineNext(const void *p) { pipelineNext_ = p; return *this; }
+  PipelineMaker &cacheStats(PipelineCacheStats *stats) { cacheStats_ = stats; return *this; }
 
   // Dynamic rendering color/depth/stencil attachment formats.
   // When any are set, the no-renderpass createUnique builds VkPipelineRenderingCreateInfo
@@ -1203,18 +1796,23 @@ public:
   vk::UniquePipeline createUnique(const vk::Device &device,
                             const vk::PipelineCache &pipelineCache,
                             const vk::PipelineLayout &pipelineLayout, bool defaultBlend=true) {
-    if (!colorFormats_.empty() ||
-        renderingInfo_.depthAttachmentFormat   != vk::Format::eUndefined ||
-        renderingInfo_.stencilAttachmentFormat != vk::Format::eUndefined) {
-      renderingInfo_.colorAttachmentCount    = (uint32_t)colorFormats_.size();
-      renderingInfo_.pColorAttachmentFormats = colorFormats_.data();
-      renderingInfo_.pNext                   = pipelineNext_;
-      pipelineNext_ = &renderingInfo_;
-    }
     return createUnique(device, pipelineCache, pipelineLayout, vk::RenderPass{}, defaultBlend);
   }
 
+  /// Create info for dynamic rendering (no VkRenderPass). See createInfo above.
+  const vk::GraphicsPipelineCreateInfo &createInfo(const vk::PipelineLayout &pipelineLayout, bool defaultBlend=true) {
+    return createInfo(pipelineLayout, vk::RenderPass{}, defaultBlend);
+  }
+
+  PipelineCacheStats *cacheStats() const { return cacheStats_; }
+
 private:
+  bool hasRenderingFormats() const {
+    return !colorFormats_.empty() ||
+        renderingInfo_.depthAttachmentFormat   != vk::Format::eUndefined ||
+        renderingInfo_.stencilAttachmentFormat != vk::Format::eUndefined;
+  }
+
   vk::PipelineInputAssemblyStateCreateInfo inputAssemblyState_;
   vk::Viewport viewport_;
   vk::Rect2D scissor_;
@@ -1233,6 +1831,12 @@ private:
   vk::PipelineRenderingCreateInfo renderingInfo_{};
   uint32_t subpass_ = 0;
   const void *pipelineNext_ = nullptr;
+  PipelineCacheStats *cacheStats_ = nullptr;
+  // Filled in by createInfo().
+  vk::PipelineViewportStateCreateInfo viewportState_;
+  vk::PipelineVertexInputStateCreateInfo vertexInputState_;
+  vk::PipelineDynamicStateCreateInfo dynState_;
+  vk::GraphicsPipelineCreateInfo pipelineInfo_;
 };
 
 template <typename iterator, typename sentinel>
@@ -1331,80 +1935,641 @@ public:
     return *this;
   }
 
+  /// Record cache hits and misses in stats.
+  ComputePipelineMaker &cacheStats(PipelineCacheStats *stats) { cacheStats_ = stats; return *this; }
+
   /// Create a managed handle to a compute shader.
   vk::UniquePipeline createUnique(vk::Device device, const vk::PipelineCache &pipelineCache, const vk::PipelineLayout &pipelineLayout) {
-    vk::ComputePipelineCreateInfo pipelineInfo{};
+    vk::ComputePipelineCreateInfo pipelineInfo = createInfo(pipelineLayout);
 
-    pipelineInfo.stage = stage_;
-    pipelineInfo.layout = pipelineLayout;
+    vk::PipelineCreationFeedback feedback{};
+    vk::PipelineCreationFeedbackCreateInfo feedbackInfo{};
+    if (cacheStats_) {
+      feedbackInfo.pPipelineCreationFeedback = &feedback;
+      pipelineInfo.pNext = &feedbackInfo;
+    }
 
+    auto start = std::chrono::steady_clock::now();
     auto [ result, pipeline ] = device.createComputePipelineUnique(pipelineCache, pipelineInfo);
     // TODO check result for vk::Result::ePipelineCompileRequiredEXT
+    if (cacheStats_) cacheStats_->record(feedback, start);
     return std::move(pipeline);
   }
+
+  /// Build the create info without creating the pipeline (see PipelineCompiler).
+  vk::ComputePipelineCreateInfo createInfo(const vk::PipelineLayout &pipelineLayout) const {
+    vk::ComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.stage = stage_;
+    pipelineInfo.layout = pipelineLayout;
+    return pipelineInfo;
+  }
+
+  PipelineCacheStats *cacheStats() const { return cacheStats_; }
 private:
   vk::PipelineShaderStageCreateInfo stage_;
   std::unique_ptr<vku::PipelineMaker::SpecData> moduleSpecialization_;
+  PipelineCacheStats *cacheStats_ = nullptr;
 };
 
-/// A generic buffer that may be used as a vertex buffer, uniform buffer or other kinds of memory resident data.
-/// Buffers require memory objects which represent GPU and CPU resources.
-class GenericBuffer {
+/// Compile many pipelines on a pool of worker threads.
+/// Makers are moved into the compiler and each add() returns a future for its pipeline,
+/// so you can start rendering with whatever is ready. Workers take up to batchSize
+/// queued makers at a time and create them with one createGraphicsPipelines or
+/// createComputePipelines call into a private cache. finish() waits for the queue to
+/// drain and merges the private caches into the cache passed to the constructor.
+/// If that cache is shared, pass the mutex that guards it (eg. Framework::pipelineCacheMutex()).
+///
+///   vku::PipelineCompiler compiler(device, fw.pipelineCache(), 0, 8, nullptr, &fw.pipelineCacheMutex());
+///   auto f = compiler.add(std::move(pm), *layout, window.renderPass());
+///   ...
+///   compiler.finish();
+///   vk::UniquePipeline pipeline = f.get();
+class PipelineCompiler {
 public:
-  GenericBuffer() {
+  PipelineCompiler(vk::Device device, vk::PipelineCache pipelineCache, unsigned numThreads = 0, size_t batchSize = 8, PipelineCacheStats *stats = nullptr, std::mutex *pipelineCacheMutex = nullptr)
+  : device_(device), pipelineCache_(pipelineCache), batchSize_(std::max<size_t>(batchSize, 1)), stats_(stats), pipelineCacheMutex_(pipelineCacheMutex) {
+    if (numThreads == 0) numThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    // Seed each thread's cache from the shared one so that warm starts still hit.
+    std::vector<uint8_t> data;
+    if (pipelineCache_) {
+      std::unique_lock<std::mutex> cacheLock;
+      if (pipelineCacheMutex_) cacheLock = std::unique_lock<std::mutex>(*pipelineCacheMutex_);
+      data = device_.getPipelineCacheData(pipelineCache_);
+    }
+    vk::PipelineCacheCreateInfo ci{{}, data.size(), data.data()};
+    for (unsigned i = 0; i != numThreads; ++i) {
+      threadCaches_.push_back(device_.createPipelineCacheUnique(ci));
+    }
+    for (unsigned i = 0; i != numThreads; ++i) {
+      threads_.emplace_back([this, i]() { worker(*threadCaches_[i]); });
+    }
   }
 
-  GenericBuffer(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops, vk::BufferUsageFlags usage, vk::DeviceSize size, vk::MemoryPropertyFlags memflags = vk::MemoryPropertyFlagBits::eDeviceLocal) {
-    // GPU has requirment that buffer be a multiple of 256 bytes, aka nonCoherentAtomSize
-    // see https://vulkan.gpuinfo.org/displaydevicelimit.php?name=nonCoherentAtomSize&platform=all
-    int nonCoherentAtomSize = 256;
-    size_ = ceil(size/float(nonCoherentAtomSize))*nonCoherentAtomSize;
-    // Create the buffer object without memory.
-    vk::BufferCreateInfo ci{};
-    ci.size = size_;
-    ci.usage = usage;
-    ci.sharingMode = vk::SharingMode::eExclusive;
-    buffer_ = device.createBufferUnique(ci);
-
-    // Find out how much memory and which heap to allocate from.
-    auto memreq = device.getBufferMemoryRequirements(*buffer_);
-
-    // Create a memory object to bind to the buffer.
-    vk::MemoryAllocateInfo mai{};
-    mai.allocationSize = memreq.size;
-    mai.memoryTypeIndex = vku::findMemoryTypeIndex(memprops, memreq.memoryTypeBits, memflags);
-    mem_ = device.allocateMemoryUnique(mai);
+  PipelineCompiler(const PipelineCompiler &) = delete;
+  PipelineCompiler &operator=(const PipelineCompiler &) = delete;
+
+  /// Queue a graphics pipeline. Pass a null renderPass for dynamic rendering.
+  std::future<vk::UniquePipeline> add(PipelineMaker &&maker, vk::PipelineLayout pipelineLayout, vk::RenderPass renderPass, bool defaultBlend = true) {
+    Job job;
+    job.graphics = std::make_unique<PipelineMaker>(std::move(maker));
+    job.layout = pipelineLayout;
+    job.renderPass = renderPass;
+    job.defaultBlend = defaultBlend;
+    return push(std::move(job));
+  }
+
+  /// Queue a compute pipeline.
+  std::future<vk::UniquePipeline> add(ComputePipelineMaker &&maker, vk::PipelineLayout pipelineLayout) {
+    Job job;
+    job.compute = std::make_unique<ComputePipelineMaker>(std::move(maker));
+    job.layout = pipelineLayout;
+    return push(std::move(job));
+  }
+
+  /// Block until every queued pipeline is built, then merge the
+  /// per-thread caches into the shared pipeline cache.
+  void finish() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this]() { return queue_.empty() && busy_ == 0; });
+    lock.unlock();
+    if (pipelineCache_) {
+      std::vector<vk::PipelineCache> caches;
+      for (auto &c : threadCaches_) caches.push_back(*c);
+      std::unique_lock<std::mutex> cacheLock;
+      if (pipelineCacheMutex_) cacheLock = std::unique_lock<std::mutex>(*pipelineCacheMutex_);
+      device_.mergePipelineCaches(pipelineCache_, caches);
+    }
+  }
 
-    device.bindBufferMemory(*buffer_, *mem_, 0);
+  /// Number of pipelines queued or being built.
+  size_t pending() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queue_.size() + busy_;
   }
 
-  /// For a host visible buffer, copy memory to the buffer object.
-  void updateLocal(const vk::Device &device, const void *value, vk::DeviceSize size) const {
-    void *ptr = device.mapMemory(*mem_, 0, size_, vk::MemoryMapFlags{});
-    memcpy(ptr, value, (size_t)size);
-    flush(device);
-    device.unmapMemory(*mem_);
+  ~PipelineCompiler() {
+    finish();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      quit_ = true;
+    }
+    work_.notify_all();
+    for (auto &t : threads_) t.join();
   }
 
-  /// For a purely device local buffer, copy memory to the buffer object immediately.
-  /// Note that this will stall the pipeline!
-  void upload(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops, vk::CommandPool commandPool, vk::Queue queue, const void *value, vk::DeviceSize size) const {
-    if (size == 0) return;
-    using buf = vk::BufferUsageFlagBits;
-    using pfb = vk::MemoryPropertyFlagBits;
-    auto tmp = vku::GenericBuffer(device, memprops, buf::eTransferSrc, size, pfb::eHostVisible);
-    tmp.updateLocal(device, value, size);
+private:
+  struct Job {
+    std::unique_ptr<PipelineMaker> graphics;
+    std::unique_ptr<ComputePipelineMaker> compute;
+    vk::PipelineLayout layout;
+    vk::RenderPass renderPass;
+    bool defaultBlend = true;
+    std::promise<vk::UniquePipeline> promise;
+  };
 
-    vku::executeImmediately(device, commandPool, queue, [&](vk::CommandBuffer cb) {
-      vk::BufferCopy bc{0, 0, size};
-      cb.copyBuffer(tmp.buffer(), *buffer_, bc);
-    });
-  }
+  std::future<vk::UniquePipeline> push(Job &&job) {
+    auto future = job.promise.get_future();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back(std::move(job));
+    }
+    work_.notify_one();
+    return future;
+  }
+
+  void worker(vk::PipelineCache cache) {
+    for (;;) {
+      // Take a run of jobs of the same kind from the front of the queue.
+      std::vector<Job> batch;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        work_.wait(lock, [this]() { return quit_ || !queue_.empty(); });
+        if (queue_.empty()) return;
+        bool graphics = queue_.front().graphics != nullptr;
+        while (!queue_.empty() && batch.size() != batchSize_ && (queue_.front().graphics != nullptr) == graphics) {
+          batch.push_back(std::move(queue_.front()));
+          queue_.pop_front();
+        }
+        busy_ += batch.size();
+      }
 
-  template<typename T>
-  void upload(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops, vk::CommandPool commandPool, vk::Queue queue, const std::vector<T> &value) const {
-    upload(device, memprops, commandPool, queue, value.data(), value.size() * sizeof(T));
-  }
+      build(cache, batch);
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        busy_ -= batch.size();
+      }
+      idle_.notify_all();
+    }
+  }
+
+  void build(vk::PipelineCache cache, std::vector<Job> &batch) {
+    size_t n = batch.size();
+    std::vector<vk::PipelineCreationFeedback> feedback(n);
+    std::vector<vk::PipelineCreationFeedbackCreateInfo> feedbackInfo(n);
+    bool wantStats = stats_ != nullptr;
+    for (size_t i = 0; i != n; ++i) {
+      feedbackInfo[i].pPipelineCreationFeedback = &feedback[i];
+      if (batch[i].graphics && batch[i].graphics->cacheStats()) wantStats = true;
+      if (batch[i].compute && batch[i].compute->cacheStats()) wantStats = true;
+    }
+
+    try {
+      auto start = std::chrono::steady_clock::now();
+      std::vector<vk::UniquePipeline> pipelines;
+      if (batch[0].graphics) {
+        std::vector<vk::GraphicsPipelineCreateInfo> infos;
+        for (size_t i = 0; i != n; ++i) {
+          auto &job = batch[i];
+          infos.push_back(job.renderPass ? job.graphics->createInfo(job.layout, job.renderPass, job.defaultBlend) : job.graphics->createInfo(job.layout, job.defaultBlend));
+          if (wantStats) {
+            feedbackInfo[i].pNext = infos.back().pNext;
+            infos.back().pNext = &feedbackInfo[i];
+          }
+        }
+        auto [result, p] = device_.createGraphicsPipelinesUnique(cache, infos);
+        pipelines = std::move(p);
+      } else {
+        std::vector<vk::ComputePipelineCreateInfo> infos;
+        for (size_t i = 0; i != n; ++i) {
+          infos.push_back(batch[i].compute->createInfo(batch[i].layout));
+          if (wantStats) infos.back().pNext = &feedbackInfo[i];
+        }
+        auto [result, p] = device_.createComputePipelinesUnique(cache, infos);
+        pipelines = std::move(p);
+      }
+      auto ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+      for (size_t i = 0; i != n; ++i) {
+        if (wantStats) {
+          // Use the driver's own timing if it gave one, otherwise share out the batch time.
+          uint64_t t = (feedback[i].flags & vk::PipelineCreationFeedbackFlagBits::eValid) ? feedback[i].duration : ns / n;
+          auto *s = batch[i].graphics ? batch[i].graphics->cacheStats() : batch[i].compute->cacheStats();
+          if (s) s->record(feedback[i], t);
+          if (stats_ && stats_ != s) stats_->record(feedback[i], t);
+        }
+        batch[i].promise.set_value(std::move(pipelines[i]));
+      }
+    } catch (...) {
+      for (auto &job : batch) job.promise.set_exception(std::current_exception());
+    }
+  }
+
+  vk::Device device_;
+  vk::PipelineCache pipelineCache_;
+  size_t batchSize_;
+  PipelineCacheStats *stats_;
+  std::mutex *pipelineCacheMutex_;
+  std::vector<vk::UniquePipelineCache> threadCaches_;
+  std::vector<std::thread> threads_;
+  mutable std::mutex mutex_;
+  std::condition_variable work_;
+  std::condition_variable idle_;
+  std::deque<Job> queue_;
+  size_t busy_ = 0;
+  bool quit_ = false;
+};
+
+class MemoryAllocator;
+
+/// A sub-allocated region of device memory handed out by a MemoryAllocator.
+/// The region is returned to the allocator when this object is destroyed.
+class MemoryAllocation {
+public:
+  MemoryAllocation() {
+  }
+
+  MemoryAllocation(MemoryAllocator *allocator, void *block, vk::DeviceMemory memory, vk::DeviceSize offset, vk::DeviceSize size, void *mapped, vk::MemoryPropertyFlags flags) :
+    allocator_(allocator), block_(block), memory_(memory), offset_(offset), size_(size), mapped_(mapped), flags_(flags) {
+  }
+
+  MemoryAllocation(MemoryAllocation &&rhs) {
+    *this = std::move(rhs);
+  }
+
+  MemoryAllocation &operator=(MemoryAllocation &&rhs) {
+    if (this != &rhs) {
+      reset();
+      allocator_ = rhs.allocator_; block_ = rhs.block_; memory_ = rhs.memory_;
+      offset_ = rhs.offset_; size_ = rhs.size_; mapped_ = rhs.mapped_; flags_ = rhs.flags_;
+      rhs.allocator_ = nullptr;
+      rhs.block_ = nullptr;
+    }
+    return *this;
+  }
+
+  MemoryAllocation(const MemoryAllocation &) = delete;
+  MemoryAllocation &operator=(const MemoryAllocation &) = delete;
+
+  ~MemoryAllocation() {
+    reset();
+  }
+
+  /// Give the region back to the allocator.
+  inline void reset();
+
+  explicit operator bool() const { return allocator_ != nullptr; }
+
+  /// The (shared) memory object containing this region.
+  vk::DeviceMemory memory() const { return memory_; }
+
+  /// Offset of this region in memory().
+  vk::DeviceSize offset() const { return offset_; }
+
+  /// Size of this region.
+  vk::DeviceSize size() const { return size_; }
+
+  /// CPU address of the region or nullptr if the memory is not host visible.
+  void *mapped() const { return mapped_; }
+
+  /// Property flags of the memory type.
+  vk::MemoryPropertyFlags flags() const { return flags_; }
+
+  void *block() const { return block_; }
+private:
+  MemoryAllocator *allocator_ = nullptr;
+  void *block_ = nullptr;
+  vk::DeviceMemory memory_;
+  vk::DeviceSize offset_ = 0;
+  vk::DeviceSize size_ = 0;
+  void *mapped_ = nullptr;
+  vk::MemoryPropertyFlags flags_;
+};
+
+/// Sub-allocator for device memory.
+/// Rather than calling allocateMemory for every buffer and image, this carves large
+/// per-memory-type blocks into regions using a coalescing best-fit free list.
+/// This keeps us well below maxMemoryAllocationCount when loading big scenes.
+///
+/// Linear resources (buffers) and optimal-tiling images are kept in separate blocks
+/// when bufferImageGranularity is greater than one so that they never share a page.
+/// Host visible blocks are mapped once when they are created.
+///
+/// The allocator must outlive every buffer and image created with it.
+/// example:
+///     vku::MemoryAllocator allocator{device, physicalDevice};
+///     vku::VertexBuffer vbo{device, memprops, size, &allocator};
+class MemoryAllocator {
+public:
+  /// Statistics for the allocator.
+  struct Stats {
+    uint32_t blockCount = 0;
+    uint32_t allocationCount = 0;
+    uint32_t freeRegionCount = 0;
+    vk::DeviceSize bytesReserved = 0;
+    vk::DeviceSize bytesInUse = 0;
+    vk::DeviceSize largestFreeRegion = 0;
+
+    /// 0 when all the free space is in one region, approaching 1 as it is scattered.
+    float fragmentation() const {
+      vk::DeviceSize freeBytes = bytesReserved - bytesInUse;
+      return freeBytes ? 1.0f - (float)largestFreeRegion / (float)freeBytes : 0.0f;
+    }
+  };
+
+  MemoryAllocator() {
+  }
+
+  MemoryAllocator(vk::Device device, vk::PhysicalDevice physicalDevice, vk::DeviceSize blockSize = 64 * 1024 * 1024) :
+    device_(device), blockSize_(blockSize) {
+    memprops_ = physicalDevice.getMemoryProperties();
+    auto limits = physicalDevice.getProperties().limits;
+    bufferImageGranularity_ = limits.bufferImageGranularity;
+    nonCoherentAtomSize_ = limits.nonCoherentAtomSize;
+  }
+
+  MemoryAllocator(const MemoryAllocator &) = delete;
+  MemoryAllocator &operator=(const MemoryAllocator &) = delete;
+
+  ~MemoryAllocator() {
+    for (auto &b : blocks_) {
+      if (b->mapped) device_.unmapMemory(*b->mem);
+    }
+  }
+
+  /// Allocate a region for a resource with these requirements.
+  /// linear is true for buffers and linear images, false for optimal images.
+  MemoryAllocation allocate(const vk::MemoryRequirements &memreq, vk::MemoryPropertyFlags search, bool linear) {
+    int typeIndex = findMemoryTypeIndex(memprops_, memreq.memoryTypeBits, search);
+    if (typeIndex < 0) throw std::runtime_error("vku::MemoryAllocator: no suitable memory type");
+    auto flags = memprops_.memoryTypes[typeIndex].propertyFlags;
+
+    // Non-coherent regions are padded to nonCoherentAtomSize so that flushes never touch a neighbour.
+    vk::DeviceSize alignment = std::max(memreq.alignment, (vk::DeviceSize)1);
+    vk::DeviceSize size = memreq.size;
+    if ((flags & vk::MemoryPropertyFlagBits::eHostVisible) && !(flags & vk::MemoryPropertyFlagBits::eHostCoherent)) {
+      alignment = std::max(alignment, nonCoherentAtomSize_);
+      size = alignUp(size, nonCoherentAtomSize_);
+    }
+
+    bool shareLinear = bufferImageGranularity_ <= 1;
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // Large resources get a block of their own.
+    if (size > blockSize_ / 2) {
+      Block *b = newBlock((uint32_t)typeIndex, linear, size, true);
+      return takeRegion(b, 0, size);
+    }
+
+    for (auto &b : blocks_) {
+      if (b->dedicated || b->memoryTypeIndex != (uint32_t)typeIndex) continue;
+      if (!shareLinear && b->linear != linear) continue;
+      vk::DeviceSize offset = 0;
+      if (findFree(*b, size, alignment, offset)) {
+        return takeRegion(b.get(), offset, size);
+      }
+    }
+
+    Block *b = newBlock((uint32_t)typeIndex, linear, blockSize_, false);
+    vk::DeviceSize offset = 0;
+    findFree(*b, size, alignment, offset);
+    return takeRegion(b, offset, size);
+  }
+
+  /// Return a region to the free list. Usually called by MemoryAllocation::reset().
+  void free(void *block, vk::DeviceSize offset, vk::DeviceSize size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = std::find_if(blocks_.begin(), blocks_.end(), [block](const std::unique_ptr<Block> &b) { return b.get() == block; });
+    if (it == blocks_.end()) return;
+    Block &b = **it;
+    b.bytesInUse -= size;
+    b.allocationCount--;
+
+    // Release dedicated blocks and surplus empty blocks to the driver.
+    if (b.allocationCount == 0 && (b.dedicated || countBlocks(b.memoryTypeIndex, b.linear) > 1)) {
+      if (b.mapped) device_.unmapMemory(*b.mem);
+      blocks_.erase(it);
+      return;
+    }
+
+    // Coalesce with the neighbouring free regions.
+    auto next = b.freeByOffset.lower_bound(offset);
+    if (next != b.freeByOffset.end() && offset + size == next->first) {
+      size += next->second;
+      eraseFree(b, next->first, next->second);
+    }
+    auto prev = b.freeByOffset.lower_bound(offset);
+    if (prev != b.freeByOffset.begin()) {
+      --prev;
+      if (prev->first + prev->second == offset) {
+        offset = prev->first;
+        size += prev->second;
+        eraseFree(b, prev->first, prev->second);
+      }
+    }
+    insertFree(b, offset, size);
+  }
+
+  /// Get statistics on fragmentation, block count and bytes in use.
+  Stats stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Stats result;
+    for (auto &b : blocks_) {
+      result.blockCount++;
+      result.allocationCount += b->allocationCount;
+      result.bytesReserved += b->size;
+      result.bytesInUse += b->bytesInUse;
+      result.freeRegionCount += (uint32_t)b->freeByOffset.size();
+      if (!b->freeBySize.empty()) {
+        result.largestFreeRegion = std::max(result.largestFreeRegion, b->freeBySize.rbegin()->first);
+      }
+    }
+    return result;
+  }
+
+  /// Print the statistics.
+  void dumpStats(std::ostream &os) const {
+    auto st = stats();
+    os << "MemoryAllocator: " << st.blockCount << " blocks, " << st.allocationCount << " allocations, "
+       << st.bytesInUse << "/" << st.bytesReserved << " bytes in use, "
+       << st.freeRegionCount << " free regions, fragmentation " << st.fragmentation() << "\n";
+  }
+
+  vk::Device device() const { return device_; }
+  vk::DeviceSize nonCoherentAtomSize() const { return nonCoherentAtomSize_; }
+  const vk::PhysicalDeviceMemoryProperties &memprops() const { return memprops_; }
+
+private:
+  struct Block {
+    vk::UniqueDeviceMemory mem;
+    vk::DeviceSize size = 0;
+    vk::DeviceSize bytesInUse = 0;
+    uint32_t allocationCount = 0;
+    uint32_t memoryTypeIndex = 0;
+    bool linear = true;
+    bool dedicated = false;
+    void *mapped = nullptr;
+    std::map<vk::DeviceSize, vk::DeviceSize> freeByOffset;
+    std::multimap<vk::DeviceSize, vk::DeviceSize> freeBySize;
+  };
+
+  static vk::DeviceSize alignUp(vk::DeviceSize value, vk::DeviceSize alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+  }
+
+  Block *newBlock(uint32_t typeIndex, bool linear, vk::DeviceSize size, bool dedicated) {
+    auto b = std::make_unique<Block>();
+    vk::MemoryAllocateInfo mai{size, typeIndex};
+    b->mem = device_.allocateMemoryUnique(mai);
+    b->size = size;
+    b->memoryTypeIndex = typeIndex;
+    b->linear = linear;
+    b->dedicated = dedicated;
+    if (memprops_.memoryTypes[typeIndex].propertyFlags & vk::MemoryPropertyFlagBits::eHostVisible) {
+      b->mapped = device_.mapMemory(*b->mem, 0, VK_WHOLE_SIZE, vk::MemoryMapFlags{});
+    }
+    insertFree(*b, 0, size);
+    blocks_.push_back(std::move(b));
+    return blocks_.back().get();
+  }
+
+  // Best fit: the smallest free region that holds the aligned request.
+  bool findFree(Block &b, vk::DeviceSize size, vk::DeviceSize alignment, vk::DeviceSize &offset) {
+    for (auto it = b.freeBySize.lower_bound(size); it != b.freeBySize.end(); ++it) {
+      vk::DeviceSize start = alignUp(it->second, alignment);
+      if (start + size <= it->second + it->first) {
+        offset = start;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Remove [offset, offset+size) from the free region containing it.
+  MemoryAllocation takeRegion(Block *b, vk::DeviceSize offset, vk::DeviceSize size) {
+    auto it = b->freeByOffset.upper_bound(offset);
+    --it;
+    vk::DeviceSize regionOffset = it->first, regionSize = it->second;
+    eraseFree(*b, regionOffset, regionSize);
+    if (offset > regionOffset) insertFree(*b, regionOffset, offset - regionOffset);
+    vk::DeviceSize end = offset + size, regionEnd = regionOffset + regionSize;
+    if (regionEnd > end) insertFree(*b, end, regionEnd - end);
+
+    b->bytesInUse += size;
+    b->allocationCount++;
+    void *mapped = b->mapped ? (uint8_t*)b->mapped + offset : nullptr;
+    return MemoryAllocation{this, b, *b->mem, offset, size, mapped, memprops_.memoryTypes[b->memoryTypeIndex].propertyFlags};
+  }
+
+  void insertFree(Block &b, vk::DeviceSize offset, vk::DeviceSize size) {
+    b.freeByOffset.emplace(offset, size);
+    b.freeBySize.emplace(size, offset);
+  }
+
+  void eraseFree(Block &b, vk::DeviceSize offset, vk::DeviceSize size) {
+    b.freeByOffset.erase(offset);
+    auto range = b.freeBySize.equal_range(size);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second == offset) { b.freeBySize.erase(it); break; }
+    }
+  }
+
+  size_t countBlocks(uint32_t typeIndex, bool linear) const {
+    return std::count_if(blocks_.begin(), blocks_.end(), [=](const std::unique_ptr<Block> &b) {
+      return !b->dedicated && b->memoryTypeIndex == typeIndex && b->linear == linear;
+    });
+  }
+
+  vk::Device device_;
+  vk::PhysicalDeviceMemoryProperties memprops_;
+  vk::DeviceSize blockSize_ = 0;
+  vk::DeviceSize bufferImageGranularity_ = 1;
+  vk::DeviceSize nonCoherentAtomSize_ = 1;
+  std::vector<std::unique_ptr<Block>> blocks_;
+  mutable std::mutex mutex_;
+};
+
+inline void MemoryAllocation::reset() {
+  if (allocator_) {
+    allocator_->free(block_, offset_, size_);
+    allocator_ = nullptr;
+    block_ = nullptr;
+  }
+}
+
+/// A generic buffer that may be used as a vertex buffer, uniform buffer or other kinds of memory resident data.
+/// Buffers require memory objects which represent GPU and CPU resources.
+class GenericBuffer {
+public:
+  GenericBuffer() {
+  }
+
+  /// If allocator is not null, the memory is sub-allocated from one of its blocks.
+  GenericBuffer(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops, vk::BufferUsageFlags usage, vk::DeviceSize size, vk::MemoryPropertyFlags memflags = vk::MemoryPropertyFlagBits::eDeviceLocal, MemoryAllocator *allocator = nullptr) {
+    // Pad buffers to a multiple of 256 bytes, the usual nonCoherentAtomSize.
+    // see https://vulkan.gpuinfo.org/displaydevicelimit.php?name=nonCoherentAtomSize&platform=all
+    // Flushes do not rely on this; they use the device's limit when it is known (see atomRange).
+    const vk::DeviceSize padding = 256;
+    size_ = (size + padding - 1) / padding * padding;
+    // Create the buffer object without memory.
+    vk::BufferCreateInfo ci{};
+    ci.size = size_;
+    ci.usage = usage;
+    ci.sharingMode = vk::SharingMode::eExclusive;
+    buffer_ = device.createBufferUnique(ci);
+
+    // Find out how much memory and which heap to allocate from.
+    auto memreq = device.getBufferMemoryRequirements(*buffer_);
+
+    if (allocator) {
+      alloc_ = allocator->allocate(memreq, memflags, true);
+      device.bindBufferMemory(*buffer_, alloc_.memory(), alloc_.offset());
+      coherent_ = bool(alloc_.flags() & vk::MemoryPropertyFlagBits::eHostCoherent);
+      atomSize_ = allocator->nonCoherentAtomSize();
+      memSize_ = alloc_.size();
+      return;
+    }
+
+    // Create a memory object to bind to the buffer.
+    vk::MemoryAllocateInfo mai{};
+    mai.allocationSize = memreq.size;
+    mai.memoryTypeIndex = vku::findMemoryTypeIndex(memprops, memreq.memoryTypeBits, memflags);
+    mem_ = device.allocateMemoryUnique(mai);
+    memSize_ = memreq.size;
+    if (mai.memoryTypeIndex < memprops.memoryTypeCount) {
+      coherent_ = bool(memprops.memoryTypes[mai.memoryTypeIndex].propertyFlags & vk::MemoryPropertyFlagBits::eHostCoherent);
+    }
+
+    device.bindBufferMemory(*buffer_, *mem_, 0);
+  }
+
+  /// Persistently mapped buffer. The memory is mapped once here and stays mapped
+  /// for the lifetime of the buffer; write through span() or write() and call
+  /// flushDirty() before the GPU reads it. Flushes are skipped for coherent memory.
+  GenericBuffer(vk::Device device, vk::PhysicalDevice physicalDevice, vk::BufferUsageFlags usage, vk::DeviceSize size, vk::MemoryPropertyFlags memflags = vk::MemoryPropertyFlagBits::eHostVisible, MemoryAllocator *allocator = nullptr)
+    : GenericBuffer(device, physicalDevice.getMemoryProperties(), usage, size, memflags, allocator) {
+    if (!allocator) atomSize_ = physicalDevice.getProperties().limits.nonCoherentAtomSize;
+    mapped_ = alloc_ ? alloc_.mapped() : device.mapMemory(*mem_, 0, VK_WHOLE_SIZE, vk::MemoryMapFlags{});
+  }
+
+  /// For a host visible buffer, copy memory to the buffer object.
+  void updateLocal(const vk::Device &device, const void *value, vk::DeviceSize size) const {
+    void *ptr = map(device);
+    memcpy(ptr, value, (size_t)size);
+    flush(device);
+    unmap(device);
+  }
+
+  /// For a purely device local buffer, copy memory to the buffer object immediately.
+  /// Note that this will stall the pipeline!
+  void upload(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops, vk::CommandPool commandPool, vk::Queue queue, const void *value, vk::DeviceSize size) const {
+    if (size == 0) return;
+    using buf = vk::BufferUsageFlagBits;
+    using pfb = vk::MemoryPropertyFlagBits;
+    auto tmp = vku::GenericBuffer(device, memprops, buf::eTransferSrc, size, pfb::eHostVisible);
+    tmp.updateLocal(device, value, size);
+
+    vku::executeImmediately(device, commandPool, queue, [&](vk::CommandBuffer cb) {
+      vk::BufferCopy bc{0, 0, size};
+      cb.copyBuffer(tmp.buffer(), *buffer_, bc);
+    });
+  }
+
+  template<typename T>
+  void upload(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops, vk::CommandPool commandPool, vk::Queue queue, const std::vector<T> &value) const {
+    upload(device, memprops, commandPool, queue, value.data(), value.size() * sizeof(T));
+  }
 
   template<typename T>
   void upload(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops, vk::CommandPool commandPool, vk::Queue queue, const T &value) const {
@@ -1426,26 +2591,93 @@ public:
     updateLocal(device, (void*)&value, vk::DeviceSize(sizeof(Type)));
   }
 
-  void *map(const vk::Device &device) const { return device.mapMemory(*mem_, 0, size_, vk::MemoryMapFlags{}); };
-  void unmap(const vk::Device &device) const { return device.unmapMemory(*mem_); };
+  /// Sub-allocated and persistently mapped buffers are always mapped, so map() and unmap() are cheap.
+  void *map(const vk::Device &device) const { return mapped_ ? mapped_ : alloc_ ? alloc_.mapped() : device.mapMemory(*mem_, 0, size_, vk::MemoryMapFlags{}); };
+  void unmap(const vk::Device &device) const { if (!alloc_ && !mapped_) device.unmapMemory(*mem_); };
 
+  /// Flush the whole buffer. Does nothing for host coherent memory.
   void flush(const vk::Device &device) const {
-    vk::MappedMemoryRange mr{*mem_, 0, VK_WHOLE_SIZE};
+    if (coherent_) return;
+    vk::MappedMemoryRange mr = alloc_ ? vk::MappedMemoryRange{alloc_.memory(), alloc_.offset(), alloc_.size()} : vk::MappedMemoryRange{*mem_, 0, VK_WHOLE_SIZE};
     return device.flushMappedMemoryRanges(mr);
   }
 
+  /// Flush part of the buffer, widened to nonCoherentAtomSize boundaries.
+  void flush(const vk::Device &device, vk::DeviceSize offset, vk::DeviceSize size) const {
+    if (coherent_ || size == 0) return;
+    device.flushMappedMemoryRanges(atomRange(offset, size));
+  }
+
   void invalidate(const vk::Device &device) const {
-    vk::MappedMemoryRange mr{*mem_, 0, VK_WHOLE_SIZE};
+    if (coherent_) return;
+    vk::MappedMemoryRange mr = alloc_ ? vk::MappedMemoryRange{alloc_.memory(), alloc_.offset(), alloc_.size()} : vk::MappedMemoryRange{*mem_, 0, VK_WHOLE_SIZE};
     return device.invalidateMappedMemoryRanges(mr);
   }
 
+  /// Typed view of a persistently mapped buffer.
+  template<class Type>
+  std::span<Type> span() const {
+    if (!mapped_) throw std::runtime_error("vku::GenericBuffer::span: buffer is not persistently mapped");
+    return std::span<Type>((Type*)mapped_, size_t(size_ / sizeof(Type)));
+  }
+
+  /// Copy into a persistently mapped buffer and mark the range dirty.
+  void write(const void *value, vk::DeviceSize size, vk::DeviceSize offset = 0) {
+    if (!mapped_) throw std::runtime_error("vku::GenericBuffer::write: buffer is not persistently mapped");
+    memcpy((uint8_t*)mapped_ + offset, value, (size_t)size);
+    markDirty(offset, size);
+  }
+
+  /// Record a range written through span() so flushDirty() covers it.
+  void markDirty(vk::DeviceSize offset, vk::DeviceSize size) {
+    if (coherent_ || size == 0) return;
+    dirtyBegin_ = std::min(dirtyBegin_, offset);
+    dirtyEnd_ = std::max(dirtyEnd_, offset + size);
+  }
+
+  /// Flush the union of the dirty ranges, if any, and clear them.
+  void flushDirty(const vk::Device &device) {
+    if (dirtyBegin_ < dirtyEnd_) flush(device, dirtyBegin_, dirtyEnd_ - dirtyBegin_);
+    dirtyBegin_ = std::numeric_limits<vk::DeviceSize>::max();
+    dirtyEnd_ = 0;
+  }
+
+  bool persistentlyMapped() const { return mapped_ != nullptr; }
+  bool coherent() const { return coherent_; }
+
   vk::Buffer buffer() const { return *buffer_; }
-  vk::DeviceMemory mem() const { return *mem_; }
+  vk::DeviceMemory mem() const { return alloc_ ? alloc_.memory() : *mem_; }
   vk::DeviceSize size() const { return size_; }
+
+  /// Offset of the buffer in mem(). Non-zero for sub-allocated buffers.
+  vk::DeviceSize memOffset() const { return alloc_ ? alloc_.offset() : 0; }
 private:
+  // Memory range covering [offset, offset+size) of the buffer, rounded out to
+  // whole atoms and clipped to the end of our memory.
+  vk::MappedMemoryRange atomRange(vk::DeviceSize offset, vk::DeviceSize size) const {
+    // Without the device's atom size only the whole of our dedicated memory is safe.
+    if (!atomSize_) return vk::MappedMemoryRange{mem(), 0, VK_WHOLE_SIZE};
+    vk::DeviceSize base = memOffset();
+    vk::DeviceSize begin = (base + offset) / atomSize_ * atomSize_;
+    vk::DeviceSize end = (base + offset + size + atomSize_ - 1) / atomSize_ * atomSize_;
+    if (end >= base + memSize_) {
+      // Sub-allocations are padded to whole atoms; dedicated memory can use VK_WHOLE_SIZE.
+      return vk::MappedMemoryRange{mem(), begin, alloc_ ? base + memSize_ - begin : VK_WHOLE_SIZE};
+    }
+    return vk::MappedMemoryRange{mem(), begin, end - begin};
+  }
+
+  MemoryAllocation alloc_;
   vk::UniqueBuffer buffer_;
   vk::UniqueDeviceMemory mem_;
   vk::DeviceSize size_;
+  vk::DeviceSize memSize_ = 0;
+  void *mapped_ = nullptr;
+  bool coherent_ = false;
+  // The device's nonCoherentAtomSize, or 0 if it is not known (the memprops constructor).
+  vk::DeviceSize atomSize_ = 0;
+  vk::DeviceSize dirtyBegin_ = std::numeric_limits<vk::DeviceSize>::max();
+  vk::DeviceSize dirtyEnd_ = 0;
 };
 
 /// This class is a specialisation of GenericBuffer for high performance vertex buffers on the GPU.
@@ -1455,7 +2687,7 @@ public:
   VertexBuffer() {
   }
 
-  VertexBuffer(const vk::Device &device, const vk::PhysicalDeviceMemoryProperties &memprops, size_t size) : GenericBuffer(device, memprops, vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eTransferDst, size, vk::MemoryPropertyFlagBits::eDeviceLocal) {
+  VertexBuffer(const vk::Device &device, const vk::PhysicalDeviceMemoryProperties &memprops, size_t size, MemoryAllocator *allocator = nullptr) : GenericBuffer(device, memprops, vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eTransferDst, size, vk::MemoryPropertyFlagBits::eDeviceLocal, allocator) {
   }
 };
 
@@ -1478,7 +2710,7 @@ public:
   IndexBuffer() {
   }
 
-  IndexBuffer(const vk::Device &device, const vk::PhysicalDeviceMemoryProperties &memprops, vk::DeviceSize size) : GenericBuffer(device, memprops, vk::BufferUsageFlagBits::eIndexBuffer | vk::BufferUsageFlagBits::eTransferDst, size, vk::MemoryPropertyFlagBits::eDeviceLocal) {
+  IndexBuffer(const vk::Device &device, const vk::PhysicalDeviceMemoryProperties &memprops, vk::DeviceSize size, MemoryAllocator *allocator = nullptr) : GenericBuffer(device, memprops, vk::BufferUsageFlagBits::eIndexBuffer | vk::BufferUsageFlagBits::eTransferDst, size, vk::MemoryPropertyFlagBits::eDeviceLocal, allocator) {
   }
 };
 
@@ -1503,8 +2735,111 @@ public:
   /// Device uniform buffer.
   ///   default memflags makes local uniform buffer (incompatible with map/unmap)
   /// If want to update buffer using map/unmap, need to override default with memflags set to vk::MemoryPropertyFlagBits::eHostVisible
-  UniformBuffer(const vk::Device &device, const vk::PhysicalDeviceMemoryProperties &memprops, size_t size, vk::MemoryPropertyFlags memflags = vk::MemoryPropertyFlagBits::eDeviceLocal) : GenericBuffer(device, memprops, vk::BufferUsageFlagBits::eUniformBuffer|vk::BufferUsageFlagBits::eTransferDst, (vk::DeviceSize)size, memflags) {
+  UniformBuffer(const vk::Device &device, const vk::PhysicalDeviceMemoryProperties &memprops, size_t size, vk::MemoryPropertyFlags memflags = vk::MemoryPropertyFlagBits::eDeviceLocal, MemoryAllocator *allocator = nullptr) : GenericBuffer(device, memprops, vk::BufferUsageFlagBits::eUniformBuffer|vk::BufferUsageFlagBits::eTransferDst, (vk::DeviceSize)size, memflags, allocator) {
+  }
+};
+
+/// Per-frame linear allocator for uniforms and scratch data.
+/// One persistently mapped buffer is split into numFrames regions. Each frame
+/// bump-allocates from its own region and the region is recycled numFrames
+/// frames later, so there are no cb.updateBuffer copies and no 64K limit.
+/// Bind buffer() as eUniformBufferDynamic or eStorageBufferDynamic and pass
+/// the returned offset as the dynamic offset.
+class FrameArena {
+public:
+  template<class Type>
+  struct Allocation {
+    Type *ptr = nullptr;
+    uint32_t offset = 0;    ///< dynamic offset from the start of buffer()
+    vk::DeviceSize size = 0;
+    operator bool() const { return ptr != nullptr; }
+  };
+
+  FrameArena() {
+  }
+
+  FrameArena(vk::Device device, vk::PhysicalDevice physicalDevice, vk::DeviceSize bytesPerFrame, uint32_t numFrames, vk::BufferUsageFlags usage = vk::BufferUsageFlagBits::eUniformBuffer|vk::BufferUsageFlagBits::eStorageBuffer, MemoryAllocator *allocator = nullptr) {
+    auto limits = physicalDevice.getProperties().limits;
+    // Both limits are powers of two, so the larger one satisfies both.
+    alignment_ = std::max<vk::DeviceSize>({limits.minUniformBufferOffsetAlignment, limits.minStorageBufferOffsetAlignment, 16});
+    frameSize_ = (bytesPerFrame + alignment_ - 1) / alignment_ * alignment_;
+    numFrames_ = std::max(numFrames, 1u);
+    buffer_ = GenericBuffer(device, physicalDevice, usage, frameSize_ * numFrames_, vk::MemoryPropertyFlagBits::eHostVisible, allocator);
+    base_ = (uint8_t*)buffer_.map(device);
+    begin_ = head_ = 0;
+  }
+
+  /// Start writing to frame's region. Only call this once the GPU has finished
+  /// with the work that last used the region; Window::draw does this for you.
+  void beginFrame(uint32_t frame) {
+    frame_ = frame % numFrames_;
+    begin_ = head_ = frame_ * frameSize_;
+  }
+
+  /// Allocate count objects in the current frame's region. Throws if the region is full.
+  template<class Type>
+  Allocation<Type> allocate(size_t count = 1) {
+    auto a = allocateBytes(sizeof(Type) * count, alignof(Type));
+    return Allocation<Type>{(Type*)a.ptr, a.offset, a.size};
+  }
+
+  /// Allocate and copy a value, returning the dynamic offset.
+  template<class Type>
+  uint32_t push(const Type &value) {
+    auto a = allocate<Type>();
+    memcpy((void*)a.ptr, &value, sizeof(Type));
+    return a.offset;
+  }
+
+  Allocation<void> allocateBytes(vk::DeviceSize size, vk::DeviceSize alignment = 1) {
+    vk::DeviceSize align = std::max(alignment, alignment_);
+    vk::DeviceSize offset = (head_ + align - 1) / align * align;
+    if (offset + size > begin_ + frameSize_) {
+      throw std::runtime_error("vku::FrameArena: out of space in frame region");
+    }
+    head_ = offset + size;
+    return Allocation<void>{base_ + offset, (uint32_t)offset, size};
+  }
+
+  /// Make this frame's writes visible to the device. A no-op for coherent memory.
+  void flush(const vk::Device &device) const {
+    if (head_ != begin_) buffer_.flush(device, begin_, head_ - begin_);
+  }
+
+  /// Offset of a frame's region, for command buffers recorded ahead of time.
+  uint32_t frameOffset(uint32_t frame) const { return uint32_t((frame % numFrames_) * frameSize_); }
+
+  vk::Buffer buffer() const { return buffer_.buffer(); }
+  vk::DeviceSize frameSize() const { return frameSize_; }
+  vk::DeviceSize alignment() const { return alignment_; }
+  vk::DeviceSize bytesUsed() const { return head_ - begin_; }
+  uint32_t numFrames() const { return numFrames_; }
+  uint32_t currentFrame() const { return frame_; }
+private:
+  GenericBuffer buffer_;
+  uint8_t *base_ = nullptr;
+  vk::DeviceSize alignment_ = 256;
+  vk::DeviceSize frameSize_ = 0;
+  vk::DeviceSize begin_ = 0;
+  vk::DeviceSize head_ = 0;
+  uint32_t numFrames_ = 1;
+  uint32_t frame_ = 0;
+};
+
+/// Entry points for VK_KHR_push_descriptor, which the loader does not export.
+struct PushDescriptorFns {
+  PushDescriptorFns() {
+  }
+
+  PushDescriptorFns(vk::Device device) {
+    pushDescriptorSet = (PFN_vkCmdPushDescriptorSetKHR)device.getProcAddr("vkCmdPushDescriptorSetKHR");
+    pushDescriptorSetWithTemplate = (PFN_vkCmdPushDescriptorSetWithTemplateKHR)device.getProcAddr("vkCmdPushDescriptorSetWithTemplateKHR");
   }
+
+  bool ok() const { return pushDescriptorSet != nullptr; }
+
+  PFN_vkCmdPushDescriptorSetKHR pushDescriptorSet = nullptr;
+  PFN_vkCmdPushDescriptorSetWithTemplateKHR pushDescriptorSetWithTemplate = nullptr;
 };
 
 /// Convenience class for updating descriptor sets (uniforms)
@@ -1603,6 +2938,23 @@ public:
     device.updateDescriptorSets( descriptorWrites_, descriptorCopies_ );
   }
 
+  /// Push the writes straight into a command buffer (VK_KHR_push_descriptor).
+  /// No descriptor set is needed; the set layout must be made with
+  /// DescriptorSetLayoutMaker::pushDescriptor(). Copies are ignored.
+  void push(const PushDescriptorFns &fns, vk::CommandBuffer cb, vk::PipelineBindPoint bindPoint, vk::PipelineLayout layout, uint32_t set) const {
+    if (!fns.pushDescriptorSet) throw std::runtime_error("vku::DescriptorSetUpdater::push: VK_KHR_push_descriptor not enabled");
+    fns.pushDescriptorSet(static_cast<VkCommandBuffer>(cb), (VkPipelineBindPoint)bindPoint, static_cast<VkPipelineLayout>(layout), set, (uint32_t)descriptorWrites_.size(), (const VkWriteDescriptorSet*)descriptorWrites_.data());
+  }
+
+  /// Forget all writes and copies so the updater can be reused without reallocating.
+  DescriptorSetUpdater &reset() {
+    descriptorWrites_.clear();
+    descriptorCopies_.clear();
+    numBuffers_ = numImages_ = numBufferViews_ = 0;
+    ok_ = true;
+    return *this;
+  }
+
   /// Returns true if the updater is error free.
   bool ok() const { return ok_; }
 private:
@@ -1618,6 +2970,94 @@ private:
   bool ok_ = true;
 };
 
+/// Builds a vk::DescriptorUpdateTemplate that reads descriptors from a packed struct.
+/// The template is made once; each update is then a single call with a pointer
+/// to the struct, with no vk::WriteDescriptorSet arrays to build or parse.
+///
+///   struct Bindings { vk::DescriptorBufferInfo ubo; vk::DescriptorImageInfo tex[2]; };
+///   auto tmpl = vku::DescriptorUpdateTemplateMaker{}
+///     .buffers(0, vk::DescriptorType::eUniformBuffer, offsetof(Bindings, ubo))
+///     .images(1, vk::DescriptorType::eCombinedImageSampler, offsetof(Bindings, tex), 2)
+///     .createUnique(device, descriptorSetLayout);
+///   vku::updateWithTemplate(device, descriptorSet, *tmpl, bindings);
+class DescriptorUpdateTemplateMaker {
+public:
+  DescriptorUpdateTemplateMaker() {
+  }
+
+  /// Add an entry. stride defaults to the size of the info struct for the descriptor type.
+  DescriptorUpdateTemplateMaker &entry(uint32_t binding, uint32_t arrayElement, uint32_t count, vk::DescriptorType type, size_t offset, size_t stride = 0) {
+    if (!stride) stride = defaultStride(type);
+    entries_.emplace_back(binding, arrayElement, count, type, offset, stride);
+    return *this;
+  }
+
+  /// count vk::DescriptorBufferInfo at offset in the struct.
+  DescriptorUpdateTemplateMaker &buffers(uint32_t binding, vk::DescriptorType type, size_t offset, uint32_t count = 1) {
+    return entry(binding, 0, count, type, offset, sizeof(vk::DescriptorBufferInfo));
+  }
+
+  /// count vk::DescriptorImageInfo at offset in the struct.
+  DescriptorUpdateTemplateMaker &images(uint32_t binding, vk::DescriptorType type, size_t offset, uint32_t count = 1) {
+    return entry(binding, 0, count, type, offset, sizeof(vk::DescriptorImageInfo));
+  }
+
+  /// count vk::BufferView at offset in the struct.
+  DescriptorUpdateTemplateMaker &bufferViews(uint32_t binding, vk::DescriptorType type, size_t offset, uint32_t count = 1) {
+    return entry(binding, 0, count, type, offset, sizeof(vk::BufferView));
+  }
+
+  /// Make a template for updating sets with this layout.
+  vk::UniqueDescriptorUpdateTemplate createUnique(vk::Device device, vk::DescriptorSetLayout layout) const {
+    vk::DescriptorUpdateTemplateCreateInfo ci{};
+    ci.descriptorUpdateEntryCount = (uint32_t)entries_.size();
+    ci.pDescriptorUpdateEntries = entries_.data();
+    ci.templateType = vk::DescriptorUpdateTemplateType::eDescriptorSet;
+    ci.descriptorSetLayout = layout;
+    return device.createDescriptorUpdateTemplateUnique(ci);
+  }
+
+  /// Make a template for pushing descriptors to set number "set" of a pipeline layout.
+  vk::UniqueDescriptorUpdateTemplate createUniquePush(vk::Device device, vk::PipelineBindPoint bindPoint, vk::PipelineLayout layout, uint32_t set) const {
+    vk::DescriptorUpdateTemplateCreateInfo ci{};
+    ci.descriptorUpdateEntryCount = (uint32_t)entries_.size();
+    ci.pDescriptorUpdateEntries = entries_.data();
+    ci.templateType = vk::DescriptorUpdateTemplateType::ePushDescriptorsKHR;
+    ci.pipelineBindPoint = bindPoint;
+    ci.pipelineLayout = layout;
+    ci.set = set;
+    return device.createDescriptorUpdateTemplateUnique(ci);
+  }
+private:
+  static size_t defaultStride(vk::DescriptorType type) {
+    using dt = vk::DescriptorType;
+    switch (type) {
+      case dt::eSampler: case dt::eCombinedImageSampler: case dt::eSampledImage:
+      case dt::eStorageImage: case dt::eInputAttachment:
+        return sizeof(vk::DescriptorImageInfo);
+      case dt::eUniformTexelBuffer: case dt::eStorageTexelBuffer:
+        return sizeof(vk::BufferView);
+      default:
+        return sizeof(vk::DescriptorBufferInfo);
+    }
+  }
+
+  std::vector<vk::DescriptorUpdateTemplateEntry> entries_;
+};
+
+/// Update a descriptor set from a packed struct using a template.
+template<class Type>
+void updateWithTemplate(vk::Device device, vk::DescriptorSet set, vk::DescriptorUpdateTemplate tmpl, const Type &data) {
+  device.updateDescriptorSetWithTemplate(set, tmpl, (const void*)&data);
+}
+
+/// Push descriptors from a packed struct using a push template.
+template<class Type>
+void pushWithTemplate(const PushDescriptorFns &fns, vk::CommandBuffer cb, vk::DescriptorUpdateTemplate tmpl, vk::PipelineLayout layout, uint32_t set, const Type &data) {
+  if (!fns.pushDescriptorSetWithTemplate) throw std::runtime_error("vku::pushWithTemplate: VK_KHR_push_descriptor not enabled");
+  fns.pushDescriptorSetWithTemplate(static_cast<VkCommandBuffer>(cb), static_cast<VkDescriptorUpdateTemplate>(tmpl), static_cast<VkPipelineLayout>(layout), set, (const void*)&data);
+}
+
 /// A factory class for descriptor set layouts. (An interface to the shaders)
 class DescriptorSetLayoutMaker {
 public:
@@ -1646,17 +3086,57 @@ public:
     return *this;
   }
 
+  /// Make a layout for VK_KHR_push_descriptor (see DescriptorSetUpdater::push).
+  DescriptorSetLayoutMaker& pushDescriptor() {
+    s.flags |= vk::DescriptorSetLayoutCreateFlagBits::ePushDescriptorKHR;
+    return *this;
+  }
+
+  /// Allow descriptors to be updated while the set is bound (descriptor indexing).
+  /// Sets must come from a pool made with eUpdateAfterBind.
+  DescriptorSetLayoutMaker& updateAfterBind() {
+    s.flags |= vk::DescriptorSetLayoutCreateFlagBits::eUpdateAfterBindPool;
+    return *this;
+  }
+
+  /// Set descriptor indexing flags on the last binding added,
+  /// eg. ePartiallyBound, eUpdateAfterBind or eVariableDescriptorCount.
+  DescriptorSetLayoutMaker& bindingFlags(vk::DescriptorBindingFlags flags) {
+    if (s.bindings.empty()) return *this;
+    s.bindingFlags.resize(s.bindings.size());
+    s.bindingFlags.back() = flags;
+    return *this;
+  }
+
   /// Create a self-deleting descriptor set object.
   vk::UniqueDescriptorSetLayout createUnique(vk::Device device) const {
     vk::DescriptorSetLayoutCreateInfo dsci{};
+    dsci.flags = s.flags;
     dsci.bindingCount = (uint32_t)s.bindings.size();
     dsci.pBindings = s.bindings.data();
+
+    std::vector<vk::DescriptorBindingFlags> flags = s.bindingFlags;
+    vk::DescriptorSetLayoutBindingFlagsCreateInfo bfci{};
+    if (!flags.empty()) {
+      flags.resize(s.bindings.size());
+      bfci.bindingCount = (uint32_t)flags.size();
+      bfci.pBindingFlags = flags.data();
+      dsci.pNext = &bfci;
+    }
     return device.createDescriptorSetLayoutUnique(dsci);
   }
 
+  const std::vector<vk::DescriptorSetLayoutBinding> &bindings() const { return s.bindings; }
+  vk::DescriptorSetLayoutCreateFlags flags() const { return s.flags; }
+
+  /// Flags for binding number i (by position, not binding number).
+  vk::DescriptorBindingFlags bindingFlags(size_t i) const { return i < s.bindingFlags.size() ? s.bindingFlags[i] : vk::DescriptorBindingFlags{}; }
+
 private:
   struct State {
+    vk::DescriptorSetLayoutCreateFlags flags;
     std::vector<vk::DescriptorSetLayoutBinding> bindings;
+    std::vector<vk::DescriptorBindingFlags> bindingFlags;
     std::vector<std::vector<vk::Sampler> > samplers;
     int numSamplers = 0;
   };
@@ -1704,6 +3184,632 @@ private:
   State s;
 };
 
+/// Returns the same vk::DescriptorSetLayout for identical binding lists.
+/// Also remembers how many descriptors of each type a layout uses so that
+/// DescriptorAllocator can size its pools.
+class DescriptorSetLayoutCache {
+public:
+  DescriptorSetLayoutCache() {
+  }
+
+  DescriptorSetLayoutCache(vk::Device device) : device_(device) {
+  }
+
+  /// Get or create the layout for this maker's bindings. Binding order does not matter.
+  vk::DescriptorSetLayout get(const DescriptorSetLayoutMaker &maker) {
+    auto &bindings = maker.bindings();
+    std::vector<size_t> order(bindings.size());
+    for (size_t i = 0; i != order.size(); ++i) order[i] = i;
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return bindings[a].binding < bindings[b].binding; });
+
+    std::vector<uint64_t> key;
+    key.push_back((uint64_t)(VkDescriptorSetLayoutCreateFlags)maker.flags());
+    for (size_t i : order) {
+      auto &b = bindings[i];
+      key.push_back(b.binding);
+      key.push_back((uint64_t)(VkDescriptorBindingFlags)maker.bindingFlags(i));
+      key.push_back((uint64_t)b.descriptorType);
+      key.push_back(b.descriptorCount);
+      key.push_back((uint64_t)(VkShaderStageFlags)b.stageFlags);
+      if (b.pImmutableSamplers) {
+        for (uint32_t s = 0; s != b.descriptorCount; ++s) {
+          key.push_back((uint64_t)(VkSampler)b.pImmutableSamplers[s]);
+        }
+      }
+    }
+
+    auto i = layouts_.find(key);
+    if (i != layouts_.end()) {
+      ++hits_;
+      return *i->second;
+    }
+
+    auto layout = maker.createUnique(device_);
+    auto &sizes = poolSizes_[(VkDescriptorSetLayout)*layout];
+    for (auto &b : bindings) {
+      auto p = std::find_if(sizes.begin(), sizes.end(), [&](const vk::DescriptorPoolSize &s) { return s.type == b.descriptorType; });
+      if (p == sizes.end()) sizes.emplace_back(b.descriptorType, b.descriptorCount);
+      else p->descriptorCount += b.descriptorCount;
+    }
+    return *(layouts_[key] = std::move(layout));
+  }
+
+  /// Descriptors of each type used by a layout made by this cache, or null if it is not ours.
+  const std::vector<vk::DescriptorPoolSize> *poolSizes(vk::DescriptorSetLayout layout) const {
+    auto i = poolSizes_.find((VkDescriptorSetLayout)layout);
+    return i == poolSizes_.end() ? nullptr : &i->second;
+  }
+
+  size_t size() const { return layouts_.size(); }
+  size_t hits() const { return hits_; }
+private:
+  vk::Device device_;
+  std::map<std::vector<uint64_t>, vk::UniqueDescriptorSetLayout> layouts_;
+  std::unordered_map<VkDescriptorSetLayout, std::vector<vk::DescriptorPoolSize>> poolSizes_;
+  size_t hits_ = 0;
+};
+
+/// Allocates descriptor sets from a chain of pools, adding a pool whenever
+/// the current one runs out. Pools are never freed set-by-set; call reset()
+/// to recycle every pool at once, eg. once per frame after the frame's fence.
+/// Keep one allocator per frame in flight for per-frame sets.
+///
+/// Pool sizes start from per-set ratios and, if a DescriptorSetLayoutCache
+/// is given, follow the mix of descriptor types actually allocated and always
+/// hold the layout being allocated. Without a cache, descriptor types outside
+/// the default ratios (eg. acceleration structures) must be added with ratio().
+class DescriptorAllocator {
+public:
+  DescriptorAllocator() {
+  }
+
+  DescriptorAllocator(vk::Device device, uint32_t setsPerPool = 256, const DescriptorSetLayoutCache *layouts = nullptr, vk::DescriptorPoolCreateFlags flags = vk::DescriptorPoolCreateFlags{})
+  : device_(device), setsPerPool_(setsPerPool), layouts_(layouts), flags_(flags) {
+    using dt = vk::DescriptorType;
+    // Descriptors per set in a fresh pool.
+    ratios_ = {
+      {dt::eUniformBuffer, 2.0f}, {dt::eUniformBufferDynamic, 1.0f},
+      {dt::eStorageBuffer, 2.0f}, {dt::eStorageBufferDynamic, 0.5f},
+      {dt::eCombinedImageSampler, 4.0f}, {dt::eSampledImage, 1.0f},
+      {dt::eSampler, 0.5f}, {dt::eStorageImage, 1.0f},
+      {dt::eInputAttachment, 0.5f},
+      {dt::eUniformTexelBuffer, 0.5f}, {dt::eStorageTexelBuffer, 0.5f},
+    };
+  }
+
+  /// Allocate one set. Throws only if a brand new pool can not hold it.
+  vk::DescriptorSet allocate(vk::DescriptorSetLayout layout, const void *pNext = nullptr) {
+    vk::DescriptorSetAllocateInfo dsai{};
+    dsai.descriptorSetCount = 1;
+    dsai.pSetLayouts = &layout;
+    dsai.pNext = pNext;
+
+    auto layoutSizes = layouts_ ? layouts_->poolSizes(layout) : nullptr;
+    // A pool made for this layout is the last resort; earlier pools may just be full.
+    bool fresh = false;
+    if (!current_) current_ = nextPool(layoutSizes, fresh);
+    for (;;) {
+      dsai.descriptorPool = current_;
+      vk::DescriptorSet set;
+      vk::Result result = device_.allocateDescriptorSets(&dsai, &set);
+      if (result == vk::Result::eSuccess) {
+        observe(layout);
+        return set;
+      }
+      bool full = result == vk::Result::eErrorOutOfPoolMemory || result == vk::Result::eErrorFragmentedPool;
+      if (!full || fresh) {
+        throw std::runtime_error("vku::DescriptorAllocator: " + vk::to_string(result));
+      }
+      // This pool is full; chain another and try again.
+      current_ = nextPool(layoutSizes, fresh);
+    }
+  }
+
+  /// Allocate one set per layout.
+  std::vector<vk::DescriptorSet> allocate(const std::vector<vk::DescriptorSetLayout> &layouts) {
+    std::vector<vk::DescriptorSet> result;
+    for (auto l : layouts) result.push_back(allocate(l));
+    return result;
+  }
+
+  /// Return every set to the pools. Only call once the GPU has finished with them.
+  void reset() {
+    for (auto &p : used_) {
+      device_.resetDescriptorPool(*p.pool);
+      free_.push_back(std::move(p));
+    }
+    used_.clear();
+    current_ = vk::DescriptorPool{};
+  }
+
+  /// Number of pools made so far.
+  size_t poolCount() const { return used_.size() + free_.size(); }
+
+  /// Change the starting mix of descriptors per set.
+  DescriptorAllocator &ratio(vk::DescriptorType type, float perSet) {
+    auto p = std::find_if(ratios_.begin(), ratios_.end(), [&](const std::pair<vk::DescriptorType, float> &r) { return r.first == type; });
+    if (p == ratios_.end()) ratios_.emplace_back(type, perSet);
+    else p->second = perSet;
+    return *this;
+  }
+private:
+  void observe(vk::DescriptorSetLayout layout) {
+    ++setsAllocated_;
+    auto sizes = layouts_ ? layouts_->poolSizes(layout) : nullptr;
+    if (!sizes) return;
+    for (auto &s : *sizes) observed_[s.type] += s.descriptorCount;
+  }
+
+  // True if an empty pool with these sizes can hold one set of the layout.
+  static bool fits(const std::vector<vk::DescriptorPoolSize> &pool, const std::vector<vk::DescriptorPoolSize> &layout) {
+    for (auto &l : layout) {
+      auto p = std::find_if(pool.begin(), pool.end(), [&](const vk::DescriptorPoolSize &s) { return s.type == l.type; });
+      if (p == pool.end() || p->descriptorCount < l.descriptorCount) return false;
+    }
+    return true;
+  }
+
+  // Take a recycled pool that can hold the layout (any, if its sizes are unknown),
+  // or make a new one. fresh is set if the pool was made for this layout.
+  vk::DescriptorPool nextPool(const std::vector<vk::DescriptorPoolSize> *layoutSizes, bool &fresh) {
+    for (size_t i = free_.size(); i-- != 0; ) {
+      if (layoutSizes && !fits(free_[i].sizes, *layoutSizes)) continue;
+      used_.push_back(std::move(free_[i]));
+      free_.erase(free_.begin() + i);
+      fresh = false;
+      return *used_.back().pool;
+    }
+
+    // Use the observed mix of types once we have seen some sets, but never
+    // go below the ratios so that unseen layouts still fit.
+    std::vector<vk::DescriptorPoolSize> sizes;
+    for (auto &r : ratios_) {
+      float perSet = r.second;
+      auto o = observed_.find(r.first);
+      if (o != observed_.end() && setsAllocated_) {
+        perSet = std::max(perSet, (float)o->second / setsAllocated_);
+      }
+      sizes.emplace_back(r.first, std::max(1u, (uint32_t)std::ceil(perSet * setsPerPool_)));
+    }
+    for (auto &o : observed_) {
+      if (std::none_of(ratios_.begin(), ratios_.end(), [&](const std::pair<vk::DescriptorType, float> &r) { return r.first == o.first; })) {
+        sizes.emplace_back(o.first, std::max(1u, (uint32_t)std::ceil((float)o.second / setsAllocated_ * setsPerPool_)));
+      }
+    }
+    // Make sure the layout being allocated fits, whatever its types.
+    if (layoutSizes) {
+      for (auto &l : *layoutSizes) {
+        auto p = std::find_if(sizes.begin(), sizes.end(), [&](const vk::DescriptorPoolSize &s) { return s.type == l.type; });
+        if (p == sizes.end()) sizes.push_back(l);
+        else p->descriptorCount = std::max(p->descriptorCount, l.descriptorCount);
+      }
+    }
+
+    vk::DescriptorPoolCreateInfo ci{};
+    ci.flags = flags_;
+    ci.maxSets = setsPerPool_;
+    ci.poolSizeCount = (uint32_t)sizes.size();
+    ci.pPoolSizes = sizes.data();
+    used_.push_back(Pool{device_.createDescriptorPoolUnique(ci), sizes});
+
+    // Each new pool is bigger than the last, up to a point.
+    setsPerPool_ = std::min(setsPerPool_ * 2, 4096u);
+    fresh = true;
+    return *used_.back().pool;
+  }
+
+  struct Pool {
+    vk::UniqueDescriptorPool pool;
+    std::vector<vk::DescriptorPoolSize> sizes;
+  };
+
+  vk::Device device_;
+  uint32_t setsPerPool_ = 256;
+  const DescriptorSetLayoutCache *layouts_ = nullptr;
+  vk::DescriptorPoolCreateFlags flags_;
+  std::vector<std::pair<vk::DescriptorType, float>> ratios_;
+  std::map<vk::DescriptorType, uint64_t> observed_;
+  uint64_t setsAllocated_ = 0;
+  std::vector<Pool> used_;
+  std::vector<Pool> free_;
+  vk::DescriptorPool current_;
+};
+
+/// One large, always bound descriptor set of textures, storage images and
+/// storage buffers, using descriptor indexing (enableDescriptorIndexing).
+/// add*() returns a stable index that shaders use to index the arrays,
+/// typically passed in a push constant:
+///
+///   layout(set = 0, binding = 0) uniform sampler2D textures[];
+///   layout(set = 0, binding = 1, rgba8) uniform image2D images[];
+///   layout(set = 0, binding = 2) buffer Buffers { uint data[]; } buffers[];
+///
+/// Freed indices are reused only after numFrames calls to nextFrame(), so a
+/// frame still in flight never sees its descriptor replaced.
+class BindlessHeap {
+public:
+  enum class Table { Texture = 0, StorageImage = 1, StorageBuffer = 2 };
+
+  BindlessHeap() {
+  }
+
+  BindlessHeap(vk::Device device, uint32_t maxTextures = 4096, uint32_t maxStorageImages = 1024, uint32_t maxStorageBuffers = 4096, uint32_t numFrames = 3, vk::ShaderStageFlags stages = vk::ShaderStageFlagBits::eAll)
+  : device_(device), numFrames_(numFrames) {
+    using dt = vk::DescriptorType;
+    using bf = vk::DescriptorBindingFlagBits;
+    capacity_ = {maxTextures, maxStorageImages, maxStorageBuffers};
+    types_ = {dt::eCombinedImageSampler, dt::eStorageImage, dt::eStorageBuffer};
+
+    auto flags = bf::ePartiallyBound | bf::eUpdateAfterBind | bf::eUpdateUnusedWhilePending;
+    DescriptorSetLayoutMaker dslm;
+    dslm.updateAfterBind();
+    for (uint32_t t = 0; t != 3; ++t) {
+      dslm.buffer(t, types_[t], stages, capacity_[t]).bindingFlags(flags);
+    }
+    layout_ = dslm.createUnique(device);
+
+    std::vector<vk::DescriptorPoolSize> sizes;
+    for (uint32_t t = 0; t != 3; ++t) sizes.emplace_back(types_[t], capacity_[t]);
+    vk::DescriptorPoolCreateInfo ci{};
+    ci.flags = vk::DescriptorPoolCreateFlagBits::eUpdateAfterBind;
+    ci.maxSets = 1;
+    ci.poolSizeCount = (uint32_t)sizes.size();
+    ci.pPoolSizes = sizes.data();
+    pool_ = device.createDescriptorPoolUnique(ci);
+
+    vk::DescriptorSetLayout l = *layout_;
+    vk::DescriptorSetAllocateInfo dsai{*pool_, 1, &l};
+    set_ = device.allocateDescriptorSets(dsai)[0];
+  }
+
+  /// Add a combined image sampler. Returns its index in textures[].
+  uint32_t addTexture(vk::Sampler sampler, vk::ImageView imageView, vk::ImageLayout imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal) {
+    uint32_t index = allocate(Table::Texture);
+    setTexture(index, sampler, imageView, imageLayout);
+    return index;
+  }
+
+  /// Add a storage image. Returns its index in images[].
+  uint32_t addStorageImage(vk::ImageView imageView, vk::ImageLayout imageLayout = vk::ImageLayout::eGeneral) {
+    uint32_t index = allocate(Table::StorageImage);
+    setStorageImage(index, imageView, imageLayout);
+    return index;
+  }
+
+  /// Add a storage buffer. Returns its index in buffers[].
+  uint32_t addStorageBuffer(vk::Buffer buffer, vk::DeviceSize offset = 0, vk::DeviceSize range = VK_WHOLE_SIZE) {
+    uint32_t index = allocate(Table::StorageBuffer);
+    setStorageBuffer(index, buffer, offset, range);
+    return index;
+  }
+
+  /// Replace the descriptor at an index. Safe while the set is bound, but
+  /// frames in flight that use this index will see either version.
+  void setTexture(uint32_t index, vk::Sampler sampler, vk::ImageView imageView, vk::ImageLayout imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal) {
+    vk::DescriptorImageInfo info{sampler, imageView, imageLayout};
+    vk::WriteDescriptorSet w{set_, (uint32_t)Table::Texture, index, 1, types_[0], &info};
+    device_.updateDescriptorSets(w, nullptr);
+  }
+
+  void setStorageImage(uint32_t index, vk::ImageView imageView, vk::ImageLayout imageLayout = vk::ImageLayout::eGeneral) {
+    vk::DescriptorImageInfo info{vk::Sampler{}, imageView, imageLayout};
+    vk::WriteDescriptorSet w{set_, (uint32_t)Table::StorageImage, index, 1, types_[1], &info};
+    device_.updateDescriptorSets(w, nullptr);
+  }
+
+  void setStorageBuffer(uint32_t index, vk::Buffer buffer, vk::DeviceSize offset = 0, vk::DeviceSize range = VK_WHOLE_SIZE) {
+    vk::DescriptorBufferInfo info{buffer, offset, range};
+    vk::WriteDescriptorSet w{set_, (uint32_t)Table::StorageBuffer, index, 1, types_[2], nullptr, &info};
+    device_.updateDescriptorSets(w, nullptr);
+  }
+
+  /// Release an index. It is reused numFrames frames from now.
+  void free(Table table, uint32_t index) {
+    retiring_[(int)table].emplace_back(frame_, index);
+  }
+
+  /// Call once per frame, after waiting for the frame's fence.
+  void nextFrame() {
+    ++frame_;
+    for (int t = 0; t != 3; ++t) {
+      auto &r = retiring_[t];
+      while (!r.empty() && r.front().first + numFrames_ <= frame_) {
+        free_[t].push_back(r.front().second);
+        r.pop_front();
+      }
+    }
+  }
+
+  /// Bind the heap. Do this once per command buffer; no per-draw rebinding needed.
+  void bind(vk::CommandBuffer cb, vk::PipelineBindPoint bindPoint, vk::PipelineLayout pipelineLayout, uint32_t firstSet = 0) const {
+    cb.bindDescriptorSets(bindPoint, pipelineLayout, firstSet, set_, nullptr);
+  }
+
+  vk::DescriptorSetLayout layout() const { return *layout_; }
+  vk::DescriptorSet set() const { return set_; }
+
+  /// Number of live indices in a table.
+  uint32_t size(Table table) const {
+    int t = (int)table;
+    return next_[t] - (uint32_t)free_[t].size() - (uint32_t)retiring_[t].size();
+  }
+
+  uint32_t capacity(Table table) const { return capacity_[(int)table]; }
+private:
+  uint32_t allocate(Table table) {
+    int t = (int)table;
+    if (!free_[t].empty()) {
+      uint32_t index = free_[t].back();
+      free_[t].pop_back();
+      return index;
+    }
+    if (next_[t] == capacity_[t]) throw std::runtime_error("vku::BindlessHeap: table is full");
+    return next_[t]++;
+  }
+
+  vk::Device device_;
+  vk::UniqueDescriptorSetLayout layout_;
+  vk::UniqueDescriptorPool pool_;
+  vk::DescriptorSet set_;
+  std::array<vk::DescriptorType, 3> types_;
+  std::array<uint32_t, 3> capacity_{};
+  std::array<uint32_t, 3> next_{};
+  std::array<std::vector<uint32_t>, 3> free_;
+  std::array<std::deque<std::pair<uint64_t, uint32_t>>, 3> retiring_;
+  uint64_t frame_ = 0;
+  uint32_t numFrames_ = 3;
+};
+
+/// Stages and accesses that use an image in a given layout, for Synchronization2 barriers.
+/// src is true for the use before a barrier (what to wait for), false for the use after it.
+/// Uses that only read need no access mask as the previous use, just an execution dependency.
+inline std::pair<vk::PipelineStageFlags2, vk::AccessFlags2> layoutSync(vk::ImageLayout layout, bool src) {
+  typedef vk::ImageLayout il;
+  typedef vk::PipelineStageFlagBits2 ps;
+  typedef vk::AccessFlagBits2 af;
+  typedef vk::PipelineStageFlags2 psf;
+  typedef vk::AccessFlags2 aff;
+  switch (layout) {
+    case il::eUndefined: return {psf{}, aff{}};
+    case il::eGeneral: return {ps::eComputeShader|ps::eFragmentShader|ps::eTransfer, src ? af::eShaderWrite|af::eTransferWrite : af::eShaderRead|af::eShaderWrite|af::eTransferRead|af::eTransferWrite};
+    case il::eColorAttachmentOptimal: return {ps::eColorAttachmentOutput, src ? aff(af::eColorAttachmentWrite) : af::eColorAttachmentRead|af::eColorAttachmentWrite};
+    case il::eDepthStencilAttachmentOptimal: return {ps::eEarlyFragmentTests|ps::eLateFragmentTests, src ? aff(af::eDepthStencilAttachmentWrite) : af::eDepthStencilAttachmentRead|af::eDepthStencilAttachmentWrite};
+    case il::eDepthStencilReadOnlyOptimal: return {ps::eEarlyFragmentTests|ps::eLateFragmentTests|ps::eFragmentShader, src ? aff{} : af::eDepthStencilAttachmentRead|af::eShaderRead};
+    case il::eShaderReadOnlyOptimal: return {ps::eVertexShader|ps::eFragmentShader|ps::eComputeShader, src ? aff{} : aff(af::eShaderRead)};
+    case il::eTransferSrcOptimal: return {ps::eTransfer, src ? aff{} : aff(af::eTransferRead)};
+    case il::eTransferDstOptimal: return {ps::eTransfer, af::eTransferWrite};
+    case il::ePreinitialized: return {ps::eHost, af::eHostWrite};
+    // Ordered by the acquire and present semaphores. Coming from present we
+    // chain with an acquire semaphore waited on at colour attachment output.
+    case il::ePresentSrcKHR: return {src ? psf(ps::eColorAttachmentOutput) : psf{}, aff{}};
+    default: return {ps::eAllCommands, af::eMemoryRead|af::eMemoryWrite};
+  }
+}
+
+/// Gathers image, buffer and memory barriers and records them with one
+/// pipelineBarrier2 call. Transitions of the same subresources are chained
+/// (A->B then B->C becomes A->C), duplicates are merged and neighbouring mips
+/// or layers with identical barriers are joined.
+/// A transition that overlaps a pending one on other subresources of the same
+/// image starts a new group, recorded as a second pipelineBarrier2 after the first.
+///
+///   vku::BarrierBatch batch;
+///   imageA.transition(batch, vk::ImageLayout::eShaderReadOnlyOptimal);
+///   imageB.transition(batch, vk::ImageLayout::eGeneral);
+///   batch.flush(cb);
+///
+/// flush(cb, false) records a Vulkan 1.0 pipelineBarrier instead, for devices
+/// without synchronization2.
+class BarrierBatch {
+public:
+  BarrierBatch() {
+  }
+
+  /// Add a layout transition with stages and accesses implied by the layouts.
+  BarrierBatch &image(vk::Image image, const vk::ImageSubresourceRange &range, vk::ImageLayout oldLayout, vk::ImageLayout newLayout) {
+    auto src = layoutSync(oldLayout, true);
+    auto dst = layoutSync(newLayout, false);
+    return image(image, range, oldLayout, newLayout, src.first, src.second, dst.first, dst.second);
+  }
+
+  /// Add an image barrier with explicit stages and accesses.
+  BarrierBatch &image(vk::Image image, const vk::ImageSubresourceRange &range, vk::ImageLayout oldLayout, vk::ImageLayout newLayout, vk::PipelineStageFlags2 srcStage, vk::AccessFlags2 srcAccess, vk::PipelineStageFlags2 dstStage, vk::AccessFlags2 dstAccess, uint32_t srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED, uint32_t dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED) {
+    vk::ImageMemoryBarrier2 b{srcStage, srcAccess, dstStage, dstAccess, oldLayout, newLayout, srcQueueFamilyIndex, dstQueueFamilyIndex, image, range};
+    size_t group = groups_.empty() ? 0 : groups_.back();
+
+    // Barriers in a group never overlap, so at most one can cover exactly this range.
+    bool overlaps = false;
+    for (size_t i = group; i != images_.size(); ++i) {
+      auto &e = images_[i];
+      if (!overlap(e, b)) continue;
+      overlaps = true;
+      if (e.subresourceRange != range || e.srcQueueFamilyIndex != srcQueueFamilyIndex || e.dstQueueFamilyIndex != dstQueueFamilyIndex) continue;
+      if (e.newLayout == oldLayout && oldLayout != newLayout) {
+        // Nothing runs between the two, so skip the middle layout.
+        e.newLayout = newLayout;
+        e.dstStageMask = dstStage;
+        e.dstAccessMask = dstAccess;
+        ++merged_;
+        return *this;
+      }
+      if (e.oldLayout == oldLayout && e.newLayout == newLayout) {
+        e.srcStageMask |= srcStage; e.srcAccessMask |= srcAccess;
+        e.dstStageMask |= dstStage; e.dstAccessMask |= dstAccess;
+        ++merged_;
+        return *this;
+      }
+    }
+
+    if (overlaps) {
+      // Two transitions of one subresource in the same call are invalid, so
+      // this one goes in a new group and waits for the stages of the last.
+      for (size_t i = group; i != images_.size(); ++i) {
+        if (overlap(images_[i], b)) b.srcStageMask |= images_[i].dstStageMask;
+      }
+      groups_.push_back(images_.size());
+      images_.push_back(b);
+      return *this;
+    }
+
+    // Join with a barrier for the neighbouring mips or layers.
+    for (size_t i = group; i != images_.size(); ++i) {
+      auto &e = images_[i];
+      if (!sameExceptRange(e, b)) continue;
+      auto &r = e.subresourceRange;
+      if (r.baseArrayLayer == range.baseArrayLayer && r.layerCount == range.layerCount && r.baseMipLevel + r.levelCount == range.baseMipLevel) {
+        r.levelCount += range.levelCount;
+        ++merged_;
+        return *this;
+      }
+      if (r.baseMipLevel == range.baseMipLevel && r.levelCount == range.levelCount && r.baseArrayLayer + r.layerCount == range.baseArrayLayer) {
+        r.layerCount += range.layerCount;
+        ++merged_;
+        return *this;
+      }
+    }
+    images_.push_back(b);
+    return *this;
+  }
+
+  /// Add a buffer barrier. Barriers on the same buffer are combined.
+  BarrierBatch &buffer(vk::Buffer buffer, vk::DeviceSize offset, vk::DeviceSize size, vk::PipelineStageFlags2 srcStage, vk::AccessFlags2 srcAccess, vk::PipelineStageFlags2 dstStage, vk::AccessFlags2 dstAccess, uint32_t srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED, uint32_t dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED) {
+    for (auto &e : buffers_) {
+      if (e.buffer != buffer || e.srcQueueFamilyIndex != srcQueueFamilyIndex || e.dstQueueFamilyIndex != dstQueueFamilyIndex) continue;
+      vk::DeviceSize end = size == VK_WHOLE_SIZE || e.size == VK_WHOLE_SIZE ? VK_WHOLE_SIZE : std::max(e.offset + e.size, offset + size);
+      e.offset = std::min(e.offset, offset);
+      e.size = end == VK_WHOLE_SIZE ? VK_WHOLE_SIZE : end - e.offset;
+      e.srcStageMask |= srcStage; e.srcAccessMask |= srcAccess;
+      e.dstStageMask |= dstStage; e.dstAccessMask |= dstAccess;
+      ++merged_;
+      return *this;
+    }
+    buffers_.emplace_back(srcStage, srcAccess, dstStage, dstAccess, srcQueueFamilyIndex, dstQueueFamilyIndex, buffer, offset, size);
+    return *this;
+  }
+
+  /// Add a global memory barrier. All of these are combined into one.
+  BarrierBatch &memory(vk::PipelineStageFlags2 srcStage, vk::AccessFlags2 srcAccess, vk::PipelineStageFlags2 dstStage, vk::AccessFlags2 dstAccess) {
+    if (memory_.empty()) {
+      memory_.emplace_back(srcStage, srcAccess, dstStage, dstAccess);
+    } else {
+      auto &e = memory_[0];
+      e.srcStageMask |= srcStage; e.srcAccessMask |= srcAccess;
+      e.dstStageMask |= dstStage; e.dstAccessMask |= dstAccess;
+      ++merged_;
+    }
+    return *this;
+  }
+
+  bool empty() const { return images_.empty() && buffers_.empty() && memory_.empty(); }
+
+  const std::vector<vk::ImageMemoryBarrier2> &images() const { return images_; }
+  const std::vector<vk::BufferMemoryBarrier2> &buffers() const { return buffers_; }
+  const std::vector<vk::MemoryBarrier2> &memory() const { return memory_; }
+
+  /// Number of barriers saved by merging since construction.
+  size_t merged() const { return merged_; }
+
+  /// Number of pipeline barrier calls flush() will record.
+  size_t numGroups() const { return empty() ? 0 : groups_.size() + 1; }
+
+  /// Record the barriers and clear the batch. Does nothing if the batch is empty.
+  /// With useSync2 false, records one vkCmdPipelineBarrier per group with the union of the stages.
+  void flush(vk::CommandBuffer cb, bool useSync2 = true) {
+    if (empty()) return;
+    size_t begin = 0;
+    for (size_t g = 0; g <= groups_.size(); ++g) {
+      size_t end = g == groups_.size() ? images_.size() : groups_[g];
+      // Memory and buffer barriers go with the first group.
+      record(cb, useSync2, g == 0, images_.data() + begin, end - begin);
+      begin = end;
+    }
+    clear();
+  }
+
+  void clear() {
+    images_.clear();
+    buffers_.clear();
+    memory_.clear();
+    groups_.clear();
+  }
+private:
+  void record(vk::CommandBuffer cb, bool useSync2, bool first, const vk::ImageMemoryBarrier2 *images, size_t numImages) {
+    static const std::vector<vk::MemoryBarrier2> noMemory;
+    static const std::vector<vk::BufferMemoryBarrier2> noBuffers;
+    auto &memory = first ? memory_ : noMemory;
+    auto &buffers = first ? buffers_ : noBuffers;
+    if (useSync2) {
+      vk::DependencyInfo di{};
+      di.setMemoryBarriers(memory).setBufferMemoryBarriers(buffers);
+      di.imageMemoryBarrierCount = (uint32_t)numImages;
+      di.pImageMemoryBarriers = images;
+      cb.pipelineBarrier2(di);
+    } else {
+      vk::PipelineStageFlags srcStage{}, dstStage{};
+      std::vector<vk::MemoryBarrier> mb;
+      std::vector<vk::BufferMemoryBarrier> bmb;
+      std::vector<vk::ImageMemoryBarrier> imb;
+      for (auto &b : memory) {
+        srcStage |= stage1(b.srcStageMask); dstStage |= stage1(b.dstStageMask);
+        mb.emplace_back(access1(b.srcAccessMask), access1(b.dstAccessMask));
+      }
+      for (auto &b : buffers) {
+        srcStage |= stage1(b.srcStageMask); dstStage |= stage1(b.dstStageMask);
+        bmb.emplace_back(access1(b.srcAccessMask), access1(b.dstAccessMask), b.srcQueueFamilyIndex, b.dstQueueFamilyIndex, b.buffer, b.offset, b.size);
+      }
+      for (size_t i = 0; i != numImages; ++i) {
+        auto &b = images[i];
+        srcStage |= stage1(b.srcStageMask); dstStage |= stage1(b.dstStageMask);
+        imb.emplace_back(access1(b.srcAccessMask), access1(b.dstAccessMask), b.oldLayout, b.newLayout, b.srcQueueFamilyIndex, b.dstQueueFamilyIndex, b.image, b.subresourceRange);
+      }
+      if (!srcStage) srcStage = vk::PipelineStageFlagBits::eTopOfPipe;
+      if (!dstStage) dstStage = vk::PipelineStageFlagBits::eBottomOfPipe;
+      cb.pipelineBarrier(srcStage, dstStage, vk::DependencyFlags{}, mb, bmb, imb);
+    }
+  }
+
+  // True if the barriers touch any of the same subresources.
+  static bool overlap(const vk::ImageMemoryBarrier2 &a, const vk::ImageMemoryBarrier2 &b) {
+    auto &ra = a.subresourceRange, &rb = b.subresourceRange;
+    auto meets = [](uint32_t baseA, uint32_t countA, uint32_t baseB, uint32_t countB) {
+      // VK_REMAINING_MIP_LEVELS and VK_REMAINING_ARRAY_LAYERS run to the end.
+      uint64_t endA = countA == ~0u ? ~0ull : (uint64_t)baseA + countA;
+      uint64_t endB = countB == ~0u ? ~0ull : (uint64_t)baseB + countB;
+      return baseA < endB && baseB < endA;
+    };
+    return a.image == b.image && (ra.aspectMask & rb.aspectMask) &&
+      meets(ra.baseMipLevel, ra.levelCount, rb.baseMipLevel, rb.levelCount) &&
+      meets(ra.baseArrayLayer, ra.layerCount, rb.baseArrayLayer, rb.layerCount);
+  }
+
+  static bool sameExceptRange(const vk::ImageMemoryBarrier2 &a, const vk::ImageMemoryBarrier2 &b) {
+    return a.image == b.image && a.oldLayout == b.oldLayout && a.newLayout == b.newLayout &&
+      a.srcStageMask == b.srcStageMask && a.srcAccessMask == b.srcAccessMask &&
+      a.dstStageMask == b.dstStageMask && a.dstAccessMask == b.dstAccessMask &&
+      a.srcQueueFamilyIndex == b.srcQueueFamilyIndex && a.dstQueueFamilyIndex == b.dstQueueFamilyIndex &&
+      a.subresourceRange.aspectMask == b.subresourceRange.aspectMask;
+  }
+
+  // The Synchronization2 bits below 2^32 have the same values as the original ones.
+  static vk::PipelineStageFlags stage1(vk::PipelineStageFlags2 f) {
+    auto v = (VkPipelineStageFlags2)f;
+    if (v >> 32) return vk::PipelineStageFlagBits::eAllCommands;
+    return vk::PipelineStageFlags((VkPipelineStageFlags)v);
+  }
+
+  static vk::AccessFlags access1(vk::AccessFlags2 f) {
+    auto v = (VkAccessFlags2)f;
+    if (v >> 32) return vk::AccessFlagBits::eMemoryRead|vk::AccessFlagBits::eMemoryWrite;
+    return vk::AccessFlags((VkAccessFlags)v);
+  }
+
+  std::vector<vk::ImageMemoryBarrier2> images_;
+  std::vector<vk::BufferMemoryBarrier2> buffers_;
+  std::vector<vk::MemoryBarrier2> memory_;
+  std::vector<size_t> groups_; // index in images_ where each group after the first starts
+  size_t merged_ = 0;
+};
+
 /// Generic image with a view and memory object.
 /// Vulkan images need a memory object to hold the data and a view object for the GPU to access the data.
 class GenericImage {
@@ -1711,13 +3817,39 @@ public:
   GenericImage() {
   }
 
-  GenericImage(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops, const vk::ImageCreateInfo &info, vk::ImageViewType viewType, vk::ImageAspectFlags aspectMask, bool makeHostImage) {
-    create(device, memprops, info, viewType, aspectMask, makeHostImage);
+  GenericImage(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops, const vk::ImageCreateInfo &info, vk::ImageViewType viewType, vk::ImageAspectFlags aspectMask, bool makeHostImage, MemoryAllocator *allocator = nullptr) {
+    create(device, memprops, info, viewType, aspectMask, makeHostImage, allocator);
+  }
+
+  /// Make the image without any memory, eg. to alias it with other images.
+  /// Call bind() with memory that meets memoryRequirements() before using it.
+  GenericImage(vk::Device device, const vk::ImageCreateInfo &info, vk::ImageViewType viewType, vk::ImageAspectFlags aspectMask) {
+    s.layouts.assign((size_t)info.mipLevels * info.arrayLayers, info.initialLayout);
+    s.info = info;
+    s.image = device.createImageUnique(info);
+    s.viewType = viewType;
+    s.aspect = aspectMask;
+  }
+
+  vk::MemoryRequirements memoryRequirements(vk::Device device) const {
+    return device.getImageMemoryRequirements(*s.image);
+  }
+
+  /// Bind an image made without memory to memory owned by someone else and make its view.
+  void bind(vk::Device device, vk::DeviceMemory memory, vk::DeviceSize offset) {
+    device.bindImageMemory(*s.image, memory, offset);
+    s.external = memory;
+    s.externalOffset = offset;
+    s.size = memoryRequirements(device).size;
+    createView(device, s.viewType, s.aspect);
   }
 
   vk::Image image() const { return *s.image; }
   vk::ImageView imageView() const { return *s.imageView; }
-  vk::DeviceMemory mem() const { return *s.mem; }
+  vk::DeviceMemory mem() const { return s.alloc ? s.alloc.memory() : s.mem ? *s.mem : s.external; }
+
+  /// Offset of the image in mem(). Non-zero for sub-allocated images.
+  vk::DeviceSize memOffset() const { return s.alloc ? s.alloc.offset() : s.mem ? 0 : s.externalOffset; }
 
   /// Clear the colour of an image.
   void clear(vk::CommandBuffer cb, const std::array<float,4> colour = {1, 1, 1, 1}) {
@@ -1730,12 +3862,13 @@ public:
   /// Update the image with an array of pixels. (Currently 2D only)
   void update(vk::Device device, const void *data, vk::DeviceSize bytesPerPixel) {
     const uint8_t *src = (const uint8_t *)data;
+    uint8_t *base = s.alloc ? (uint8_t *)s.alloc.mapped() : (uint8_t *)device.mapMemory(*s.mem, 0, s.size, vk::MemoryMapFlags{});
     for (uint32_t mipLevel = 0; mipLevel != info().mipLevels; ++mipLevel) {
       // Array images are layed out horizontally. eg. [left][front][right] etc.
       for (uint32_t arrayLayer = 0; arrayLayer != info().arrayLayers; ++arrayLayer) {
         vk::ImageSubresource subresource{vk::ImageAspectFlagBits::eColor, mipLevel, arrayLayer};
         auto srlayout = device.getImageSubresourceLayout(*s.image, subresource);
-        uint8_t *dest = (uint8_t *)device.mapMemory(*s.mem, 0, s.size, vk::MemoryMapFlags{}) + srlayout.offset;
+        uint8_t *dest = base + srlayout.offset;
         size_t bytesPerLine = s.info.extent.width * bytesPerPixel;
         size_t srcStride = bytesPerLine * info().arrayLayers;
         for (int y = 0; y != s.info.extent.height; ++y) {
@@ -1745,7 +3878,7 @@ public:
         }
       }
     }
-    device.unmapMemory(*s.mem);
+    if (!s.alloc) device.unmapMemory(*s.mem);
   }
 
   /// Copy another image to this one. This also changes the layout.
@@ -1781,93 +3914,84 @@ public:
 
     // Copy the staging buffer to the GPU texture and set the layout.
     vku::executeImmediately(device, commandPool, queue, [&](vk::CommandBuffer cb) {
-      auto bp = getBlockParams(s.info.format);
-      vk::Buffer buf = stagingBuffer.buffer();
-      uint32_t offset = 0;
-      for (uint32_t mipLevel = 0; mipLevel != s.info.mipLevels; ++mipLevel) {
-        auto width = mipScale(s.info.extent.width, mipLevel);
-        auto height = mipScale(s.info.extent.height, mipLevel);
-        auto depth = mipScale(s.info.extent.depth, mipLevel);
-        for (uint32_t face = 0; face != s.info.arrayLayers; ++face) {
-          copy(cb, buf, mipLevel, face, width, height, depth, offset);
-          offset += ((bp.bytesPerBlock + 3) & ~3) * (width * height);
-        }
-      }
-      setLayout(cb, finalLayout);
+      copyMips(cb, stagingBuffer.buffer(), 0, finalLayout);
     });
   }
 
+  /// Record copies of every mip level and layer from a packed buffer, then set the layout.
+  /// The buffer layout is the same as used by upload().
+  void copyMips(vk::CommandBuffer cb, vk::Buffer buf, uint32_t bufferOffset, vk::ImageLayout finalLayout=vk::ImageLayout::eShaderReadOnlyOptimal) {
+    auto bp = getBlockParams(s.info.format);
+    uint32_t offset = bufferOffset;
+    for (uint32_t mipLevel = 0; mipLevel != s.info.mipLevels; ++mipLevel) {
+      auto width = mipScale(s.info.extent.width, mipLevel);
+      auto height = mipScale(s.info.extent.height, mipLevel);
+      auto depth = mipScale(s.info.extent.depth, mipLevel);
+      for (uint32_t face = 0; face != s.info.arrayLayers; ++face) {
+        copy(cb, buf, mipLevel, face, width, height, depth, offset);
+        offset += ((bp.bytesPerBlock + 3) & ~3) * (width * height);
+      }
+    }
+    setLayout(cb, finalLayout);
+  }
+
   /// Change the layout of this image using a memory barrier.
+  /// Only subresources not already in newLayout are transitioned.
   void setLayout(vk::CommandBuffer cb, vk::ImageLayout newLayout, vk::ImageAspectFlags aspectMask = vk::ImageAspectFlagBits::eColor) {
-    if (newLayout == s.currentLayout) return;
-    vk::ImageLayout oldLayout = s.currentLayout;
-    s.currentLayout = newLayout;
-
-    vk::ImageMemoryBarrier imageMemoryBarriers = {};
-    imageMemoryBarriers.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    imageMemoryBarriers.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    imageMemoryBarriers.oldLayout = oldLayout;
-    imageMemoryBarriers.newLayout = newLayout;
-    imageMemoryBarriers.image = *s.image;
-    imageMemoryBarriers.subresourceRange = {aspectMask, 0, s.info.mipLevels, 0, s.info.arrayLayers};
-
-    // Put barrier on top
-    // https://www.khronos.org/registry/vulkan/specs/1.2/html/chap7.html#synchronization-access-types-supported
-    vk::PipelineStageFlags srcStageMask{vk::PipelineStageFlagBits::eTopOfPipe};
-    vk::PipelineStageFlags dstStageMask{vk::PipelineStageFlagBits::eTopOfPipe};
-    vk::DependencyFlags dependencyFlags{};
-    vk::AccessFlags srcMask{};
-    vk::AccessFlags dstMask{};
-
-    typedef vk::ImageLayout il;
-    typedef vk::AccessFlagBits afb;
-
-    // Is it me, or are these the same?
-    switch (oldLayout) {
-      case il::eUndefined: break;
-      case il::eGeneral: srcMask = afb::eShaderWrite|afb::eTransferWrite; srcStageMask=vk::PipelineStageFlagBits::eComputeShader|vk::PipelineStageFlagBits::eTransfer; break;
-      case il::eColorAttachmentOptimal: srcMask = afb::eColorAttachmentWrite; srcStageMask=vk::PipelineStageFlagBits::eColorAttachmentOutput; break;
-      case il::eDepthStencilAttachmentOptimal: srcMask = afb::eDepthStencilAttachmentWrite; srcStageMask=vk::PipelineStageFlagBits::eEarlyFragmentTests; break;
-      case il::eDepthStencilReadOnlyOptimal: srcMask = afb::eDepthStencilAttachmentRead; srcStageMask=vk::PipelineStageFlagBits::eEarlyFragmentTests; break;
-      case il::eShaderReadOnlyOptimal: srcMask = afb::eShaderRead; srcStageMask=vk::PipelineStageFlagBits::eVertexShader; break;
-      case il::eTransferSrcOptimal: srcMask = afb::eTransferRead; srcStageMask=vk::PipelineStageFlagBits::eTransfer; break;
-      case il::eTransferDstOptimal: srcMask = afb::eTransferWrite; srcStageMask=vk::PipelineStageFlagBits::eTransfer; break;
-      case il::ePreinitialized: srcMask = afb::eTransferWrite|afb::eHostWrite; srcStageMask=vk::PipelineStageFlagBits::eTransfer|vk::PipelineStageFlagBits::eHost; break;
-      case il::ePresentSrcKHR: srcMask = afb::eMemoryRead; break;
-    }
-
-    switch (newLayout) {
-      case il::eUndefined: break;
-      case il::eGeneral: dstMask = afb::eShaderWrite|afb::eShaderRead|afb::eTransferWrite; dstStageMask=vk::PipelineStageFlagBits::eComputeShader|vk::PipelineStageFlagBits::eTransfer; break;
-      case il::eColorAttachmentOptimal: dstMask = afb::eColorAttachmentWrite; dstStageMask=vk::PipelineStageFlagBits::eColorAttachmentOutput; break;
-      case il::eDepthStencilAttachmentOptimal: dstMask = afb::eDepthStencilAttachmentWrite; dstStageMask=vk::PipelineStageFlagBits::eEarlyFragmentTests; break;
-      case il::eDepthStencilReadOnlyOptimal: dstMask = afb::eDepthStencilAttachmentRead; dstStageMask=vk::PipelineStageFlagBits::eEarlyFragmentTests; break;
-      case il::eShaderReadOnlyOptimal: dstMask = afb::eShaderRead; dstStageMask=vk::PipelineStageFlagBits::eVertexShader; break;
-      case il::eTransferSrcOptimal: dstMask = afb::eTransferRead; dstStageMask=vk::PipelineStageFlagBits::eTransfer; break;
-      case il::eTransferDstOptimal: dstMask = afb::eTransferWrite; dstStageMask=vk::PipelineStageFlagBits::eTransfer; break;
-      case il::ePreinitialized: dstMask = afb::eTransferWrite; dstStageMask=vk::PipelineStageFlagBits::eTransfer; break;
-      case il::ePresentSrcKHR: dstMask = afb::eMemoryRead; break;
-    }
-//printf("%08x %08x\n", (VkFlags)srcMask, (VkFlags)dstMask);
-
-    imageMemoryBarriers.srcAccessMask = srcMask;
-    imageMemoryBarriers.dstAccessMask = dstMask;
-    auto memoryBarriers = nullptr;
-    auto bufferMemoryBarriers = nullptr;
-    cb.pipelineBarrier(srcStageMask, dstStageMask, dependencyFlags, memoryBarriers, bufferMemoryBarriers, imageMemoryBarriers);
+    BarrierBatch batch;
+    transition(batch, newLayout, aspectMask);
+    batch.flush(cb, false);
+  }
+
+  /// Add layout transitions for a range of mips and layers to a batch.
+  /// Runs of subresources that share a layout become a single barrier.
+  void transition(BarrierBatch &batch, vk::ImageLayout newLayout, vk::ImageAspectFlags aspectMask = vk::ImageAspectFlagBits::eColor, uint32_t baseMip = 0, uint32_t mipCount = VK_REMAINING_MIP_LEVELS, uint32_t baseLayer = 0, uint32_t layerCount = VK_REMAINING_ARRAY_LAYERS) {
+    uint32_t mips = s.info.mipLevels, layers = s.info.arrayLayers;
+    uint32_t mipEnd = mipCount == VK_REMAINING_MIP_LEVELS ? mips : std::min(mips, baseMip + mipCount);
+    uint32_t layerEnd = layerCount == VK_REMAINING_ARRAY_LAYERS ? layers : std::min(layers, baseLayer + layerCount);
+    for (uint32_t layer = baseLayer; layer < layerEnd; ++layer) {
+      for (uint32_t mip = baseMip; mip < mipEnd; ) {
+        vk::ImageLayout oldLayout = s.layouts[layer * mips + mip];
+        uint32_t end = mip + 1;
+        while (end < mipEnd && s.layouts[layer * mips + end] == oldLayout) ++end;
+        if (oldLayout != newLayout) {
+          batch.image(*s.image, {aspectMask, mip, end - mip, layer, 1}, oldLayout, newLayout);
+          for (uint32_t m = mip; m != end; ++m) s.layouts[layer * mips + m] = newLayout;
+        }
+        mip = end;
+      }
+    }
   }
 
   /// Set what the image thinks is its current layout (ie. the old layout in an image barrier).
   void setCurrentLayout(vk::ImageLayout oldLayout) {
-    s.currentLayout = oldLayout;
+    std::fill(s.layouts.begin(), s.layouts.end(), oldLayout);
+  }
+
+  /// The tracked layout of one mip of one layer.
+  vk::ImageLayout layout(uint32_t mip = 0, uint32_t layer = 0) const {
+    return s.layouts.empty() ? vk::ImageLayout::eUndefined : s.layouts[layer * s.info.mipLevels + mip];
   }
 
   vk::Format format() const { return s.info.format; }
   vk::Extent3D extent() const { return s.info.extent; }
   const vk::ImageCreateInfo &info() const { return s.info; }
+
+  /// True if the contents only live inside a render pass (eTransientAttachment).
+  /// Attachments like this should be stored with eDontCare.
+  bool transient() const { return bool(s.info.usage & vk::ImageUsageFlagBits::eTransientAttachment); }
+
+  /// True if a transient image got eLazilyAllocated memory.
+  /// On tiled GPUs this memory may never be committed at all.
+  bool lazilyAllocated() const { return s.lazy; }
+
+  /// Bytes of lazily allocated memory the driver has actually committed.
+  vk::DeviceSize committedBytes(vk::Device device) const {
+    return s.lazy ? device.getMemoryCommitment(*s.mem) : s.size;
+  }
 protected:
-  void create(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops, const vk::ImageCreateInfo &info, vk::ImageViewType viewType, vk::ImageAspectFlags aspectMask, bool hostImage) {
-    s.currentLayout = info.initialLayout;
+  void create(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops, const vk::ImageCreateInfo &info, vk::ImageViewType viewType, vk::ImageAspectFlags aspectMask, bool hostImage, MemoryAllocator *allocator = nullptr) {
+    s.layouts.assign((size_t)info.mipLevels * info.arrayLayers, info.initialLayout);
     s.info = info;
     s.image = device.createImageUnique(info);
 
@@ -1876,34 +4000,64 @@ protected:
     vk::MemoryPropertyFlags search{};
     if (hostImage) search = vk::MemoryPropertyFlagBits::eHostCoherent | vk::MemoryPropertyFlagBits::eHostVisible;
 
-    // Create a memory object to bind to the buffer.
-    // Note: we don't expect to be able to map the buffer.
-    vk::MemoryAllocateInfo mai{};
-    mai.allocationSize = s.size = memreq.size;
-    mai.memoryTypeIndex = vku::findMemoryTypeIndex(memprops, memreq.memoryTypeBits, search);
-    s.mem = device.allocateMemoryUnique(mai);
+    // Transient attachments get lazily allocated memory if the device has any,
+    // otherwise they fall back to ordinary memory below.
+    int lazyType = -1;
+    if (!hostImage && (info.usage & vk::ImageUsageFlagBits::eTransientAttachment)) {
+      lazyType = vku::findMemoryTypeIndex(memprops, memreq.memoryTypeBits, vk::MemoryPropertyFlagBits::eLazilyAllocated);
+    }
+    s.lazy = lazyType >= 0;
+
+    if (s.lazy) {
+      // Lazy memory is never sub-allocated; it has to be its own object to be left uncommitted.
+      vk::MemoryAllocateInfo mai{};
+      mai.allocationSize = s.size = memreq.size;
+      mai.memoryTypeIndex = (uint32_t)lazyType;
+      s.mem = device.allocateMemoryUnique(mai);
+      device.bindImageMemory(*s.image, *s.mem, 0);
+    } else if (allocator) {
+      s.size = memreq.size;
+      s.alloc = allocator->allocate(memreq, search, info.tiling == vk::ImageTiling::eLinear);
+      device.bindImageMemory(*s.image, s.alloc.memory(), s.alloc.offset());
+    } else {
+      // Create a memory object to bind to the buffer.
+      // Note: we don't expect to be able to map the buffer.
+      vk::MemoryAllocateInfo mai{};
+      mai.allocationSize = s.size = memreq.size;
+      mai.memoryTypeIndex = vku::findMemoryTypeIndex(memprops, memreq.memoryTypeBits, search);
+      s.mem = device.allocateMemoryUnique(mai);
+
+      device.bindImageMemory(*s.image, *s.mem, 0);
+    }
 
-    device.bindImageMemory(*s.image, *s.mem, 0);
+    if (!hostImage) createView(device, viewType, aspectMask);
+  }
 
-    if (!hostImage) {
-      vk::ImageViewCreateInfo viewInfo{};
-      viewInfo.image = *s.image;
-      viewInfo.viewType = viewType;
-      viewInfo.format = info.format;
-      viewInfo.components = { vk::ComponentSwizzle::eR, vk::ComponentSwizzle::eG, vk::ComponentSwizzle::eB, vk::ComponentSwizzle::eA };
-      viewInfo.subresourceRange = vk::ImageSubresourceRange{aspectMask, 0, info.mipLevels, 0, info.arrayLayers};
-      s.imageView = device.createImageViewUnique(viewInfo);
-    }
+  void createView(vk::Device device, vk::ImageViewType viewType, vk::ImageAspectFlags aspectMask) {
+    vk::ImageViewCreateInfo viewInfo{};
+    viewInfo.image = *s.image;
+    viewInfo.viewType = viewType;
+    viewInfo.format = s.info.format;
+    viewInfo.components = { vk::ComponentSwizzle::eR, vk::ComponentSwizzle::eG, vk::ComponentSwizzle::eB, vk::ComponentSwizzle::eA };
+    viewInfo.subresourceRange = vk::ImageSubresourceRange{aspectMask, 0, s.info.mipLevels, 0, s.info.arrayLayers};
+    s.imageView = device.createImageViewUnique(viewInfo);
   }
 
   struct State {
+    MemoryAllocation alloc;
     vk::UniqueImage image;
     vk::UniqueImageView imageView;
     vk::UniqueDeviceMemory mem;
     vk::DeviceSize size;
-    vk::ImageLayout currentLayout;
+    // Layout of each subresource, indexed by layer * mipLevels + mip.
+    std::vector<vk::ImageLayout> layouts;
     vk::ImageCreateInfo info;
-
+    bool lazy = false;
+    // Memory owned elsewhere, for images made without memory.
+    vk::DeviceMemory external;
+    vk::DeviceSize externalOffset = 0;
+    vk::ImageViewType viewType = vk::ImageViewType::e2D;
+    vk::ImageAspectFlags aspect;
   };
 
   State s;
@@ -1916,7 +4070,7 @@ public:
   TextureImage2D() {
   }
 
-  TextureImage2D(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops, uint32_t width, uint32_t height, uint32_t mipLevels=1, vk::Format format = vk::Format::eR8G8B8A8Unorm, bool hostImage = false) {
+  TextureImage2D(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops, uint32_t width, uint32_t height, uint32_t mipLevels=1, vk::Format format = vk::Format::eR8G8B8A8Unorm, bool hostImage = false, MemoryAllocator *allocator = nullptr) {
     vk::ImageCreateInfo info;
     info.flags = {};
     info.imageType = vk::ImageType::e2D;
@@ -1931,7 +4085,7 @@ public:
     info.queueFamilyIndexCount = 0;
     info.pQueueFamilyIndices = nullptr;
     info.initialLayout = hostImage ? vk::ImageLayout::ePreinitialized : vk::ImageLayout::eUndefined;
-    create(device, memprops, info, vk::ImageViewType::e2D, vk::ImageAspectFlagBits::eColor, hostImage);
+    create(device, memprops, info, vk::ImageViewType::e2D, vk::ImageAspectFlagBits::eColor, hostImage, allocator);
   }
 private:
 };
@@ -1945,7 +4099,8 @@ public:
   TextureImage3D(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops,
                  uint32_t width, uint32_t height, uint32_t depth,
                  uint32_t mipLevels = 1,
-                 vk::Format format = vk::Format::eR8G8B8A8Unorm) {
+                 vk::Format format = vk::Format::eR8G8B8A8Unorm,
+                 MemoryAllocator *allocator = nullptr) {
     vk::ImageCreateInfo info;
     info.flags             = {};
     info.imageType         = vk::ImageType::e3D;
@@ -1963,7 +4118,7 @@ public:
     info.queueFamilyIndexCount = 0;
     info.pQueueFamilyIndices   = nullptr;
     info.initialLayout     = vk::ImageLayout::eUndefined;
-    create(device, memprops, info, vk::ImageViewType::e3D, vk::ImageAspectFlagBits::eColor, false);
+    create(device, memprops, info, vk::ImageViewType::e3D, vk::ImageAspectFlagBits::eColor, false, allocator);
   }
 private:
 };
@@ -1974,7 +4129,7 @@ public:
   TextureImageCube() {
   }
 
-  TextureImageCube(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops, uint32_t width, uint32_t height, uint32_t mipLevels=1, vk::Format format = vk::Format::eR8G8B8A8Unorm, bool hostImage = false) {
+  TextureImageCube(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops, uint32_t width, uint32_t height, uint32_t mipLevels=1, vk::Format format = vk::Format::eR8G8B8A8Unorm, bool hostImage = false, MemoryAllocator *allocator = nullptr) {
     vk::ImageCreateInfo info;
     info.flags = {vk::ImageCreateFlagBits::eCubeCompatible};
     info.imageType = vk::ImageType::e2D;
@@ -1990,18 +4145,20 @@ public:
     info.pQueueFamilyIndices = nullptr;
     info.initialLayout = hostImage ? vk::ImageLayout::ePreinitialized : vk::ImageLayout::eUndefined;
     //info.initialLayout = vk::ImageLayout::ePreinitialized;
-    create(device, memprops, info, vk::ImageViewType::eCube, vk::ImageAspectFlagBits::eColor, hostImage);
+    create(device, memprops, info, vk::ImageViewType::eCube, vk::ImageAspectFlagBits::eColor, hostImage, allocator);
   }
 private:
 };
 
 /// An image to use as a depth buffer on a renderpass.
+/// A transient depth buffer can only be used as an attachment, but
+/// gets lazily allocated memory where available.
 class DepthStencilImage : public GenericImage {
 public:
   DepthStencilImage() {
   }
 
-  DepthStencilImage(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops, uint32_t width, uint32_t height, vk::Format format = vk::Format::eD24UnormS8Uint) {
+  DepthStencilImage(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops, uint32_t width, uint32_t height, vk::Format format = vk::Format::eD24UnormS8Uint, MemoryAllocator *allocator = nullptr, bool transient = false) {
     vk::ImageCreateInfo info;
     info.flags = {};
 
@@ -2014,23 +4171,25 @@ public:
     info.tiling = vk::ImageTiling::eOptimal;
     //TODO: wouldn't "usage" be better supplied as a user function parameter?
     info.usage = vk::ImageUsageFlagBits::eInputAttachment|vk::ImageUsageFlagBits::eDepthStencilAttachment|vk::ImageUsageFlagBits::eTransferSrc|vk::ImageUsageFlagBits::eSampled;
+    if (transient) info.usage = vk::ImageUsageFlagBits::eInputAttachment|vk::ImageUsageFlagBits::eDepthStencilAttachment|vk::ImageUsageFlagBits::eTransientAttachment;
     info.sharingMode = vk::SharingMode::eExclusive;
     info.queueFamilyIndexCount = 0;
     info.pQueueFamilyIndices = nullptr;
     info.initialLayout = vk::ImageLayout::eUndefined;
     typedef vk::ImageAspectFlagBits iafb;
-    create(device, memprops, info, vk::ImageViewType::e2D, iafb::eDepth, false);
+    create(device, memprops, info, vk::ImageViewType::e2D, iafb::eDepth, false, allocator);
   }
 private:
 };
 
 /// An image to use as a colour buffer on a renderpass.
+/// Make it transient for intermediate targets only read as input attachments.
 class ColorAttachmentImage : public GenericImage {
 public:
   ColorAttachmentImage() {
   }
 
-  ColorAttachmentImage(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops, uint32_t width, uint32_t height, vk::Format format = vk::Format::eR8G8B8A8Unorm) {
+  ColorAttachmentImage(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops, uint32_t width, uint32_t height, vk::Format format = vk::Format::eR8G8B8A8Unorm, MemoryAllocator *allocator = nullptr, bool transient = false) {
     vk::ImageCreateInfo info;
     info.flags = {};
 
@@ -2043,12 +4202,13 @@ public:
     info.tiling = vk::ImageTiling::eOptimal;
     //TODO: wouldn't "usage" be better supplied as a user function parameter?
     info.usage = vk::ImageUsageFlagBits::eInputAttachment|vk::ImageUsageFlagBits::eColorAttachment|vk::ImageUsageFlagBits::eTransferSrc|vk::ImageUsageFlagBits::eTransferDst|vk::ImageUsageFlagBits::eSampled;
+    if (transient) info.usage = vk::ImageUsageFlagBits::eInputAttachment|vk::ImageUsageFlagBits::eColorAttachment|vk::ImageUsageFlagBits::eTransientAttachment;
     info.sharingMode = vk::SharingMode::eExclusive;
     info.queueFamilyIndexCount = 0;
     info.pQueueFamilyIndices = nullptr;
     info.initialLayout = vk::ImageLayout::eUndefined;
     typedef vk::ImageAspectFlagBits iafb;
-    create(device, memprops, info, vk::ImageViewType::e2D, iafb::eColor, false);
+    create(device, memprops, info, vk::ImageViewType::e2D, iafb::eColor, false, allocator);
   }
 private:
 };
@@ -2062,7 +4222,7 @@ public:
 
   MsaaImage(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops,
             uint32_t width, uint32_t height, vk::Format format,
-            vk::SampleCountFlagBits samples) {
+            vk::SampleCountFlagBits samples, MemoryAllocator *allocator = nullptr) {
     vk::ImageCreateInfo info;
     info.imageType    = vk::ImageType::e2D;
     info.format       = format;
@@ -2071,14 +4231,14 @@ public:
     info.arrayLayers  = 1;
     info.samples      = samples;
     info.tiling       = vk::ImageTiling::eOptimal;
-    // eTransientAttachment: contents need not survive the render pass — allows lazy allocation
-    // on tile-based GPUs (no bandwidth cost for storing the MSAA buffer).
+    // eTransientAttachment: contents need not survive the render pass, so create()
+    // gives it lazily allocated memory on tile-based GPUs (no memory or bandwidth for the MSAA buffer).
     info.usage        = vk::ImageUsageFlagBits::eColorAttachment |
                         vk::ImageUsageFlagBits::eTransientAttachment;
     info.sharingMode  = vk::SharingMode::eExclusive;
     info.initialLayout = vk::ImageLayout::eUndefined;
     create(device, memprops, info, vk::ImageViewType::e2D,
-           vk::ImageAspectFlagBits::eColor, false);
+           vk::ImageAspectFlagBits::eColor, false, allocator);
   }
 private:
 };
@@ -2322,19 +4482,23 @@ public:
 
     // Copy the staging buffer to the GPU texture and set the layout.
     vku::executeImmediately(device, commandPool, queue, [&](vk::CommandBuffer cb) {
-      vk::Buffer buf = stagingBuffer.buffer();
-      for (uint32_t mipLevel = 0; mipLevel != mipLevels(); ++mipLevel) {
-        auto width = this->width(mipLevel);
-        auto height = this->height(mipLevel);
-        auto depth = this->depth(mipLevel);
-        for (uint32_t face = 0; face != faces(); ++face) {
-          image.copy(cb, buf, mipLevel, face, width, height, depth, offset(mipLevel, 0, face));
-        }
-      }
-      image.setLayout(cb, vk::ImageLayout::eShaderReadOnlyOptimal);
+      copy(cb, image, stagingBuffer.buffer(), 0);
     });
   }
 
+  /// Record copies from a buffer holding the whole KTX file (at bufferOffset) to the image.
+  void copy(vk::CommandBuffer cb, vku::GenericImage &image, vk::Buffer buf, uint32_t bufferOffset, vk::ImageLayout finalLayout=vk::ImageLayout::eShaderReadOnlyOptimal) {
+    for (uint32_t mipLevel = 0; mipLevel != mipLevels(); ++mipLevel) {
+      auto width = this->width(mipLevel);
+      auto height = this->height(mipLevel);
+      auto depth = this->depth(mipLevel);
+      for (uint32_t face = 0; face != faces(); ++face) {
+        image.copy(cb, buf, mipLevel, face, width, height, depth, bufferOffset + offset(mipLevel, 0, face));
+      }
+    }
+    image.setLayout(cb, finalLayout);
+  }
+
 private:
   static void swap(uint32_t &value) {
     value = value >> 24 | (value & 0xff0000) >> 8 | (value & 0xff00) << 8 | value << 24;
@@ -2364,72 +4528,611 @@ private:
   std::vector<uint32_t> imageSizes_;
 };
 
-/// Factory for CommandPool.
-class CommandPoolMaker {
+/// Streams buffer and image uploads through a persistently mapped staging ring.
+/// Uploads are batched into one command buffer until flush() is called and each
+/// upload returns a ticket which can be polled or waited on. Nothing here calls waitIdle,
+/// so rendering can continue while data streams in.
+///
+/// Commands on the same queue after a flush() see the uploaded data, so when
+/// the upload queue is the graphics queue there is no need to wait at all.
+///
+/// If dstQueueFamilyIndex differs from the upload queue's family (eg. a dedicated
+/// transfer queue from Framework) each copy ends with a queue family release barrier.
+/// Call acquire() on a command buffer for the destination queue to record the matching
+/// acquire barriers for every batch that has completed.
+/// example:
+///     vku::UploadQueue uploads{device, fw.memprops(), fw.graphicsQueue(), fw.graphicsQueueFamilyIndex()};
+///     for (auto &t : textures) uploads.upload(t.image, t.bytes);
+///     auto ticket = uploads.flush();
+///     ...
+///     if (uploads.complete(ticket)) { ... }
+class UploadQueue {
 public:
+  typedef uint64_t Ticket;
 
-  /// Set pointer to a structure extending this structure.
-  CommandPoolMaker &pNext(const void *pNext) {
-    cpci_.pNext = pNext;
-    return *this;
-  }
-
-  /// Set flags indicating usage behavior for the pool and command buffers allocated from it
-  CommandPoolMaker &flags(vk::CommandPoolCreateFlags flags) {
-    cpci_.flags = flags;
-    return *this;
+  UploadQueue() {
   }
 
-  /// Set queue family
-  CommandPoolMaker &queueFamilyIndex(uint32_t queueFamilyIndex) {
-    cpci_.queueFamilyIndex = queueFamilyIndex;
-    return *this;
-  }
+  UploadQueue(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops, vk::Queue queue, uint32_t queueFamilyIndex, vk::DeviceSize ringSize = 32 * 1024 * 1024, uint32_t dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED) :
+    device_(device), memprops_(memprops), queue_(queue), srcQueueFamilyIndex_(queueFamilyIndex), dstQueueFamilyIndex_(dstQueueFamilyIndex) {
+    transferOwnership_ = dstQueueFamilyIndex != VK_QUEUE_FAMILY_IGNORED && dstQueueFamilyIndex != queueFamilyIndex;
+    using buf = vk::BufferUsageFlagBits;
+    using pfb = vk::MemoryPropertyFlagBits;
+    staging_ = GenericBuffer(device, memprops, buf::eTransferSrc, ringSize, pfb::eHostVisible|pfb::eHostCoherent);
+    ringSize_ = staging_.size();
+    mapped_ = (uint8_t*)staging_.map(device);
 
-  /// Create a new command pool
-  vk::UniqueCommandPool createUnique(const vk::Device &device) const {
-    return device.createCommandPoolUnique(cpci_);
+    typedef vk::CommandPoolCreateFlagBits ccbits;
+    vk::CommandPoolCreateInfo cpci{ ccbits::eTransient|ccbits::eResetCommandBuffer, queueFamilyIndex };
+    commandPool_ = device.createCommandPoolUnique(cpci);
   }
 
-private:
-  vk::CommandPoolCreateInfo cpci_;
-};
+  UploadQueue(const UploadQueue &) = delete;
+  UploadQueue &operator=(const UploadQueue &) = delete;
 
-/// Factory for ViewPort.
-class ViewPortMaker {
-public:
+  ~UploadQueue() {
+    if (device_) {
+      wait(flush());
+      staging_.unmap(device_);
+    }
+  }
 
-  /// Set viewport origin x.
-  ViewPortMaker &x(float x) {
-    viewport_.x = x;
-    return *this;
+  /// Copy bytes to a device local buffer.
+  Ticket upload(const GenericBuffer &buffer, const void *value, vk::DeviceSize size, vk::DeviceSize dstOffset = 0) {
+    return upload(value, size, [&](vk::CommandBuffer cb, vk::Buffer src, vk::DeviceSize srcOffset) {
+      vk::BufferCopy bc{srcOffset, dstOffset, size};
+      cb.copyBuffer(src, buffer.buffer(), bc);
+      if (transferOwnership_) {
+        vk::BufferMemoryBarrier bmb{vk::AccessFlagBits::eTransferWrite, vk::AccessFlags{}, srcQueueFamilyIndex_, dstQueueFamilyIndex_, buffer.buffer(), dstOffset, size};
+        cb.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eBottomOfPipe, vk::DependencyFlags{}, nullptr, bmb, nullptr);
+        bmb.srcAccessMask = vk::AccessFlags{};
+        bmb.dstAccessMask = vk::AccessFlagBits::eMemoryRead;
+        pending().bufferAcquires.push_back(bmb);
+      }
+    });
   }
 
-  /// Set viewport origin y.
-  ViewPortMaker &y(float y) {
-    viewport_.y = y;
-    return *this;
+  template<typename T>
+  Ticket upload(const GenericBuffer &buffer, const std::vector<T> &value) {
+    return upload(buffer, value.data(), value.size() * sizeof(T));
+  }
+
+  /// Copy all mip levels and layers of an image, packed as for GenericImage::upload.
+  Ticket upload(GenericImage &image, const std::vector<uint8_t> &bytes, vk::ImageLayout finalLayout=vk::ImageLayout::eShaderReadOnlyOptimal) {
+    return upload(bytes.data(), bytes.size(), imageAlignment(image), [&](vk::CommandBuffer cb, vk::Buffer src, vk::DeviceSize srcOffset) {
+      if (transferOwnership_) {
+        image.copyMips(cb, src, (uint32_t)srcOffset, vk::ImageLayout::eTransferDstOptimal);
+        release(cb, image, finalLayout);
+      } else {
+        image.copyMips(cb, src, (uint32_t)srcOffset, finalLayout);
+      }
+    });
   }
 
-  /// Set viewport width.
-  ViewPortMaker &width(float width) {
-    viewport_.width = width;
-    return *this;
+  /// Copy a KTX file to an image.
+  Ticket upload(GenericImage &image, KTXFileLayout &layout, const std::vector<uint8_t> &bytes) {
+    return upload(bytes.data(), bytes.size(), imageAlignment(image), [&](vk::CommandBuffer cb, vk::Buffer src, vk::DeviceSize srcOffset) {
+      if (transferOwnership_) {
+        layout.copy(cb, image, src, (uint32_t)srcOffset, vk::ImageLayout::eTransferDstOptimal);
+        release(cb, image, vk::ImageLayout::eShaderReadOnlyOptimal);
+      } else {
+        layout.copy(cb, image, src, (uint32_t)srcOffset);
+      }
+    });
   }
 
-  /// Set viewport height.
-  ViewPortMaker &height(float height) {
-    viewport_.height = height;
-    return *this;
+  /// Copy bytes into the staging ring and call func to record the transfer commands.
+  /// func gets the staging buffer and the offset of the data within it,
+  /// which is a multiple of alignment (at least 4, as vkCmdCopyBuffer needs).
+  Ticket upload(const void *value, vk::DeviceSize size, const std::function<void (vk::CommandBuffer cb, vk::Buffer src, vk::DeviceSize srcOffset)> &func) {
+    return upload(value, size, 4, func);
+  }
+
+  Ticket upload(const void *value, vk::DeviceSize size, vk::DeviceSize alignment, const std::function<void (vk::CommandBuffer cb, vk::Buffer src, vk::DeviceSize srcOffset)> &func) {
+    vk::Buffer src;
+    vk::DeviceSize srcOffset = 0;
+    if (size > ringSize_ / 2) {
+      // Too big for the ring: use a temporary buffer that lives until the batch retires.
+      using buf = vk::BufferUsageFlagBits;
+      using pfb = vk::MemoryPropertyFlagBits;
+      GenericBuffer tmp(device_, memprops_, buf::eTransferSrc, size, pfb::eHostVisible|pfb::eHostCoherent);
+      tmp.updateLocal(device_, value, size);
+      src = tmp.buffer();
+      pending().oversize.push_back(std::move(tmp));
+    } else {
+      srcOffset = allocate(size, std::lcm(std::max(alignment, (vk::DeviceSize)1), (vk::DeviceSize)4));
+      memcpy(mapped_ + srcOffset, value, (size_t)size);
+      src = staging_.buffer();
+    }
+    func(pending().cb, src, srcOffset);
+    pendingUploads_++;
+    return nextTicket_;
+  }
+
+  /// Submit the current batch and return its ticket.
+  Ticket flush() {
+    if (!recording_) return nextTicket_ - 1;
+    Batch &b = pending_;
+
+    // Make the transfers visible to anything that follows on this queue.
+    vk::MemoryBarrier mb{vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eMemoryRead};
+    b.cb.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eAllCommands, vk::DependencyFlags{}, mb, nullptr, nullptr);
+    b.cb.end();
+
+    device_.resetFences(*b.fence);
+    vk::SubmitInfo submit;
+    submit.commandBufferCount = 1;
+    submit.pCommandBuffers = &b.cb;
+    queue_.submit(submit, *b.fence);
+
+    b.ticket = nextTicket_++;
+    b.ringEnd = head_;
+    inFlight_.push_back(std::move(b));
+    pending_ = Batch{};
+    recording_ = false;
+    pendingUploads_ = 0;
+    return inFlight_.back().ticket;
+  }
+
+  /// Return true if the uploads for this ticket have completed. Does not block.
+  bool complete(Ticket ticket) {
+    retire(false);
+    return ticket <= completedTicket_;
+  }
+
+  /// Block until the uploads for this ticket have completed.
+  void wait(Ticket ticket) {
+    if (recording_ && ticket >= nextTicket_) flush();
+    while (completedTicket_ < ticket && !inFlight_.empty()) {
+      retire(true);
+    }
   }
 
-  /// Set viewport minDepth.
-  ViewPortMaker &minDepth(float minDepth) {
-    viewport_.minDepth = minDepth;
-    return *this;
+  /// Record queue family acquire barriers for all completed batches.
+  /// cb must be for a queue in dstQueueFamilyIndex. Does nothing if ownership is not transferred.
+  void acquire(vk::CommandBuffer cb) {
+    retire(false);
+    if (bufferAcquires_.empty() && imageAcquires_.empty()) return;
+    cb.pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe, vk::PipelineStageFlagBits::eAllCommands, vk::DependencyFlags{}, nullptr, bufferAcquires_, imageAcquires_);
+    bufferAcquires_.clear();
+    imageAcquires_.clear();
   }
 
-  /// Set viewport maxDepth.
+  /// True if copies are released to another queue family.
+  bool transfersOwnership() const { return transferOwnership_; }
+
+  /// Number of uploads recorded but not yet submitted.
+  uint32_t pendingUploads() const { return pendingUploads_; }
+
+  /// The staging ring size in bytes.
+  vk::DeviceSize ringSize() const { return ringSize_; }
+
+private:
+  struct Batch {
+    vk::CommandBuffer cb;
+    vk::UniqueCommandBuffer cbHolder;
+    vk::UniqueFence fence;
+    Ticket ticket = 0;
+    vk::DeviceSize ringEnd = 0;
+    std::vector<GenericBuffer> oversize;
+    std::vector<vk::BufferMemoryBarrier> bufferAcquires;
+    std::vector<vk::ImageMemoryBarrier> imageAcquires;
+  };
+
+  // Release an image in eTransferDstOptimal to the destination family, changing to finalLayout.
+  // The transfer queue may not support shader stages, so the release uses eBottomOfPipe.
+  void release(vk::CommandBuffer cb, GenericImage &image, vk::ImageLayout finalLayout) {
+    auto &info = image.info();
+    vk::ImageMemoryBarrier imb{
+      vk::AccessFlagBits::eTransferWrite, vk::AccessFlags{},
+      vk::ImageLayout::eTransferDstOptimal, finalLayout,
+      srcQueueFamilyIndex_, dstQueueFamilyIndex_, image.image(),
+      {getFormatAspect(info.format), 0, info.mipLevels, 0, info.arrayLayers}
+    };
+    cb.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eBottomOfPipe, vk::DependencyFlags{}, nullptr, nullptr, imb);
+    imb.srcAccessMask = vk::AccessFlags{};
+    imb.dstAccessMask = vk::AccessFlagBits::eShaderRead;
+    pending().imageAcquires.push_back(imb);
+    image.setCurrentLayout(finalLayout);
+  }
+
+  // Get the batch being recorded, starting one if necessary.
+  Batch &pending() {
+    if (!recording_) {
+      if (!free_.empty()) {
+        pending_ = std::move(free_.back());
+        free_.pop_back();
+      } else {
+        vk::CommandBufferAllocateInfo cbai{ *commandPool_, vk::CommandBufferLevel::ePrimary, 1 };
+        pending_.cbHolder = std::move(device_.allocateCommandBuffersUnique(cbai)[0]);
+        pending_.cb = *pending_.cbHolder;
+        pending_.fence = device_.createFenceUnique(vk::FenceCreateInfo{});
+      }
+      pending_.cb.begin(vk::CommandBufferBeginInfo{vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+      recording_ = true;
+    }
+    return pending_;
+  }
+
+  // Retire finished batches. If block is true, wait for the oldest one.
+  void retire(bool block) {
+    while (!inFlight_.empty()) {
+      Batch &b = inFlight_.front();
+      if (block) {
+        auto umax = std::numeric_limits<uint64_t>::max();
+        {vk::Result result = device_.waitForFences(*b.fence, VK_TRUE, umax);}
+        block = false;
+      } else if (device_.getFenceStatus(*b.fence) != vk::Result::eSuccess) {
+        break;
+      }
+      tail_ = b.ringEnd;
+      completedTicket_ = b.ticket;
+      b.oversize.clear();
+      bufferAcquires_.insert(bufferAcquires_.end(), b.bufferAcquires.begin(), b.bufferAcquires.end());
+      imageAcquires_.insert(imageAcquires_.end(), b.imageAcquires.begin(), b.imageAcquires.end());
+      b.bufferAcquires.clear();
+      b.imageAcquires.clear();
+      b.cb.reset(vk::CommandBufferResetFlags{});
+      free_.push_back(std::move(b));
+      inFlight_.pop_front();
+    }
+    if (inFlight_.empty() && !recording_) {
+      head_ = tail_ = 0;
+    }
+  }
+
+  // bufferOffset for image copies must be a multiple of the texel block size and of 4.
+  static vk::DeviceSize imageAlignment(const GenericImage &image) {
+    vk::DeviceSize block = getBlockParams(image.info().format).bytesPerBlock;
+    return std::lcm(std::max(block, (vk::DeviceSize)1), (vk::DeviceSize)4);
+  }
+
+  // Find space in the ring, waiting for old batches if it is full.
+  // alignment need not be a power of two (eg. 12 for R32G32B32 texels).
+  // An allocation never lets head_ catch up with tail_, so head_ == tail_ always
+  // means the ring is empty, even while batches that only used oversize
+  // temporaries are in flight.
+  vk::DeviceSize allocate(vk::DeviceSize size, vk::DeviceSize alignment) {
+    if (size > ringSize_) {
+      throw std::runtime_error("vku::UploadQueue: upload larger than the staging ring");
+    }
+    for (;;) {
+      bool empty = head_ == tail_ || (!recording_ && inFlight_.empty());
+      vk::DeviceSize offset = (head_ + alignment - 1) / alignment * alignment;
+      if (empty) {
+        // Batches still in flight hold no ring space, so restart the ring at 0.
+        for (auto &b : inFlight_) b.ringEnd = 0;
+        head_ = tail_ = 0;
+        offset = 0;
+      }
+      if (empty || head_ > tail_) {
+        if (offset + size <= ringSize_) { head_ = offset + size; return offset; }
+        if (size < tail_) { head_ = size; return 0; }
+      } else if (head_ < tail_) {
+        if (offset + size < tail_) { head_ = offset + size; return offset; }
+      }
+
+      // Full: submit anything pending so that it can retire, then wait for the oldest batch.
+      if (recording_) flush();
+      retire(true);
+    }
+  }
+
+  vk::Device device_;
+  vk::PhysicalDeviceMemoryProperties memprops_;
+  vk::Queue queue_;
+  uint32_t srcQueueFamilyIndex_ = VK_QUEUE_FAMILY_IGNORED;
+  uint32_t dstQueueFamilyIndex_ = VK_QUEUE_FAMILY_IGNORED;
+  bool transferOwnership_ = false;
+  std::vector<vk::BufferMemoryBarrier> bufferAcquires_;
+  std::vector<vk::ImageMemoryBarrier> imageAcquires_;
+  vk::UniqueCommandPool commandPool_;
+  GenericBuffer staging_;
+  uint8_t *mapped_ = nullptr;
+  vk::DeviceSize ringSize_ = 0;
+  vk::DeviceSize head_ = 0;
+  vk::DeviceSize tail_ = 0;
+  Batch pending_;
+  bool recording_ = false;
+  uint32_t pendingUploads_ = 0;
+  std::deque<Batch> inFlight_;
+  std::vector<Batch> free_;
+  Ticket nextTicket_ = 1;
+  Ticket completedTicket_ = 0;
+};
+
+/// Copy images and buffers back to the CPU without stalling.
+/// Copies are recorded into the frame's own command buffer and land in a
+/// host cached ring with one region per frame in flight. The queue never waits
+/// on the GPU itself: beginFrame() must only be called once the slot's last
+/// submit has finished, as in Window's dynamic callback, and hands over what
+/// that submit copied. Tagging a frame with submitted() lets poll() hand its
+/// copies over earlier, as soon as the tag has signalled.
+/// example:
+///     vku::ReadbackQueue readback{device, fw.physicalDevice(), window.numImageIndices()};
+///     ... in the dynamic callback, which draw() calls after waiting for imageIndex:
+///     readback.beginFrame(imageIndex);
+///     readback.copy(cb, field, VK_WHOLE_SIZE, 0, [](const vku::ReadbackQueue::Result &r) { save(r.data, r.size); });
+///     ... after draw():
+///     if (window.timelineSemaphore()) readback.submitted(window.timelineSemaphore(), window.timelineValue());
+///     else readback.submitted(window.commandBufferFences()[imageIndex]);
+///     readback.poll();
+///
+/// Only tag with a fence that the frame's submit signals and that is not reset
+/// before beginFrame() comes round to the slot again.
+///
+/// Without a callback, results go to a single producer, single consumer queue
+/// that another thread can drain with tryPop().
+class ReadbackQueue {
+public:
+  typedef uint64_t Ticket;
+
+  /// A completed copy. data is only valid during the callback.
+  struct Result {
+    Ticket ticket = 0;
+    uint64_t frame = 0;
+    const void *data = nullptr;
+    vk::DeviceSize size = 0;
+  };
+
+  /// A completed copy taken from the queue with tryPop().
+  struct OwnedResult {
+    Ticket ticket = 0;
+    uint64_t frame = 0;
+    std::vector<uint8_t> bytes;
+  };
+
+  typedef std::function<void (const Result &result)> Callback;
+
+  ReadbackQueue() {
+  }
+
+  ReadbackQueue(vk::Device device, vk::PhysicalDevice physicalDevice, uint32_t numFrames = 3, vk::DeviceSize frameSize = 16 * 1024 * 1024, size_t queueSize = 64) :
+    device_(device), frameSize_(frameSize), queue_(std::max(queueSize, (size_t)2)) {
+    using pfb = vk::MemoryPropertyFlagBits;
+    auto memprops = physicalDevice.getMemoryProperties();
+    // Cached memory makes CPU reads fast; fall back to whatever is host visible.
+    vk::MemoryPropertyFlags flags = pfb::eHostVisible|pfb::eHostCached;
+    if (findMemoryTypeIndex(memprops, ~0u, flags) < 0) flags = pfb::eHostVisible;
+    buffer_ = GenericBuffer(device, physicalDevice, vk::BufferUsageFlagBits::eTransferDst, frameSize * numFrames, flags);
+    mapped_ = (uint8_t*)buffer_.map(device);
+    frames_.resize(numFrames);
+  }
+
+  ReadbackQueue(const ReadbackQueue &) = delete;
+  ReadbackQueue &operator=(const ReadbackQueue &) = delete;
+
+  /// Start recording copies for a frame slot.
+  /// The slot's previous submit must have finished (eg. its fence has been waited on);
+  /// any of its copies that poll() has not handed over yet are delivered now.
+  void beginFrame(uint32_t frame) {
+    current_ = frame % frames_.size();
+    auto &f = frames_[current_];
+    if (!f.copies.empty()) deliver(f);
+    f.used = 0;
+    f.fence = vk::Fence{};
+    f.timeline = vk::Semaphore{};
+    f.frame = frameNumber_++;
+  }
+
+  /// Copy part of a buffer. Waits for all earlier writes to the buffer.
+  Ticket copy(vk::CommandBuffer cb, const GenericBuffer &buffer, vk::DeviceSize size = VK_WHOLE_SIZE, vk::DeviceSize offset = 0, const Callback &callback = Callback{}) {
+    if (size == VK_WHOLE_SIZE) size = buffer.size() - offset;
+    vk::DeviceSize dst = allocate(size, 4);
+    vk::BufferMemoryBarrier before{vk::AccessFlagBits::eMemoryWrite, vk::AccessFlagBits::eTransferRead,
+      VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, buffer.buffer(), offset, size};
+    cb.pipelineBarrier(vk::PipelineStageFlagBits::eAllCommands, vk::PipelineStageFlagBits::eTransfer, {}, nullptr, before, nullptr);
+    cb.copyBuffer(buffer.buffer(), buffer_.buffer(), vk::BufferCopy{offset, dst, size});
+    return add(cb, dst, size, callback);
+  }
+
+  /// Copy one mip level and layer of a colour image, tightly packed.
+  /// The image is moved to eTransferSrcOptimal for the copy and then back to its layout.
+  Ticket copy(vk::CommandBuffer cb, GenericImage &image, uint32_t bytesPerPixel = 4, uint32_t mipLevel = 0, uint32_t arrayLayer = 0, const Callback &callback = Callback{}) {
+    auto extent = image.extent();
+    uint32_t w = std::max(extent.width >> mipLevel, 1u);
+    uint32_t h = std::max(extent.height >> mipLevel, 1u);
+    uint32_t d = std::max(extent.depth >> mipLevel, 1u);
+    vk::DeviceSize size = (vk::DeviceSize)w * h * d * bytesPerPixel;
+    // bufferOffset must be a multiple of the texel size and of 4.
+    vk::DeviceSize dst = allocate(size, std::lcm((vk::DeviceSize)std::max(bytesPerPixel, 1u), (vk::DeviceSize)4));
+
+    vk::ImageLayout oldLayout = image.layout(mipLevel, arrayLayer);
+    BarrierBatch batch;
+    image.transition(batch, vk::ImageLayout::eTransferSrcOptimal, vk::ImageAspectFlagBits::eColor, mipLevel, 1, arrayLayer, 1);
+    batch.flush(cb, false);
+    vk::BufferImageCopy region{dst, 0, 0, {vk::ImageAspectFlagBits::eColor, mipLevel, arrayLayer, 1}, {0, 0, 0}, {w, h, d}};
+    cb.copyImageToBuffer(image.image(), vk::ImageLayout::eTransferSrcOptimal, buffer_.buffer(), region);
+    if (oldLayout != vk::ImageLayout::eUndefined && oldLayout != vk::ImageLayout::eTransferSrcOptimal) {
+      image.transition(batch, oldLayout, vk::ImageAspectFlagBits::eColor, mipLevel, 1, arrayLayer, 1);
+      batch.flush(cb, false);
+    }
+    return add(cb, dst, size, callback);
+  }
+
+  /// Tag this frame's copies with the fence of the submit that carries them.
+  /// The fence must be unsignalled until that submit finishes.
+  void submitted(vk::Fence fence) { frames_[current_].fence = fence; }
+
+  /// Tag this frame's copies with a timeline semaphore value instead.
+  void submitted(vk::Semaphore timeline, uint64_t value) {
+    frames_[current_].timeline = timeline;
+    frames_[current_].value = value;
+  }
+
+  /// Deliver the copies of every frame whose fence has signalled. Never blocks.
+  void poll() {
+    for (auto &f : frames_) {
+      if (!f.copies.empty() && signalled(f)) deliver(f);
+    }
+  }
+
+  /// Take a completed copy from the queue. Safe to call from one other thread.
+  bool tryPop(OwnedResult &result) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) return false;
+    result = std::move(queue_[tail]);
+    tail_.store((tail + 1) % queue_.size(), std::memory_order_release);
+    return true;
+  }
+
+  /// Number of results dropped because the queue was full.
+  uint64_t dropped() const { return dropped_; }
+
+  /// The last ticket whose data has been delivered.
+  Ticket completedTicket() const { return completedTicket_; }
+private:
+  struct Copy {
+    Ticket ticket;
+    vk::DeviceSize offset;
+    vk::DeviceSize size;
+    Callback callback;
+  };
+
+  struct Frame {
+    std::vector<Copy> copies;
+    vk::DeviceSize used = 0;
+    vk::Fence fence;
+    vk::Semaphore timeline;
+    uint64_t value = 0;
+    uint64_t frame = 0;
+  };
+
+  vk::DeviceSize allocate(vk::DeviceSize size, vk::DeviceSize alignment) {
+    auto &f = frames_[current_];
+    // Offsets are from the start of the buffer, so align the absolute position.
+    vk::DeviceSize base = current_ * frameSize_;
+    vk::DeviceSize offset = (base + f.used + alignment - 1) / alignment * alignment - base;
+    if (offset + size > frameSize_) throw std::runtime_error("vku::ReadbackQueue: out of space in frame region");
+    f.used = offset + size;
+    return current_ * frameSize_ + offset;
+  }
+
+  Ticket add(vk::CommandBuffer cb, vk::DeviceSize offset, vk::DeviceSize size, const Callback &callback) {
+    // Make the copy visible to the host once the fence signals.
+    vk::BufferMemoryBarrier after{vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eHostRead,
+      VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, buffer_.buffer(), offset, size};
+    cb.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eHost, {}, nullptr, after, nullptr);
+    Ticket ticket = nextTicket_++;
+    frames_[current_].copies.push_back(Copy{ticket, offset, size, callback});
+    return ticket;
+  }
+
+  bool signalled(const Frame &f) const {
+    if (f.fence) return device_.getFenceStatus(f.fence) == vk::Result::eSuccess;
+    if (f.timeline) return device_.getSemaphoreCounterValue(f.timeline) >= f.value;
+    return false;
+  }
+
+  void deliver(Frame &f) {
+    buffer_.invalidate(device_);
+    for (auto &c : f.copies) {
+      Result r{c.ticket, f.frame, mapped_ + c.offset, c.size};
+      if (c.callback) {
+        c.callback(r);
+      } else {
+        push(r);
+      }
+      completedTicket_ = std::max(completedTicket_, c.ticket);
+    }
+    f.copies.clear();
+  }
+
+  void push(const Result &r) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t next = (head + 1) % queue_.size();
+    if (next == tail_.load(std::memory_order_acquire)) {
+      ++dropped_;
+      return;
+    }
+    auto &slot = queue_[head];
+    slot.ticket = r.ticket;
+    slot.frame = r.frame;
+    slot.bytes.assign((const uint8_t*)r.data, (const uint8_t*)r.data + r.size);
+    head_.store(next, std::memory_order_release);
+  }
+
+  vk::Device device_;
+  GenericBuffer buffer_;
+  uint8_t *mapped_ = nullptr;
+  vk::DeviceSize frameSize_ = 0;
+  std::vector<Frame> frames_;
+  size_t current_ = 0;
+  uint64_t frameNumber_ = 0;
+  Ticket nextTicket_ = 1;
+  Ticket completedTicket_ = 0;
+  uint64_t dropped_ = 0;
+  std::vector<OwnedResult> queue_;
+  std::atomic<size_t> head_{0};
+  std::atomic<size_t> tail_{0};
+};
+
+/// Factory for CommandPool.
+class CommandPoolMaker {
+public:
+
+  /// Set pointer to a structure extending this structure.
+  CommandPoolMaker &pNext(const void *pNext) {
+    cpci_.pNext = pNext;
+    return *this;
+  }
+
+  /// Set flags indicating usage behavior for the pool and command buffers allocated from it
+  CommandPoolMaker &flags(vk::CommandPoolCreateFlags flags) {
+    cpci_.flags = flags;
+    return *this;
+  }
+
+  /// Set queue family
+  CommandPoolMaker &queueFamilyIndex(uint32_t queueFamilyIndex) {
+    cpci_.queueFamilyIndex = queueFamilyIndex;
+    return *this;
+  }
+
+  /// Create a new command pool
+  vk::UniqueCommandPool createUnique(const vk::Device &device) const {
+    return device.createCommandPoolUnique(cpci_);
+  }
+
+private:
+  vk::CommandPoolCreateInfo cpci_;
+};
+
+/// Factory for ViewPort.
+class ViewPortMaker {
+public:
+
+  /// Set viewport origin x.
+  ViewPortMaker &x(float x) {
+    viewport_.x = x;
+    return *this;
+  }
+
+  /// Set viewport origin y.
+  ViewPortMaker &y(float y) {
+    viewport_.y = y;
+    return *this;
+  }
+
+  /// Set viewport width.
+  ViewPortMaker &width(float width) {
+    viewport_.width = width;
+    return *this;
+  }
+
+  /// Set viewport height.
+  ViewPortMaker &height(float height) {
+    viewport_.height = height;
+    return *this;
+  }
+
+  /// Set viewport minDepth.
+  ViewPortMaker &minDepth(float minDepth) {
+    viewport_.minDepth = minDepth;
+    return *this;
+  }
+
+  /// Set viewport maxDepth.
   ViewPortMaker &maxDepth(float maxDepth) {
     viewport_.maxDepth = maxDepth;
     return *this;
@@ -2540,17 +5243,1312 @@ public:
     return *this;
   }
 
+  /// Resolve the most recent (multisampled) colour attachment into view.
+  /// Unless storeMultisampled is true, the multisampled image is then not stored.
+  RenderingMaker &resolve(vk::ImageView view,
+                          vk::ResolveModeFlagBits mode = vk::ResolveModeFlagBits::eAverage,
+                          vk::ImageLayout layout = vk::ImageLayout::eColorAttachmentOptimal,
+                          bool storeMultisampled = false) {
+    if (colorAtts_.empty()) {
+      throw std::runtime_error("vku::RenderingMaker: resolve() needs a colour attachment first");
+    }
+    auto &att = colorAtts_.back();
+    att.resolveMode        = mode;
+    att.resolveImageView   = view;
+    att.resolveImageLayout = layout;
+    att.storeOp            = storeMultisampled ? vk::AttachmentStoreOp::eStore : vk::AttachmentStoreOp::eDontCare;
+    return *this;
+  }
+
+  /// Depth attachment cleared to depth. Transient images are not stored.
+  RenderingMaker &depthClear(const GenericImage &image, float depth = 1.0f,
+                             vk::ImageLayout layout = vk::ImageLayout::eDepthStencilAttachmentOptimal) {
+    depthAtt_.imageView   = image.imageView();
+    depthAtt_.imageLayout = layout;
+    depthAtt_.loadOp      = vk::AttachmentLoadOp::eClear;
+    depthAtt_.storeOp     = image.transient() ? vk::AttachmentStoreOp::eDontCare : vk::AttachmentStoreOp::eStore;
+    depthAtt_.clearValue  = vk::ClearValue{vk::ClearDepthStencilValue{depth, 0}};
+    return *this;
+  }
+
   void beginRendering(vk::CommandBuffer cb) {
     info_.colorAttachmentCount = (uint32_t)colorAtts_.size();
     info_.pColorAttachments    = colorAtts_.data();
+    info_.pDepthAttachment     = depthAtt_.imageView ? &depthAtt_ : nullptr;
     cb.beginRendering(info_);
   }
 
 private:
   vk::RenderingInfo info_{};
   std::vector<vk::RenderingAttachmentInfo> colorAtts_;
+  vk::RenderingAttachmentInfo depthAtt_{};
+};
+
+/// A frame graph: passes declare which images and buffers they use and how,
+/// and compile() works out the order of barriers, drops passes whose results
+/// are never used and lets transient images with non-overlapping lifetimes
+/// share memory.
+///
+///   vku::FrameGraph fg;
+///   auto backbuffer = fg.importImage("colour", colourImage);
+///   auto blur = fg.createImage("blur", blurInfo);
+///   fg.addPass("blur", [&](vk::CommandBuffer cb) { ... fg.view(blur) ... })
+///     .read(input, vku::FrameGraph::Access::SampledCompute)
+///     .write(blur, vku::FrameGraph::Access::StorageWriteCompute);
+///   fg.addPass("composite", [&](vk::CommandBuffer cb) { vku::RenderingMaker rm(w, h); ... })
+///     .read(blur, vku::FrameGraph::Access::SampledFragment)
+///     .write(backbuffer, vku::FrameGraph::Access::ColorAttachment);
+///   fg.compile(device, memprops);
+///   fg.dump(std::cout);
+///   ...
+///   fg.execute(cb); // every frame
+///
+/// Imported resources are always kept alive; so are passes marked sideEffect().
+/// Imported images start each execute() in whatever layout GenericImage has
+/// tracked, mip by mip and layer by layer, and are left with their tracked layout updated.
+/// A transient's first use each frame waits for the previous frame's last use of its memory.
+class FrameGraph {
+public:
+  typedef uint32_t Resource;
+
+  /// Common ways for a pass to use a resource.
+  enum class Access {
+    ColorAttachment, DepthAttachment, DepthRead,
+    SampledFragment, SampledCompute, SampledGraphics,
+    StorageReadCompute, StorageWriteCompute, StorageReadFragment, StorageWriteFragment,
+    TransferSrc, TransferDst,
+    UniformRead, VertexInput, IndexInput, IndirectRead,
+    Present,
+  };
+
+  struct Use {
+    Resource resource;
+    vk::ImageLayout layout;
+    vk::PipelineStageFlags2 stages;
+    vk::AccessFlags2 access;
+    bool write;
+  };
+
+  class Pass {
+  public:
+    /// The pass reads the resource.
+    Pass &read(Resource r, Access a) { return use(r, a, false); }
+
+    /// The pass writes (or reads and writes) the resource.
+    Pass &write(Resource r, Access a) { return use(r, a, true); }
+
+    /// Fully specified use, for anything Access does not cover.
+    Pass &use(Resource r, vk::ImageLayout layout, vk::PipelineStageFlags2 stages, vk::AccessFlags2 access, bool write) {
+      uses_.push_back(Use{r, layout, stages, access, write});
+      return *this;
+    }
+
+    /// Never cull this pass, eg. it writes something the graph does not know about.
+    Pass &sideEffect() { sideEffect_ = true; return *this; }
+
+    const std::string &name() const { return name_; }
+    const std::vector<Use> &uses() const { return uses_; }
+    bool culled() const { return !alive_; }
+  private:
+    friend class FrameGraph;
+    Pass &use(Resource r, Access a, bool write) {
+      Use u = usage(a);
+      u.resource = r;
+      u.write = write;
+      uses_.push_back(u);
+      return *this;
+    }
+
+    std::string name_;
+    std::function<void (vk::CommandBuffer cb)> record_;
+    std::vector<Use> uses_;
+    bool sideEffect_ = false;
+    bool alive_ = false;
+  };
+
+  /// One pass of the compiled schedule and the barriers recorded before it.
+  struct Step {
+    uint32_t pass;
+    BarrierBatch barriers;
+    // Imported images whose first barrier is fixed up with their actual layout at execute time.
+    std::vector<std::pair<size_t, Resource>> imports;
+  };
+
+  FrameGraph() {
+  }
+
+  /// Use an existing image. Its layout is tracked through the GenericImage.
+  Resource importImage(const std::string &name, GenericImage &image, vk::ImageAspectFlags aspect = vk::ImageAspectFlagBits::eColor) {
+    ResourceInfo r;
+    r.name = name;
+    r.isImage = true;
+    r.imported = true;
+    r.generic = &image;
+    r.aspect = aspect;
+    return add(std::move(r));
+  }
+
+  /// Use an existing buffer.
+  Resource importBuffer(const std::string &name, vk::Buffer buffer, vk::DeviceSize size = VK_WHOLE_SIZE) {
+    ResourceInfo r;
+    r.name = name;
+    r.isImage = false;
+    r.imported = true;
+    r.buffer = buffer;
+    r.size = size;
+    return add(std::move(r));
+  }
+
+  /// An image that only lives for the frame. It is created by compile(), with usage
+  /// flags added for the ways passes use it, and may share memory with other transients.
+  Resource createImage(const std::string &name, const vk::ImageCreateInfo &info, vk::ImageViewType viewType = vk::ImageViewType::e2D, vk::ImageAspectFlags aspect = vk::ImageAspectFlagBits::eColor) {
+    ResourceInfo r;
+    r.name = name;
+    r.isImage = true;
+    r.info = info;
+    r.info.initialLayout = vk::ImageLayout::eUndefined;
+    r.viewType = viewType;
+    r.aspect = aspect;
+    return add(std::move(r));
+  }
+
+  /// Keep the passes that write this transient even though nothing reads it.
+  void markOutput(Resource r) { resources_[r].output = true; }
+
+  /// Add a pass. record is called by execute() with the frame's command buffer.
+  Pass &addPass(const std::string &name, const std::function<void (vk::CommandBuffer cb)> &record) {
+    passes_.emplace_back();
+    passes_.back().name_ = name;
+    passes_.back().record_ = record;
+    return passes_.back();
+  }
+
+  /// Cull passes, create and alias transient images and work out the barriers.
+  void compile(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops) {
+    schedule_.clear();
+    for (auto &r : resources_) {
+      if (!r.imported) {
+        r.transient = GenericImage{};
+        r.generic = nullptr;
+      }
+      r.first = r.last = -1;
+      r.aliasOf = -1;
+      r.slot = -1;
+    }
+    slots_.clear();
+
+    cull();
+    for (uint32_t p = 0; p != passes_.size(); ++p) {
+      if (!passes_[p].alive_) continue;
+      int step = (int)schedule_.size();
+      schedule_.push_back(Step{p});
+      for (auto &u : passes_[p].uses_) {
+        auto &r = resources_[u.resource];
+        if (r.first < 0) r.first = step;
+        r.last = step;
+      }
+    }
+
+    createTransients(device, memprops);
+    placeBarriers();
+  }
+
+  /// Record the compiled schedule into cb.
+  /// With useSync2 false barriers are recorded with vkCmdPipelineBarrier.
+  void execute(vk::CommandBuffer cb, bool useSync2 = true) {
+    for (auto &step : schedule_) {
+      BarrierBatch batch;
+      auto &imgs = step.barriers.images();
+      for (size_t i = 0; i != imgs.size(); ++i) {
+        auto &b = imgs[i];
+        auto imp = std::find_if(step.imports.begin(), step.imports.end(), [i](const std::pair<size_t, Resource> &p) { return p.first == i; });
+        if (imp == step.imports.end()) {
+          batch.image(b.image, b.subresourceRange, b.oldLayout, b.newLayout, b.srcStageMask, b.srcAccessMask, b.dstStageMask, b.dstAccessMask);
+          continue;
+        }
+
+        // Start each run of mips from wherever it was left last time.
+        auto &g = *resources_[imp->second].generic;
+        uint32_t mips = g.info().mipLevels, layers = g.info().arrayLayers;
+        for (uint32_t layer = 0; layer != layers; ++layer) {
+          for (uint32_t mip = 0; mip != mips; ) {
+            vk::ImageLayout oldLayout = g.layout(mip, layer);
+            uint32_t end = mip + 1;
+            while (end != mips && g.layout(end, layer) == oldLayout) ++end;
+            auto src = layoutSync(oldLayout, true);
+            vk::ImageSubresourceRange range{b.subresourceRange.aspectMask, mip, end - mip, layer, 1};
+            batch.image(b.image, range, oldLayout, b.newLayout, src.first, src.second, b.dstStageMask, b.dstAccessMask);
+            mip = end;
+          }
+        }
+      }
+      for (auto &b : step.barriers.buffers()) {
+        batch.buffer(b.buffer, b.offset, b.size, b.srcStageMask, b.srcAccessMask, b.dstStageMask, b.dstAccessMask);
+      }
+      for (auto &b : step.barriers.memory()) {
+        batch.memory(b.srcStageMask, b.srcAccessMask, b.dstStageMask, b.dstAccessMask);
+      }
+      batch.flush(cb, useSync2);
+      passes_[step.pass].record_(cb);
+    }
+
+    for (auto &r : resources_) {
+      if (r.isImage && r.first >= 0) r.generic->setCurrentLayout(r.finalLayout);
+    }
+  }
+
+  vk::Image image(Resource r) const { auto &i = resources_[r]; return i.generic ? i.generic->image() : vk::Image{}; }
+  vk::ImageView view(Resource r) const { auto &i = resources_[r]; return i.generic ? i.generic->imageView() : vk::ImageView{}; }
+
+  /// The GenericImage of an image resource. Transients only exist after compile().
+  GenericImage *genericImage(Resource r) const { return resources_[r].generic; }
+  vk::Buffer buffer(Resource r) const { return resources_[r].buffer; }
+  const std::string &name(Resource r) const { return resources_[r].name; }
+
+  const std::vector<Step> &schedule() const { return schedule_; }
+  const std::deque<Pass> &passes() const { return passes_; }
+
+  /// Bytes of device memory saved by aliasing transient images.
+  vk::DeviceSize aliasedBytes() const {
+    vk::DeviceSize total = 0, used = 0;
+    for (auto &r : resources_) total += r.memSize;
+    for (auto &s : slots_) used += s.size;
+    return total - used;
+  }
+
+  /// Print the compiled schedule.
+  void dump(std::ostream &os) const {
+    for (auto &p : passes_) {
+      if (!p.alive_) os << "culled " << p.name_ << "\n";
+    }
+    for (auto &step : schedule_) {
+      for (auto &b : step.barriers.images()) {
+        os << "  barrier " << resourceName(b.image) << " " << vk::to_string(b.oldLayout) << " -> " << vk::to_string(b.newLayout)
+           << " mips " << b.subresourceRange.baseMipLevel << "+" << b.subresourceRange.levelCount
+           << " " << vk::to_string(b.srcStageMask) << " -> " << vk::to_string(b.dstStageMask) << "\n";
+      }
+      for (auto &b : step.barriers.buffers()) {
+        os << "  barrier " << resourceName(b.buffer) << " " << vk::to_string(b.srcStageMask) << " -> " << vk::to_string(b.dstStageMask) << "\n";
+      }
+      for (auto &b : step.barriers.memory()) {
+        os << "  barrier memory " << vk::to_string(b.srcStageMask) << " -> " << vk::to_string(b.dstStageMask) << "\n";
+      }
+      os << "pass " << passes_[step.pass].name_ << "\n";
+    }
+    for (size_t s = 0; s != slots_.size(); ++s) {
+      os << "memory " << s << " " << slots_[s].size << " bytes:";
+      for (auto &r : resources_) if (r.slot == (int)s) os << " " << r.name << "[" << r.first << "," << r.last << "]";
+      os << "\n";
+    }
+    os << aliasedBytes() << " bytes saved by aliasing\n";
+  }
+
+  /// Forget all passes and resources.
+  void clear() {
+    schedule_.clear();
+    passes_.clear();
+    resources_.clear();
+    slots_.clear();
+  }
+private:
+  struct ResourceInfo {
+    std::string name;
+    bool isImage = false;
+    bool imported = false;
+    bool output = false;
+    GenericImage *generic = nullptr;
+    vk::Buffer buffer;
+    vk::DeviceSize size = VK_WHOLE_SIZE;
+    vk::ImageCreateInfo info;
+    vk::ImageViewType viewType = vk::ImageViewType::e2D;
+    vk::ImageAspectFlags aspect;
+    GenericImage transient;
+    vk::DeviceSize memSize = 0;
+    vk::ImageLayout finalLayout = vk::ImageLayout::eUndefined;
+    int first = -1, last = -1;  // steps of first and last use
+    int aliasOf = -1;           // previous user of the same memory
+    int slot = -1;
+  };
+
+  struct Slot {
+    vk::UniqueDeviceMemory mem;
+    vk::DeviceSize size = 0;
+    uint32_t typeBits = ~0u;
+    int last = -1;
+    int resource = -1;
+  };
+
+  static Use usage(Access a) {
+    typedef vk::ImageLayout il;
+    typedef vk::PipelineStageFlagBits2 ps;
+    typedef vk::AccessFlagBits2 af;
+    switch (a) {
+      case Access::ColorAttachment: return {0, il::eColorAttachmentOptimal, ps::eColorAttachmentOutput, af::eColorAttachmentRead|af::eColorAttachmentWrite, true};
+      case Access::DepthAttachment: return {0, il::eDepthStencilAttachmentOptimal, ps::eEarlyFragmentTests|ps::eLateFragmentTests, af::eDepthStencilAttachmentRead|af::eDepthStencilAttachmentWrite, true};
+      case Access::DepthRead: return {0, il::eDepthStencilReadOnlyOptimal, ps::eEarlyFragmentTests|ps::eLateFragmentTests|ps::eFragmentShader, af::eDepthStencilAttachmentRead|af::eShaderRead, false};
+      case Access::SampledFragment: return {0, il::eShaderReadOnlyOptimal, ps::eFragmentShader, af::eShaderRead, false};
+      case Access::SampledCompute: return {0, il::eShaderReadOnlyOptimal, ps::eComputeShader, af::eShaderRead, false};
+      case Access::SampledGraphics: return {0, il::eShaderReadOnlyOptimal, ps::eVertexShader|ps::eFragmentShader, af::eShaderRead, false};
+      case Access::StorageReadCompute: return {0, il::eGeneral, ps::eComputeShader, af::eShaderStorageRead, false};
+      case Access::StorageWriteCompute: return {0, il::eGeneral, ps::eComputeShader, af::eShaderStorageRead|af::eShaderStorageWrite, true};
+      case Access::StorageReadFragment: return {0, il::eGeneral, ps::eFragmentShader, af::eShaderStorageRead, false};
+      case Access::StorageWriteFragment: return {0, il::eGeneral, ps::eFragmentShader, af::eShaderStorageRead|af::eShaderStorageWrite, true};
+      case Access::TransferSrc: return {0, il::eTransferSrcOptimal, ps::eTransfer, af::eTransferRead, false};
+      case Access::TransferDst: return {0, il::eTransferDstOptimal, ps::eTransfer, af::eTransferWrite, true};
+      case Access::UniformRead: return {0, il::eUndefined, ps::eVertexShader|ps::eFragmentShader|ps::eComputeShader, af::eUniformRead, false};
+      case Access::VertexInput: return {0, il::eUndefined, ps::eVertexAttributeInput, af::eVertexAttributeRead, false};
+      case Access::IndexInput: return {0, il::eUndefined, ps::eIndexInput, af::eIndexRead, false};
+      case Access::IndirectRead: return {0, il::eUndefined, ps::eDrawIndirect, af::eIndirectCommandRead, false};
+      case Access::Present: return {0, il::ePresentSrcKHR, vk::PipelineStageFlags2{}, vk::AccessFlags2{}, false};
+    }
+    return {0, il::eGeneral, ps::eAllCommands, af::eMemoryRead|af::eMemoryWrite, true};
+  }
+
+  static vk::AccessFlags2 writeBits() {
+    typedef vk::AccessFlagBits2 af;
+    return af::eShaderWrite|af::eShaderStorageWrite|af::eColorAttachmentWrite|af::eDepthStencilAttachmentWrite|af::eTransferWrite|af::eHostWrite|af::eMemoryWrite;
+  }
+
+  static vk::ImageUsageFlags imageUsage(vk::ImageLayout layout) {
+    typedef vk::ImageLayout il;
+    typedef vk::ImageUsageFlagBits iu;
+    switch (layout) {
+      case il::eColorAttachmentOptimal: return iu::eColorAttachment;
+      case il::eDepthStencilAttachmentOptimal: case il::eDepthStencilReadOnlyOptimal: return iu::eDepthStencilAttachment;
+      case il::eShaderReadOnlyOptimal: return iu::eSampled;
+      case il::eGeneral: return iu::eStorage;
+      case il::eTransferSrcOptimal: return iu::eTransferSrc;
+      case il::eTransferDstOptimal: return iu::eTransferDst;
+      default: return vk::ImageUsageFlags{};
+    }
+  }
+
+  Resource add(ResourceInfo &&r) {
+    resources_.push_back(std::move(r));
+    return (Resource)resources_.size() - 1;
+  }
+
+  // Walk backwards keeping passes that produce something used later.
+  void cull() {
+    std::vector<bool> needed(resources_.size());
+    for (size_t i = 0; i != resources_.size(); ++i) {
+      needed[i] = resources_[i].imported || resources_[i].output;
+    }
+    for (size_t p = passes_.size(); p-- != 0; ) {
+      auto &pass = passes_[p];
+      pass.alive_ = pass.sideEffect_;
+      for (auto &u : pass.uses_) {
+        if (u.write && needed[u.resource]) pass.alive_ = true;
+      }
+      if (pass.alive_) {
+        // Anything this pass touches must have been produced by earlier passes.
+        for (auto &u : pass.uses_) needed[u.resource] = true;
+      }
+    }
+  }
+
+  // Make transient images, sharing memory between images whose lifetimes do not overlap.
+  void createTransients(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops) {
+    std::vector<Resource> order;
+    for (Resource i = 0; i != resources_.size(); ++i) {
+      auto &r = resources_[i];
+      if (r.imported || r.first < 0) continue;
+      for (auto &p : passes_) {
+        if (!p.alive_) continue;
+        for (auto &u : p.uses_) if (u.resource == i) r.info.usage |= imageUsage(u.layout);
+      }
+      r.transient = GenericImage(device, r.info, r.viewType, r.aspect);
+      r.generic = &r.transient;
+      order.push_back(i);
+    }
+    std::sort(order.begin(), order.end(), [this](Resource a, Resource b) { return resources_[a].first < resources_[b].first; });
+
+    for (Resource i : order) {
+      auto &r = resources_[i];
+      auto memreq = r.transient.memoryRequirements(device);
+      r.memSize = memreq.size;
+
+      // Best fit among the slots that are free by our first use.
+      auto waste = [&](const Slot &slot) { return slot.size > memreq.size ? slot.size - memreq.size : memreq.size - slot.size; };
+      int best = -1;
+      for (int s = 0; s != (int)slots_.size(); ++s) {
+        auto &slot = slots_[s];
+        if (slot.last >= r.first || !(slot.typeBits & memreq.memoryTypeBits)) continue;
+        if (best < 0 || waste(slot) < waste(slots_[best])) best = s;
+      }
+      if (best < 0) {
+        best = (int)slots_.size();
+        slots_.emplace_back();
+      }
+      auto &slot = slots_[best];
+      r.slot = best;
+      r.aliasOf = slot.resource;
+      slot.size = std::max(slot.size, memreq.size);
+      slot.typeBits &= memreq.memoryTypeBits;
+      slot.last = r.last;
+      slot.resource = (int)i;
+    }
+
+    for (auto &slot : slots_) {
+      vk::MemoryAllocateInfo mai{};
+      mai.allocationSize = slot.size;
+      int type = findMemoryTypeIndex(memprops, slot.typeBits, vk::MemoryPropertyFlagBits::eDeviceLocal);
+      if (type < 0) type = findMemoryTypeIndex(memprops, slot.typeBits, vk::MemoryPropertyFlags{});
+      mai.memoryTypeIndex = (uint32_t)type;
+      slot.mem = device.allocateMemoryUnique(mai);
+    }
+
+    for (Resource i : order) {
+      auto &r = resources_[i];
+      r.transient.bind(device, *slots_[r.slot].mem, 0);
+    }
+  }
+
+  // Walk the schedule tracking how each resource was last used and add a
+  // barrier only where a hazard or layout change needs one.
+  void placeBarriers() {
+    struct Track {
+      vk::ImageLayout layout = vk::ImageLayout::eUndefined;
+      vk::PipelineStageFlags2 writeStages;  // stages of the last write (or layout transition)
+      vk::AccessFlags2 writeAccess;         // accesses that must be made available
+      vk::PipelineStageFlags2 readStages;   // stages that have read since then
+      vk::PipelineStageFlags2 visibleStages;
+      vk::AccessFlags2 visibleAccess;
+      bool touched = false;
+    };
+    std::vector<Track> tracks(resources_.size());
+
+    // All the stages and writes of each resource in a frame. The previous frame's
+    // uses of a slot's last resource are what its first resource has to wait for.
+    std::vector<std::pair<vk::PipelineStageFlags2, vk::AccessFlags2>> frameUses(resources_.size());
+    for (auto &step : schedule_) {
+      for (auto &u : passes_[step.pass].uses_) {
+        frameUses[u.resource].first |= u.stages;
+        if (u.write) frameUses[u.resource].second |= u.access & writeBits();
+      }
+    }
+
+    for (auto &step : schedule_) {
+      for (auto &u : passes_[step.pass].uses_) {
+        auto &r = resources_[u.resource];
+        auto &t = tracks[u.resource];
+        bool layoutChange = r.isImage && (!t.touched || t.layout != u.layout);
+        vk::PipelineStageFlags2 srcStages = t.writeStages | t.readStages;
+        vk::AccessFlags2 srcAccess = t.writeAccess;
+        bool importFixup = false;
+
+        bool need = false;
+        if (!t.touched) {
+          need = true;
+          if (r.imported && r.isImage) {
+            importFixup = true;
+          } else if (r.imported) {
+            // We do not know who wrote an imported buffer last.
+            srcStages = vk::PipelineStageFlagBits2::eAllCommands;
+            srcAccess = vk::AccessFlagBits2::eMemoryWrite;
+          } else if (r.aliasOf >= 0) {
+            // Wait for the previous user of this memory.
+            auto &a = tracks[r.aliasOf];
+            srcStages = a.writeStages | a.readStages;
+            srcAccess = a.writeAccess;
+          } else {
+            // Wait for the last user of this memory in the previous frame.
+            auto &last = frameUses[slots_[r.slot].resource];
+            srcStages = last.first;
+            srcAccess = last.second;
+          }
+        } else if (layoutChange) {
+          need = true;
+        } else if (u.write) {
+          need = bool(srcStages);
+        } else if (t.writeStages) {
+          need = (u.stages & ~t.visibleStages) || (u.access & ~t.visibleAccess);
+          srcStages = t.writeStages;
+        }
+
+        if (need) {
+          if (r.isImage) {
+            vk::ImageSubresourceRange range{r.aspect, 0, VK_REMAINING_MIP_LEVELS, 0, VK_REMAINING_ARRAY_LAYERS};
+            vk::ImageLayout oldLayout = t.touched ? t.layout : vk::ImageLayout::eUndefined;
+            if (importFixup) step.imports.emplace_back(step.barriers.images().size(), u.resource);
+            step.barriers.image(image(u.resource), range, oldLayout, u.layout, srcStages, srcAccess, u.stages, u.access);
+          } else {
+            step.barriers.buffer(r.buffer, 0, r.size, srcStages, srcAccess, u.stages, u.access);
+          }
+        }
+
+        if (need && layoutChange) {
+          // The transition is a write that finishes before u.stages.
+          t.writeStages = u.stages;
+          t.writeAccess = vk::AccessFlags2{};
+          t.readStages = vk::PipelineStageFlags2{};
+          t.visibleStages = vk::PipelineStageFlags2{};
+          t.visibleAccess = vk::AccessFlags2{};
+        }
+        if (need) {
+          t.visibleStages |= u.stages;
+          t.visibleAccess |= u.access;
+        }
+        if (u.write) {
+          t.writeStages = u.stages;
+          t.writeAccess = u.access & writeBits();
+          t.readStages = vk::PipelineStageFlags2{};
+          t.visibleStages = vk::PipelineStageFlags2{};
+          t.visibleAccess = vk::AccessFlags2{};
+        } else {
+          t.readStages |= u.stages;
+        }
+        if (r.isImage) t.layout = u.layout;
+        t.touched = true;
+      }
+    }
+
+    for (size_t i = 0; i != resources_.size(); ++i) {
+      resources_[i].finalLayout = tracks[i].layout;
+    }
+  }
+
+  // Names for dump().
+  std::string resourceName(vk::Image img) const {
+    for (Resource i = 0; i != resources_.size(); ++i) {
+      if (resources_[i].isImage && image(i) == img) return resources_[i].name;
+    }
+    return "?";
+  }
+
+  std::string resourceName(vk::Buffer buf) const {
+    for (auto &r : resources_) if (!r.isImage && r.buffer == buf) return r.name;
+    return "?";
+  }
+
+  std::deque<Pass> passes_;
+  std::deque<ResourceInfo> resources_;
+  std::vector<Step> schedule_;
+  std::vector<Slot> slots_;
+};
+
+/// Write a string as a quoted JSON string.
+inline void writeJsonString(std::ostream &os, const std::string &str) {
+  os << '"';
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      os << '\\' << c;
+    } else if ((unsigned char)c < 0x20) {
+      char tmp[8];
+      snprintf(tmp, sizeof(tmp), "\\u%04x", (unsigned)c);
+      os << tmp;
+    } else {
+      os << c;
+    }
+  }
+  os << '"';
+}
+
+/// Measure GPU time with timestamp queries.
+///
+///   vku::GpuProfiler prof(device, fw.physicalDevice(), fw.graphicsQueueFamilyIndex(), window.numImageIndices());
+///   ...
+///   cb.begin(bi);
+///   prof.beginFrame(cb, imageIndex);
+///   {
+///     auto s = prof.scope(cb, "shadows");
+///     { auto s2 = prof.scope(cb, "cascade0"); ... }
+///   }
+///   ...
+///   prof.stats("shadows/cascade0").avg
+///
+/// Each frame slot has its own query pool. beginFrame() reads back the results
+/// the slot recorded last time round, so call it only after the fence for that
+/// slot has been waited on; the read never waits for the GPU.
+/// Scopes nest and are keyed by their path, eg. "shadows/cascade0".
+/// CPU spans from cpuScope() go into the same trace, for chrome://tracing or Perfetto.
+class GpuProfiler {
+public:
+  /// Rolling statistics for one scope over the last few frames, in milliseconds.
+  struct Stats {
+    double last = 0;
+    double avg = 0;
+    double min = 0;
+    double max = 0;
+    uint64_t count = 0;
+  };
+
+  /// Ends the scope when destroyed.
+  class Scope {
+  public:
+    Scope() {}
+    Scope(GpuProfiler *prof, vk::CommandBuffer cb, int index) : prof_(prof), cb_(cb), index_(index) {}
+    Scope(Scope &&rhs) { *this = std::move(rhs); }
+    Scope &operator=(Scope &&rhs) {
+      end();
+      prof_ = rhs.prof_; cb_ = rhs.cb_; index_ = rhs.index_;
+      rhs.prof_ = nullptr;
+      return *this;
+    }
+    ~Scope() { end(); }
+
+    /// End the scope early.
+    void end() {
+      if (prof_) prof_->endScope(cb_, index_);
+      prof_ = nullptr;
+    }
+  private:
+    GpuProfiler *prof_ = nullptr;
+    vk::CommandBuffer cb_;
+    int index_ = -1;
+  };
+
+  /// Ends a CPU span when destroyed.
+  class CpuScope {
+  public:
+    CpuScope(GpuProfiler *prof, const char *name) : prof_(prof), name_(name), start_(prof->nowUs()) {}
+    CpuScope(const CpuScope &) = delete;
+    ~CpuScope() { prof_->cpuSpan(name_, start_, prof_->nowUs()); }
+  private:
+    GpuProfiler *prof_;
+    const char *name_;
+    double start_;
+  };
+
+  GpuProfiler() {
+  }
+
+  /// queueFamilyIndex is the family the scopes are recorded on; it decides the valid timestamp bits.
+  GpuProfiler(vk::Device device, vk::PhysicalDevice physicalDevice, uint32_t queueFamilyIndex, uint32_t numFrames = 3, uint32_t maxScopes = 256, uint32_t window = 64) :
+    device_(device), maxScopes_(maxScopes), window_(window) {
+    auto limits = physicalDevice.getProperties().limits;
+    auto qprops = physicalDevice.getQueueFamilyProperties();
+    uint32_t validBits = queueFamilyIndex < qprops.size() ? qprops[queueFamilyIndex].timestampValidBits : 0;
+    period_ = limits.timestampPeriod;
+    supported_ = validBits != 0 && period_ != 0;
+    mask_ = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+    if (!supported_) {
+      std::cout << "vku::GpuProfiler: timestamps not supported on queue family " << queueFamilyIndex << "\n";
+    }
+
+    frames_.resize(numFrames);
+    for (auto &f : frames_) {
+      vk::QueryPoolCreateInfo qpci{{}, vk::QueryType::eTimestamp, maxScopes * 2};
+      if (supported_) f.pool = device.createQueryPoolUnique(qpci);
+    }
+    epoch_ = std::chrono::steady_clock::now();
+  }
+
+  GpuProfiler(const GpuProfiler &) = delete;
+  GpuProfiler &operator=(const GpuProfiler &) = delete;
+
+  /// Collect the results this slot recorded last time and reset its queries.
+  /// Must be recorded outside a render pass, before any scope() on cb.
+  void beginFrame(vk::CommandBuffer cb, uint32_t frame) {
+    current_ = &frames_[frame % frames_.size()];
+    collect(*current_);
+    current_->scopes.clear();
+    current_->depth = 0;
+    current_->cpuStart = nowUs();
+    if (supported_) cb.resetQueryPool(*current_->pool, 0, maxScopes_ * 2);
+  }
+
+  /// Write a timestamp now and another when the returned Scope is destroyed.
+  Scope scope(vk::CommandBuffer cb, const std::string &name, vk::PipelineStageFlagBits stage = vk::PipelineStageFlagBits::eTopOfPipe) {
+    if (!supported_ || !current_ || current_->scopes.size() == maxScopes_) return Scope{};
+    auto &f = *current_;
+    int index = (int)f.scopes.size();
+    ScopeRecord rec;
+    rec.path = f.depth ? f.path + "/" + name : name;
+    rec.depth = f.depth++;
+    f.path = rec.path;
+    f.scopes.push_back(rec);
+    cb.writeTimestamp(stage, *f.pool, index * 2);
+    return Scope{this, cb, index};
+  }
+
+  /// Time a span of CPU work for the trace, eg. auto s = prof.cpuScope("record");
+  /// name must outlive the span.
+  CpuScope cpuScope(const char *name) { return CpuScope(this, name); }
+
+  /// Statistics for a scope path. Zero if never seen.
+  Stats stats(const std::string &path) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto i = stats_.find(path);
+    return i == stats_.end() ? Stats{} : i->second.stats;
+  }
+
+  /// All scope paths seen so far with their statistics.
+  std::vector<std::pair<std::string, Stats>> allStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::pair<std::string, Stats>> result;
+    for (auto &p : stats_) result.emplace_back(p.first, p.second.stats);
+    return result;
+  }
+
+  /// Print a table of scope timings.
+  void dump(std::ostream &os) const {
+    for (auto &p : allStats()) {
+      os << p.first << ": avg " << p.second.avg << "ms min " << p.second.min << "ms max " << p.second.max << "ms\n";
+    }
+  }
+
+  /// Start keeping GPU and CPU spans for writeTrace(), up to maxEvents of them.
+  void startTrace(size_t maxEvents = 1 << 20) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    trace_.clear();
+    maxEvents_ = maxEvents;
+    tracing_ = true;
+  }
+
+  void stopTrace() { tracing_ = false; }
+
+  /// Write the spans in Chrome trace_event JSON format. GPU spans are on tid 0.
+  /// GPU times are lined up with the CPU clock at beginFrame(), so the two are
+  /// only approximately in step.
+  void writeTrace(std::ostream &os) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    os << "{\"traceEvents\":[\n";
+    for (size_t i = 0; i != trace_.size(); ++i) {
+      auto &e = trace_[i];
+      os << "{\"name\":";
+      writeJsonString(os, e.name);
+      os << ",\"cat\":\"" << (e.tid ? "cpu" : "gpu") << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << e.tid;
+      os << ",\"ts\":" << e.ts << ",\"dur\":" << e.dur << "}" << (i + 1 == trace_.size() ? "\n" : ",\n");
+    }
+    os << "]}\n";
+  }
+
+  bool writeTrace(const std::string &filename) const {
+    std::ofstream f(filename);
+    if (!f) return false;
+    writeTrace(f);
+    return true;
+  }
+
+  bool supported() const { return supported_; }
+
+  /// Nanoseconds per timestamp tick.
+  float timestampPeriod() const { return period_; }
+private:
+  struct ScopeRecord {
+    std::string path;
+    uint32_t depth;
+  };
+
+  struct Frame {
+    vk::UniqueQueryPool pool;
+    std::vector<ScopeRecord> scopes;
+    std::string path;
+    uint32_t depth = 0;
+    double cpuStart = 0;
+  };
+
+  struct History {
+    std::vector<double> samples;
+    size_t next = 0;
+    Stats stats;
+  };
+
+  struct Event {
+    std::string name;
+    double ts;
+    double dur;
+    uint32_t tid;
+  };
+
+  void endScope(vk::CommandBuffer cb, int index) {
+    auto &f = *current_;
+    cb.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, *f.pool, index * 2 + 1);
+    --f.depth;
+    auto slash = f.path.rfind('/');
+    f.path = slash == std::string::npos ? std::string() : f.path.substr(0, slash);
+  }
+
+  // Read back a finished frame without waiting.
+  void collect(Frame &f) {
+    if (!supported_ || f.scopes.empty()) return;
+    uint32_t count = (uint32_t)f.scopes.size() * 2;
+    std::vector<uint64_t> data(count * 2);
+    auto flags = vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWithAvailability;
+    vk::Result result = device_.getQueryPoolResults(*f.pool, 0, count, data.size() * sizeof(uint64_t), data.data(), 2 * sizeof(uint64_t), flags);
+    if (result != vk::Result::eSuccess && result != vk::Result::eNotReady) return;
+
+    uint64_t base = data[0];
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i != f.scopes.size(); ++i) {
+      uint64_t *begin = &data[i * 4];
+      uint64_t *end = &data[i * 4 + 2];
+      if (!begin[1] || !end[1]) continue;
+      double ms = (double)((end[0] - begin[0]) & mask_) * period_ * 1e-6;
+      add(f.scopes[i].path, ms);
+      if (tracing_ && trace_.size() < maxEvents_) {
+        double ts = f.cpuStart + (double)((begin[0] - base) & mask_) * period_ * 1e-3;
+        trace_.push_back(Event{f.scopes[i].path, ts, ms * 1e3, 0});
+      }
+    }
+  }
+
+  void add(const std::string &path, double ms) {
+    auto &h = stats_[path];
+    if (h.samples.size() < window_) {
+      h.samples.push_back(ms);
+    } else {
+      h.samples[h.next] = ms;
+      h.next = (h.next + 1) % window_;
+    }
+    auto &s = h.stats;
+    s.last = ms;
+    s.count++;
+    s.min = s.max = ms;
+    double total = 0;
+    for (double v : h.samples) {
+      total += v;
+      s.min = std::min(s.min, v);
+      s.max = std::max(s.max, v);
+    }
+    s.avg = total / h.samples.size();
+  }
+
+  void cpuSpan(const char *name, double start, double end) {
+    if (!tracing_) return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (trace_.size() >= maxEvents_) return;
+    auto id = std::this_thread::get_id();
+    auto t = threadIds_.find(id);
+    if (t == threadIds_.end()) t = threadIds_.emplace(id, (uint32_t)threadIds_.size() + 1).first;
+    trace_.push_back(Event{name, start, end - start, t->second});
+  }
+
+  double nowUs() const {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - epoch_).count();
+  }
+
+  vk::Device device_;
+  std::vector<Frame> frames_;
+  Frame *current_ = nullptr;
+  uint32_t maxScopes_ = 0;
+  uint32_t window_ = 64;
+  float period_ = 1;
+  uint64_t mask_ = ~0ull;
+  bool supported_ = false;
+  std::chrono::steady_clock::time_point epoch_;
+
+  mutable std::mutex mutex_;
+  std::map<std::string, History> stats_;
+  std::vector<Event> trace_;
+  std::map<std::thread::id, uint32_t> threadIds_;
+  size_t maxEvents_ = 0;
+  std::atomic<bool> tracing_{false};
+};
+
+/// Count what the GPU did in a range of commands with pipeline statistics
+/// (and optionally occlusion) queries.
+/// Needs DeviceMaker::enablePipelineStatisticsQuery (FrameworkOptions::usePipelineStatistics,
+/// then check Framework::hasPipelineStatistics()).
+///
+///   vku::QueryStats qs(device, window.numImageIndices());
+///   cb.begin(bi);
+///   qs.beginFrame(cb, imageIndex);
+///   cb.beginRenderPass(...);
+///   { auto r = qs.range(cb, "decals"); cb.draw(...); }
+///   ...
+///   qs.dump(std::cout);
+///
+/// Like GpuProfiler, beginFrame() collects the slot's previous results without
+/// waiting, so call it once the slot's fence has been waited on.
+/// Only one range can be open at a time, and a range must begin and end in the same subpass.
+class QueryStats {
+public:
+  /// Counters for one range. counters[i] is the i'th bit set in flags().
+  struct Result {
+    std::string name;
+    std::vector<uint64_t> counters;
+    uint64_t samples = 0; // samples passing depth and stencil, if occlusion queries are on.
+  };
+
+  /// Ends the range when destroyed.
+  class Range {
+  public:
+    Range() {}
+    Range(QueryStats *qs, vk::CommandBuffer cb, uint32_t index) : qs_(qs), cb_(cb), index_(index) {}
+    Range(Range &&rhs) { *this = std::move(rhs); }
+    Range &operator=(Range &&rhs) {
+      end();
+      qs_ = rhs.qs_; cb_ = rhs.cb_; index_ = rhs.index_;
+      rhs.qs_ = nullptr;
+      return *this;
+    }
+    ~Range() { end(); }
+
+    void end() {
+      if (qs_) qs_->endRange(cb_, index_);
+      qs_ = nullptr;
+    }
+  private:
+    QueryStats *qs_ = nullptr;
+    vk::CommandBuffer cb_;
+    uint32_t index_ = 0;
+  };
+
+  /// Counters useful for most passes. Tessellation and geometry counters need those stages.
+  static vk::QueryPipelineStatisticFlags defaultFlags() {
+    typedef vk::QueryPipelineStatisticFlagBits b;
+    return b::eInputAssemblyVertices | b::eInputAssemblyPrimitives | b::eVertexShaderInvocations |
+           b::eClippingInvocations | b::eClippingPrimitives | b::eFragmentShaderInvocations |
+           b::eComputeShaderInvocations;
+  }
+
+  QueryStats() {
+  }
+
+  /// With occlusion on, precise needs DeviceMaker::enableOcclusionQueryPrecise; otherwise
+  /// samples is only guaranteed to be non-zero when something passed.
+  QueryStats(vk::Device device, uint32_t numFrames = 3, uint32_t maxRanges = 64, vk::QueryPipelineStatisticFlags flags = defaultFlags(), bool occlusion = false, bool precise = false) :
+    device_(device), flags_(flags), maxRanges_(maxRanges), occlusion_(occlusion), precise_(precise) {
+    for (uint32_t bit = 0; bit != 32; ++bit) {
+      if ((VkQueryPipelineStatisticFlags)flags & (1u << bit)) bits_.push_back((vk::QueryPipelineStatisticFlagBits)(1u << bit));
+    }
+
+    frames_.resize(numFrames);
+    for (auto &f : frames_) {
+      vk::QueryPoolCreateInfo qpci{{}, vk::QueryType::ePipelineStatistics, maxRanges, flags};
+      f.stats = device.createQueryPoolUnique(qpci);
+      if (occlusion) {
+        vk::QueryPoolCreateInfo oqci{{}, vk::QueryType::eOcclusion, maxRanges};
+        f.occlusion = device.createQueryPoolUnique(oqci);
+      }
+    }
+  }
+
+  QueryStats(const QueryStats &) = delete;
+  QueryStats &operator=(const QueryStats &) = delete;
+
+  /// Collect the results this slot recorded last time and reset its queries.
+  /// Must be recorded outside a render pass.
+  void beginFrame(vk::CommandBuffer cb, uint32_t frame) {
+    current_ = &frames_[frame % frames_.size()];
+    collect(*current_);
+    current_->names.clear();
+    cb.resetQueryPool(*current_->stats, 0, maxRanges_);
+    if (occlusion_) cb.resetQueryPool(*current_->occlusion, 0, maxRanges_);
+  }
+
+  /// Count the commands recorded until the returned Range is destroyed.
+  Range range(vk::CommandBuffer cb, const std::string &name) {
+    if (!current_ || current_->names.size() == maxRanges_) return Range{};
+    auto &f = *current_;
+    uint32_t index = (uint32_t)f.names.size();
+    f.names.push_back(name);
+    cb.beginQuery(*f.stats, index, vk::QueryControlFlags{});
+    if (occlusion_) cb.beginQuery(*f.occlusion, index, precise_ ? vk::QueryControlFlagBits::ePrecise : vk::QueryControlFlags{});
+    return Range{this, cb, index};
+  }
+
+  /// Called with each frame's results as they are collected.
+  void onResults(const std::function<void (const std::vector<Result> &results)> &callback) { callback_ = callback; }
+
+  /// Results from the most recently collected frame.
+  const std::vector<Result> &results() const { return results_; }
+
+  vk::QueryPipelineStatisticFlags flags() const { return flags_; }
+
+  /// The counter for one statistic, or 0 if it is not being collected.
+  uint64_t value(const Result &r, vk::QueryPipelineStatisticFlagBits bit) const {
+    for (size_t i = 0; i != bits_.size(); ++i) {
+      if (bits_[i] == bit && i < r.counters.size()) return r.counters[i];
+    }
+    return 0;
+  }
+
+  /// Print the last results as a table.
+  void dump(std::ostream &os) const {
+    for (auto &r : results_) {
+      os << r.name << ":\n";
+      for (size_t i = 0; i != bits_.size(); ++i) {
+        os << "  " << vk::to_string(bits_[i]) << " " << r.counters[i] << "\n";
+      }
+      if (occlusion_) os << "  Samples " << r.samples << "\n";
+    }
+  }
+
+  /// Write the last results as JSON: [{"name": ..., "InputAssemblyVertices": ..., ...}, ...]
+  void writeJson(std::ostream &os) const {
+    os << "[\n";
+    for (size_t j = 0; j != results_.size(); ++j) {
+      auto &r = results_[j];
+      os << "  {\"name\":";
+      writeJsonString(os, r.name);
+      for (size_t i = 0; i != bits_.size(); ++i) {
+        os << ",\"" << vk::to_string(bits_[i]) << "\":" << r.counters[i];
+      }
+      if (occlusion_) os << ",\"Samples\":" << r.samples;
+      os << "}" << (j + 1 == results_.size() ? "\n" : ",\n");
+    }
+    os << "]\n";
+  }
+private:
+  struct Frame {
+    vk::UniqueQueryPool stats;
+    vk::UniqueQueryPool occlusion;
+    std::vector<std::string> names;
+  };
+
+  void endRange(vk::CommandBuffer cb, uint32_t index) {
+    cb.endQuery(*current_->stats, index);
+    if (occlusion_) cb.endQuery(*current_->occlusion, index);
+  }
+
+  // Read back a finished frame without waiting.
+  void collect(Frame &f) {
+    if (f.names.empty()) return;
+    uint32_t count = (uint32_t)f.names.size();
+    size_t stride = bits_.size() + 1;
+    std::vector<uint64_t> data(count * stride);
+    auto rflags = vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWithAvailability;
+    vk::Result result = device_.getQueryPoolResults(*f.stats, 0, count, data.size() * sizeof(uint64_t), data.data(), stride * sizeof(uint64_t), rflags);
+    if (result != vk::Result::eSuccess && result != vk::Result::eNotReady) return;
+
+    std::vector<uint64_t> samples(count * 2);
+    if (occlusion_) {
+      result = device_.getQueryPoolResults(*f.occlusion, 0, count, samples.size() * sizeof(uint64_t), samples.data(), 2 * sizeof(uint64_t), rflags);
+      if (result != vk::Result::eSuccess && result != vk::Result::eNotReady) return;
+    }
+
+    results_.clear();
+    for (uint32_t i = 0; i != count; ++i) {
+      const uint64_t *p = &data[i * stride];
+      if (!p[bits_.size()]) continue;
+      Result r;
+      r.name = f.names[i];
+      r.counters.assign(p, p + bits_.size());
+      r.samples = samples[i * 2];
+      results_.push_back(std::move(r));
+    }
+    if (callback_) callback_(results_);
+  }
+
+  vk::Device device_;
+  vk::QueryPipelineStatisticFlags flags_;
+  std::vector<vk::QueryPipelineStatisticFlagBits> bits_;
+  uint32_t maxRanges_ = 0;
+  bool occlusion_ = false;
+  bool precise_ = false;
+  std::vector<Frame> frames_;
+  Frame *current_ = nullptr;
+  std::vector<Result> results_;
+  std::function<void (const std::vector<Result> &results)> callback_;
+};
+
+/// Command buffers that live for one frame.
+/// Each frame slot has its own transient pool, reset as a whole by beginFrame()
+/// instead of buffer by buffer; drivers make this the cheap path. Handles are
+/// kept on a free list and handed out again after the reset.
+/// Not thread safe: give each recording thread its own allocator.
+///
+///     vku::FrameCommandAllocator cmds{device, queueFamilyIndex, framesInFlight};
+///     ... after waiting for the frame's fence:
+///     cmds.beginFrame(frame);
+///     vk::CommandBuffer cb = cmds.allocate();
+///     cb.begin(...);
+class FrameCommandAllocator {
+public:
+  FrameCommandAllocator() {
+  }
+
+  FrameCommandAllocator(vk::Device device, uint32_t queueFamilyIndex, uint32_t numFrames = 3) : device_(device) {
+    frames_.resize(numFrames);
+    for (auto &f : frames_) {
+      vk::CommandPoolCreateInfo cpci{vk::CommandPoolCreateFlagBits::eTransient, queueFamilyIndex};
+      f.pool = device.createCommandPoolUnique(cpci);
+    }
+  }
+
+  /// Reset the frame slot's pool, returning all its command buffers to the free list.
+  /// The GPU must have finished with everything allocated for this slot.
+  void beginFrame(uint32_t frame) {
+    current_ = frame % frames_.size();
+    auto &f = frames_[current_];
+    device_.resetCommandPool(*f.pool, vk::CommandPoolResetFlags{});
+    for (auto &l : f.levels) l.used = 0;
+  }
+
+  /// Get a command buffer in the initial state, ready for begin().
+  vk::CommandBuffer allocate(vk::CommandBufferLevel level = vk::CommandBufferLevel::ePrimary) {
+    auto &f = frames_[current_];
+    auto &l = f.levels[level == vk::CommandBufferLevel::ePrimary ? 0 : 1];
+    if (l.used == l.buffers.size()) {
+      // Grow the free list; the buffers are freed with the pool.
+      uint32_t n = (uint32_t)std::max(l.buffers.size(), (size_t)1);
+      vk::CommandBufferAllocateInfo cbai{*f.pool, level, n};
+      auto more = device_.allocateCommandBuffers(cbai);
+      l.buffers.insert(l.buffers.end(), more.begin(), more.end());
+    }
+    return l.buffers[l.used++];
+  }
+
+  /// Command buffers handed out this frame.
+  size_t allocated() const {
+    auto &f = frames_[current_];
+    return f.levels[0].used + f.levels[1].used;
+  }
+
+  uint32_t numFrames() const { return (uint32_t)frames_.size(); }
+private:
+  struct Level {
+    std::vector<vk::CommandBuffer> buffers;
+    size_t used = 0;
+  };
+
+  struct Frame {
+    vk::UniqueCommandPool pool;
+    std::array<Level, 2> levels; // primary, secondary
+  };
+
+  vk::Device device_;
+  std::vector<Frame> frames_;
+  size_t current_ = 0;
+};
+
+/// Record secondary command buffers on a persistent pool of worker threads.
+/// Each thread has its own FrameCommandAllocator; beginFrame() resets all of a
+/// slot's pools at once, so call it after waiting for that slot's fence.
+/// example:
+///     vku::ParallelRecorder recorder{device, fw.graphicsQueueFamilyIndex(), window.numImageIndices()};
+///     ... in the dynamic callback:
+///     recorder.beginFrame(imageIndex);
+///     cb.beginRenderPass(rpbi, vk::SubpassContents::eSecondaryCommandBuffers);
+///     vk::CommandBufferInheritanceInfo inherit{rpbi.renderPass, 0, rpbi.framebuffer};
+///     recorder.execute(cb, inherit, objects.size(), [&](vk::CommandBuffer scb, size_t begin, size_t end, uint32_t thread) {
+///       for (size_t i = begin; i != end; ++i) objects[i].draw(scb);
+///     });
+///     cb.endRenderPass();
+class ParallelRecorder {
+public:
+  /// Record items [begin, end) into cb, which has already been begun.
+  typedef std::function<void (vk::CommandBuffer cb, size_t begin, size_t end, uint32_t thread)> RecordFunc;
+
+  ParallelRecorder() {
+  }
+
+  /// numThreads of 0 uses one thread per core.
+  ParallelRecorder(vk::Device device, uint32_t queueFamilyIndex, uint32_t numFrames = 3, uint32_t numThreads = 0) {
+    if (numThreads == 0) numThreads = std::max(1u, std::thread::hardware_concurrency());
+    for (uint32_t i = 0; i != numThreads; ++i) {
+      commands_.emplace_back(device, queueFamilyIndex, numFrames);
+    }
+    for (uint32_t i = 0; i != numThreads; ++i) {
+      threads_.emplace_back([this, i]() { worker(i); });
+    }
+  }
+
+  ParallelRecorder(const ParallelRecorder &) = delete;
+  ParallelRecorder &operator=(const ParallelRecorder &) = delete;
+
+  ~ParallelRecorder() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    work_.notify_all();
+    for (auto &t : threads_) t.join();
+  }
+
+  /// Reset every thread's pool for this frame slot.
+  void beginFrame(uint32_t frame) {
+    for (auto &c : commands_) c.beginFrame(frame);
+  }
+
+  /// Split [0, count) into one contiguous chunk per thread and record each into
+  /// a secondary command buffer. Blocks until all are done and returns them in order.
+  /// If func throws on any thread, the first exception is rethrown here once all threads finish.
+  const std::vector<vk::CommandBuffer> &record(const vk::CommandBufferInheritanceInfo &inheritance, size_t count, const RecordFunc &func,
+      vk::CommandBufferUsageFlags usage = vk::CommandBufferUsageFlagBits::eRenderPassContinue|vk::CommandBufferUsageFlagBits::eOneTimeSubmit) {
+    uint32_t chunks = (uint32_t)std::min(count, threads_.size());
+    results_.assign(chunks, vk::CommandBuffer{});
+    if (chunks == 0) return results_;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    job_.func = &func;
+    job_.inheritance = inheritance;
+    job_.usage = usage;
+    job_.count = count;
+    job_.chunks = chunks;
+    remaining_ = chunks;
+    error_ = nullptr;
+    ++generation_;
+    work_.notify_all();
+    done_.wait(lock, [this]() { return remaining_ == 0; });
+    if (error_) {
+      std::exception_ptr error = error_;
+      error_ = nullptr;
+      std::rethrow_exception(error);
+    }
+    return results_;
+  }
+
+  /// Record as above and execute the secondaries in the primary command buffer.
+  void execute(vk::CommandBuffer primary, const vk::CommandBufferInheritanceInfo &inheritance, size_t count, const RecordFunc &func) {
+    auto &cbs = record(inheritance, count, func);
+    if (!cbs.empty()) primary.executeCommands(cbs);
+  }
+
+  uint32_t numThreads() const { return (uint32_t)threads_.size(); }
+private:
+  struct Job {
+    const RecordFunc *func = nullptr;
+    vk::CommandBufferInheritanceInfo inheritance;
+    vk::CommandBufferUsageFlags usage;
+    size_t count = 0;
+    uint32_t chunks = 0;
+  };
+
+  void worker(uint32_t thread) {
+    uint64_t seen = 0;
+    for (;;) {
+      Job job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        work_.wait(lock, [&]() { return stop_ || generation_ != seen; });
+        if (stop_) return;
+        seen = generation_;
+        if (thread >= job_.chunks) continue;
+        job = job_;
+      }
+
+      vk::CommandBuffer cb;
+      std::exception_ptr error;
+      try {
+        cb = commands_[thread].allocate(vk::CommandBufferLevel::eSecondary);
+
+        size_t begin = job.count * thread / job.chunks;
+        size_t end = job.count * (thread + 1) / job.chunks;
+        vk::CommandBufferBeginInfo bi{job.usage, &job.inheritance};
+        cb.begin(bi);
+        (*job.func)(cb, begin, end, thread);
+        cb.end();
+      } catch (...) {
+        // Escaping the thread would call std::terminate; hand it to record() instead.
+        error = std::current_exception();
+      }
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      results_[thread] = cb;
+      if (error && !error_) error_ = error;
+      if (--remaining_ == 0) done_.notify_one();
+    }
+  }
+
+  std::vector<FrameCommandAllocator> commands_; // one per thread
+  std::vector<std::thread> threads_;
+  std::vector<vk::CommandBuffer> results_;
+  Job job_;
+  uint64_t generation_ = 0;
+  uint32_t remaining_ = 0;
+  std::exception_ptr error_;
+  bool stop_ = false;
+  std::mutex mutex_;
+  std::condition_variable work_;
+  std::condition_variable done_;
 };
 
 } // namespace vku
 
+#undef VKU_DETAIL_MMAP
+
 #endif // VKU_HPP
@@ -57,6 +57,9 @@
 #include <chrono>
 #include <functional>
 #include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
 
 #include <vulkan/vulkan.hpp>
 #include <vku/vku.hpp>
@@ -72,6 +75,20 @@ struct FrameworkOptions
 	bool useMultiView = false;
 	bool useDynamicRendering = false;
 	bool useSynchronization2 = false;
+	// Request a dedicated transfer queue family if the device has one.
+	// Falls back to the graphics queue otherwise.
+	bool useTransferQueue = false;
+	// Enable VK_KHR_push_descriptor (see DescriptorSetUpdater::push).
+	bool usePushDescriptors = false;
+	// Enable descriptor indexing (see BindlessHeap). Check hasDescriptorIndexing().
+	bool useDescriptorIndexing = false;
+	// Enable pipeline statistics and precise occlusion queries (see QueryStats).
+	bool usePipelineStatistics = false;
+	// Enable timeline semaphores (see WindowOptions::useTimelineSubmit).
+	bool useTimelineSemaphore = false;
+	// If not empty, the pipeline cache is loaded from this file at startup
+	// and saved back to it when the framework is destroyed.
+	std::string pipelineCachePath;
 };
 
 /// This class provides an optional interface to the vulkan instance, devices and queues.
@@ -135,11 +152,53 @@ public:
       return;
     }
 
+    // Prefer a transfer-only family (usually a DMA engine), then any other family
+    // that is not the graphics family. Single family devices use the graphics queue.
+    transferQueueFamilyIndex_ = graphicsQueueFamilyIndex_;
+    if (options.useTransferQueue) {
+      for (int pass = 0; pass != 2 && transferQueueFamilyIndex_ == graphicsQueueFamilyIndex_; ++pass) {
+        for (uint32_t qi = 0; qi != qprops.size(); ++qi) {
+          auto flags = qprops[qi].queueFlags;
+          bool transferOnly = !(flags & (vk::QueueFlagBits::eGraphics|vk::QueueFlagBits::eCompute));
+          bool canTransfer = bool(flags & (vk::QueueFlagBits::eTransfer|vk::QueueFlagBits::eCompute));
+          if (qi != graphicsQueueFamilyIndex_ && canTransfer && (transferOnly || pass == 1)) {
+            transferQueueFamilyIndex_ = qi;
+            break;
+          }
+        }
+      }
+    }
+
     memprops_ = physical_device_.getMemoryProperties();
 
     // todo: find optimal texture format
     // auto rgbaprops = physical_device_.getFormatProperties(vk::Format::eR8G8B8A8Unorm);
 
+    // Query features are optional and missing on many mobile drivers and MoltenVK.
+    auto features = physical_device_.getFeatures();
+    pipelineStatistics_ = options.usePipelineStatistics && features.pipelineStatisticsQuery;
+    if (options.usePipelineStatistics && !pipelineStatistics_) {
+      std::cout << "pipelineStatisticsQuery is not supported\n";
+    }
+    if (options.usePipelineStatistics && !features.occlusionQueryPrecise) {
+      std::cout << "occlusionQueryPrecise is not supported\n";
+    }
+
+    // Likewise only enable the Vulkan 1.2 features the device has.
+    auto features2 = physical_device_.getFeatures2<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceDescriptorIndexingFeatures, vk::PhysicalDeviceTimelineSemaphoreFeatures, vk::PhysicalDeviceSynchronization2Features>();
+    auto &indexing = features2.get<vk::PhysicalDeviceDescriptorIndexingFeatures>();
+    timelineSemaphore_ = options.useTimelineSemaphore && features2.get<vk::PhysicalDeviceTimelineSemaphoreFeatures>().timelineSemaphore;
+    if (options.useTimelineSemaphore && !timelineSemaphore_) {
+      std::cout << "timelineSemaphore is not supported\n";
+    }
+    synchronization2_ = options.useSynchronization2 && features2.get<vk::PhysicalDeviceSynchronization2Features>().synchronization2;
+    if (options.useSynchronization2 && !synchronization2_) {
+      std::cout << "synchronization2 is not supported\n";
+    }
+    if (options.useDescriptorIndexing) {
+      descriptorIndexing_ = reportIndexingFeatures(indexing);
+    }
+
     vku::DeviceMaker dm{};
     dm.defaultExtensions()
       .queue(graphicsQueueFamilyIndex_)
@@ -147,8 +206,18 @@ public:
       .enableTessellationShader( options.useTessellationShader )
       .enableMultiView( options.useMultiView )
       .enableDynamicRendering( options.useDynamicRendering )
-      .enableSynchronization2( options.useSynchronization2 );
+      .enableSynchronization2( synchronization2_ )
+      .enableDescriptorIndexing( options.useDescriptorIndexing, &indexing )
+      .enableTimelineSemaphore( timelineSemaphore_ )
+      .enablePipelineStatisticsQuery( pipelineStatistics_ )
+      .enableOcclusionQueryPrecise( options.usePipelineStatistics && features.occlusionQueryPrecise );
+    bool pushDescriptors = options.usePushDescriptors && hasExtension(VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME);
+    if (options.usePushDescriptors && !pushDescriptors) {
+      std::cout << VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME " is not supported\n";
+    }
+    if (pushDescriptors) dm.extension(VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME);
     if (options.useCompute && computeQueueFamilyIndex_ != graphicsQueueFamilyIndex_) dm.queue(computeQueueFamilyIndex_);
+    if (transferQueueFamilyIndex_ != graphicsQueueFamilyIndex_ && transferQueueFamilyIndex_ != computeQueueFamilyIndex_) dm.queue(transferQueueFamilyIndex_);
 
     // NVIDIA ICD occasionally returns DeviceLost transiently at creation time.
     // Retry with exponential backoff before propagating the error.
@@ -163,13 +232,20 @@ public:
       }
     }
 
-    vk::PipelineCacheCreateInfo pipelineCacheInfo{};
-    pipelineCache_ = device_->createPipelineCacheUnique(pipelineCacheInfo);
+    loadPipelineCache();
 
     std::vector<vk::DescriptorPoolSize> poolSizes = {
       {vk::DescriptorType::eUniformBuffer, 128},
       {vk::DescriptorType::eCombinedImageSampler, 128},
-      {vk::DescriptorType::eStorageBuffer, 128} };
+      {vk::DescriptorType::eStorageBuffer, 128},
+      {vk::DescriptorType::eUniformBufferDynamic, 32},
+      {vk::DescriptorType::eStorageBufferDynamic, 32},
+      {vk::DescriptorType::eStorageImage, 32},
+      {vk::DescriptorType::eSampledImage, 32},
+      {vk::DescriptorType::eSampler, 32},
+      {vk::DescriptorType::eInputAttachment, 32},
+      {vk::DescriptorType::eUniformTexelBuffer, 32},
+      {vk::DescriptorType::eStorageTexelBuffer, 32} };
 
     // Create an arbitrary number of descriptors in a pool.
     // Allow the descriptors to be freed, possibly not optimal behaviour.
@@ -180,6 +256,12 @@ public:
     descriptorPoolInfo.pPoolSizes = poolSizes.data();
     descriptorPool_ = device_->createDescriptorPoolUnique(descriptorPoolInfo);
 
+    if (pushDescriptors) pushDescriptorFns_ = PushDescriptorFns(*device_);
+
+    // Growable alternatives to the fixed pool above.
+    descriptorSetLayoutCache_ = std::make_unique<DescriptorSetLayoutCache>(*device_);
+    descriptorAllocator_ = std::make_unique<DescriptorAllocator>(*device_, 256, descriptorSetLayoutCache_.get());
+
     ok_ = true;
   }
 
@@ -206,21 +288,112 @@ public:
   /// Get the queue used to submit compute jobs
   vk::Queue computeQueue() const { return device_->getQueue(computeQueueFamilyIndex_, 0); }
 
+  /// Get the queue used to submit transfers.
+  /// This is the graphics queue unless options.useTransferQueue found a separate family.
+  vk::Queue transferQueue() const { return device_->getQueue(transferQueueFamilyIndex_, 0); }
+
   /// Get the physical device.
   const vk::PhysicalDevice &physicalDevice() const { return physical_device_; }
 
   /// Get the default pipeline cache (you can use your own if you like).
   vk::PipelineCache pipelineCache() const { return *pipelineCache_; }
 
+  /// Hit/miss counters for the default pipeline cache.
+  /// Pass this to PipelineMaker::cacheStats() to have pipelines counted.
+  PipelineCacheStats *pipelineCacheStats() const { return pipelineCacheStats_.get(); }
+
+  /// Make a pipeline cache for a worker thread, seeded with the contents of the default one.
+  /// Hand it back with mergePipelineCache() so its pipelines get saved.
+  vk::UniquePipelineCache createThreadPipelineCache() const {
+    std::vector<uint8_t> data;
+    {
+      std::lock_guard<std::mutex> lock(*pipelineCacheMutex_);
+      data = device_->getPipelineCacheData(*pipelineCache_);
+    }
+    vk::PipelineCacheCreateInfo ci{{}, data.size(), data.data()};
+    return device_->createPipelineCacheUnique(ci);
+  }
+
+  /// The mutex that guards the default pipeline cache (see PipelineCompiler).
+  std::mutex &pipelineCacheMutex() const { return *pipelineCacheMutex_; }
+
+  /// Merge a worker thread's cache into the default pipeline cache.
+  void mergePipelineCache(vk::PipelineCache cache) const {
+    std::lock_guard<std::mutex> lock(*pipelineCacheMutex_);
+    device_->mergePipelineCaches(*pipelineCache_, cache);
+  }
+
+  /// Write the default pipeline cache to options.pipelineCachePath.
+  /// This is called by the destructor but can be called at any time.
+  bool savePipelineCache() const {
+    if (options.pipelineCachePath.empty() || !pipelineCache_) return false;
+    std::vector<uint8_t> data;
+    {
+      std::lock_guard<std::mutex> lock(*pipelineCacheMutex_);
+      data = device_->getPipelineCacheData(*pipelineCache_);
+    }
+
+    // Write to a temporary and rename so that a crash never leaves a truncated cache.
+    std::string tmp = options.pipelineCachePath + ".tmp";
+    {
+      std::ofstream f(tmp, std::ios::binary);
+      if (!f.write((const char*)data.data(), data.size())) {
+        std::cout << "Pipeline cache: could not write " << tmp << "\n";
+        return false;
+      }
+    }
+#ifdef _WIN32
+    // rename() does not replace an existing file on Windows.
+    std::remove(options.pipelineCachePath.c_str());
+#endif
+    if (std::rename(tmp.c_str(), options.pipelineCachePath.c_str()) != 0) {
+      std::cout << "Pipeline cache: could not rename " << tmp << "\n";
+      return false;
+    }
+    return true;
+  }
+
   /// Get the default descriptor pool (you can use your own if you like).
   vk::DescriptorPool descriptorPool() const { return *descriptorPool_; }
 
+  /// Get a descriptor allocator that adds pools as they fill up.
+  DescriptorAllocator &descriptorAllocator() const { return *descriptorAllocator_; }
+
+  /// Get the VK_KHR_push_descriptor entry points.
+  /// Null unless options.usePushDescriptors was set and the device has the extension.
+  const PushDescriptorFns &pushDescriptorFns() const { return pushDescriptorFns_; }
+
+  /// Get a cache that shares descriptor set layouts with identical bindings.
+  DescriptorSetLayoutCache &descriptorSetLayoutCache() const { return *descriptorSetLayoutCache_; }
+
   /// Get the family index for the graphics queues.
   uint32_t graphicsQueueFamilyIndex() const { return graphicsQueueFamilyIndex_; }
 
   /// Get the family index for the compute queues.
   uint32_t computeQueueFamilyIndex() const { return computeQueueFamilyIndex_; }
 
+  /// Get the family index for the transfer queue.
+  uint32_t transferQueueFamilyIndex() const { return transferQueueFamilyIndex_; }
+
+  /// True if options.usePipelineStatistics was set and the device supports it.
+  bool hasPipelineStatistics() const { return pipelineStatistics_; }
+
+  /// True if options.useDescriptorIndexing was set and the device supports everything BindlessHeap needs.
+  bool hasDescriptorIndexing() const { return descriptorIndexing_; }
+
+  /// True if options.useTimelineSemaphore was set and the device supports it.
+  bool hasTimelineSemaphore() const { return timelineSemaphore_; }
+
+  /// True if options.useSynchronization2 was set and the device supports it.
+  bool hasSynchronization2() const { return synchronization2_; }
+
+  /// True if the device was made with everything WindowOptions::useTimelineSubmit needs.
+  bool hasTimelineSubmit() const { return timelineSemaphore_ && synchronization2_; }
+
+  /// Returns true if transfers run on a different queue family to graphics.
+  /// Resources uploaded there need queue family ownership transfers (see UploadQueue).
+  bool hasDedicatedTransferQueue() const { return transferQueueFamilyIndex_ != graphicsQueueFamilyIndex_; }
+
   const vk::PhysicalDeviceMemoryProperties &memprops() const { return memprops_; }
 
   /// Clean up the framework satisfying the Vulkan verification layers.
@@ -228,11 +401,16 @@ public:
     if (device_) {
       device_->waitIdle();
       if (pipelineCache_) {
+        if (savePipelineCache()) {
+          pipelineCacheStats_->dump(std::cout);
+        }
         pipelineCache_.reset();
       }
       if (descriptorPool_) {
         descriptorPool_.reset();
       }
+      descriptorAllocator_.reset();
+      descriptorSetLayoutCache_.reset();
       device_.reset();
     }
 
@@ -248,15 +426,101 @@ public:
   bool ok() const { return ok_; }
 
 private:
+  /// True if the physical device offers this device extension.
+  bool hasExtension(const char *name) const {
+    auto extensions = physical_device_.enumerateDeviceExtensionProperties();
+    return std::any_of(extensions.begin(), extensions.end(), [&](const vk::ExtensionProperties &e) { return !strcmp(e.extensionName, name); });
+  }
+
+  /// Print each descriptor indexing feature BindlessHeap needs that the device lacks.
+  /// Returns true if there are none.
+  static bool reportIndexingFeatures(const vk::PhysicalDeviceDescriptorIndexingFeatures &f) {
+    std::pair<const char *, vk::Bool32> needed[] = {
+      {"runtimeDescriptorArray", f.runtimeDescriptorArray},
+      {"descriptorBindingPartiallyBound", f.descriptorBindingPartiallyBound},
+      {"descriptorBindingVariableDescriptorCount", f.descriptorBindingVariableDescriptorCount},
+      {"descriptorBindingUpdateUnusedWhilePending", f.descriptorBindingUpdateUnusedWhilePending},
+      {"descriptorBindingSampledImageUpdateAfterBind", f.descriptorBindingSampledImageUpdateAfterBind},
+      {"descriptorBindingStorageImageUpdateAfterBind", f.descriptorBindingStorageImageUpdateAfterBind},
+      {"descriptorBindingStorageBufferUpdateAfterBind", f.descriptorBindingStorageBufferUpdateAfterBind},
+      {"shaderSampledImageArrayNonUniformIndexing", f.shaderSampledImageArrayNonUniformIndexing},
+      {"shaderStorageImageArrayNonUniformIndexing", f.shaderStorageImageArrayNonUniformIndexing},
+      {"shaderStorageBufferArrayNonUniformIndexing", f.shaderStorageBufferArrayNonUniformIndexing},
+    };
+    bool all = true;
+    for (auto &n : needed) {
+      if (!n.second) {
+        std::cout << n.first << " is not supported\n";
+        all = false;
+      }
+    }
+    return all;
+  }
+
+  /// Create the default pipeline cache, seeded from options.pipelineCachePath if
+  /// the file exists and was written by this driver on this device.
+  void loadPipelineCache() {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<uint8_t> data;
+    if (!options.pipelineCachePath.empty()) {
+      std::ifstream f(options.pipelineCachePath, std::ios::binary);
+      if (f) {
+        data.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+        const char *reason = pipelineCacheRejected(data);
+        if (reason) {
+          std::cout << "Pipeline cache: ignoring " << options.pipelineCachePath << " (" << reason << ")\n";
+          data.clear();
+        }
+      } else {
+        std::cout << "Pipeline cache: no " << options.pipelineCachePath << ", cold start\n";
+      }
+    }
+
+    vk::PipelineCacheCreateInfo pipelineCacheInfo{{}, data.size(), data.data()};
+    pipelineCache_ = device_->createPipelineCacheUnique(pipelineCacheInfo);
+
+    if (!data.empty()) {
+      auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+      std::cout << "Pipeline cache: loaded " << data.size() << " bytes from " << options.pipelineCachePath << " in " << ms << "ms\n";
+    }
+  }
+
+  /// Check the VkPipelineCacheHeaderVersionOne at the start of a cache blob.
+  /// Returns nullptr if the blob is usable, otherwise the reason it is not.
+  const char *pipelineCacheRejected(const std::vector<uint8_t> &data) const {
+    uint32_t header[4];
+    uint8_t uuid[VK_UUID_SIZE];
+    if (data.size() < sizeof(header) + sizeof(uuid)) return "too short";
+    memcpy(header, data.data(), sizeof(header));
+    memcpy(uuid, data.data() + sizeof(header), sizeof(uuid));
+    auto props = physical_device_.getProperties();
+    if (header[0] < sizeof(header) + sizeof(uuid)) return "bad header size";
+    if (header[1] != (uint32_t)vk::PipelineCacheHeaderVersion::eOne) return "unknown header version";
+    if (header[2] != props.vendorID) return "different vendor";
+    if (header[3] != props.deviceID) return "different device";
+    if (memcmp(uuid, props.pipelineCacheUUID.data(), sizeof(uuid)) != 0) return "different driver";
+    return nullptr;
+  }
+
   vk::UniqueInstance instance_;
   vku::DebugCallback callback_;
   vk::UniqueDevice device_;
   vk::PhysicalDevice physical_device_;
   vk::UniquePipelineCache pipelineCache_;
+  std::unique_ptr<PipelineCacheStats> pipelineCacheStats_ = std::make_unique<PipelineCacheStats>();
+  std::unique_ptr<std::mutex> pipelineCacheMutex_ = std::make_unique<std::mutex>();
   vk::UniqueDescriptorPool descriptorPool_;
+  std::unique_ptr<DescriptorSetLayoutCache> descriptorSetLayoutCache_;
+  std::unique_ptr<DescriptorAllocator> descriptorAllocator_;
+  PushDescriptorFns pushDescriptorFns_;
   uint32_t graphicsQueueFamilyIndex_;
   uint32_t computeQueueFamilyIndex_;
+  uint32_t transferQueueFamilyIndex_;
   vk::PhysicalDeviceMemoryProperties memprops_;
+  bool pipelineStatistics_ = false;
+  bool descriptorIndexing_ = false;
+  bool timelineSemaphore_ = false;
+  bool synchronization2_ = false;
   bool ok_ = false;
 };
 
@@ -267,6 +531,40 @@ struct WindowOptions
   // true = minImageCount+1 (triple buffering, GPU runs uncapped under eFifo)
   // false = minImageCount   (double buffering, eFifo naturally caps at vsync)
   bool tripleBuffering = false;
+  // Number of frames the CPU may record ahead of the GPU, each with its own
+  // dynamic command buffer, fence and semaphores. 0 uses the swapchain image count.
+  uint32_t framesInFlight = 0;
+  // Submit the dynamic and static command buffers in one vkQueueSubmit2 and
+  // track frames with one timeline semaphore instead of fences.
+  // The device must be made with synchronization2 and timeline semaphores enabled,
+  // eg. useTimelineSubmit = fw.hasTimelineSubmit(). If the device does not support
+  // them, the window prints why and falls back to fences.
+  bool useTimelineSubmit = false;
+  // Headless windows only: the number of offscreen images standing in for the
+  // swapchain, and how often one is copied back to the CPU (0 never, 1 every frame).
+  uint32_t headlessImages = 3;
+  uint32_t readbackInterval = 0;
+  // Number of frames kept for Window::frameTimingStats().
+  uint32_t frameTimingWindow = 240;
+};
+
+/// Where the CPU spent its time in one Window::draw(), in milliseconds.
+struct FrameTiming {
+  double fenceWait = 0; // waiting for the GPU to finish with this frame's buffers
+  double acquire = 0;   // acquireNextImageKHR
+  double record = 0;    // the dynamic callback and FrameArena flush
+  double submit = 0;    // queue submits
+  double present = 0;   // presentKHR
+  double total = 0;     // the whole of draw()
+  double interval = 0;  // since the start of the previous draw()
+};
+
+/// Rolling percentiles of FrameTiming over the last WindowOptions::frameTimingWindow frames.
+struct FrameTimingStats {
+  FrameTiming p50;
+  FrameTiming p95;
+  FrameTiming p99;
+  size_t frames = 0;
 };
 
 /// This class wraps a window, a surface and a swap chain for that surface.
@@ -318,6 +616,25 @@ public:
     init(instance, device, physicalDevice, graphicsQueueFamilyIndex, surface, options.desiredSwapChainImageFormat);
   }
 
+  /// Construct a headless window with no surface, eg. for batch jobs on a machine with no display.
+  /// A ring of options.headlessImages ColorAttachmentImages replaces the swapchain;
+  /// draw() and setStaticCommands() work as usual but nothing is presented.
+  /// See setReadbackCallback() to get the pixels.
+  Window(const vk::Instance &instance, const vk::Device &device, const vk::PhysicalDevice &physicalDevice, uint32_t graphicsQueueFamilyIndex, uint32_t width, uint32_t height, const WindowOptions &options_ = WindowOptions{}) : options(options_) {
+    graphicsQueueFamilyIndex_ = graphicsQueueFamilyIndex;
+    physicalDevice_ = physicalDevice;
+    instance_ = instance;
+    device_ = device;
+    presentQueueFamily_ = graphicsQueueFamilyIndex;
+    headless_ = true;
+    width_ = width;
+    height_ = height;
+    swapchainImageFormat_ = options.desiredSwapChainImageFormat;
+
+    createImages();
+    initFrames(device, graphicsQueueFamilyIndex);
+  }
+
   void init(const vk::Instance &instance, const vk::Device &device, const vk::PhysicalDevice &physicalDevice, uint32_t graphicsQueueFamilyIndex, vk::SurfaceKHR surface, vk::Format desiredSwapChainFormat) {
     // ObjectDestroy moved from vk:: to vk::detail:: around SDK 1.3.283
 #if VK_HEADER_VERSION >= 290
@@ -364,14 +681,22 @@ public:
 
     createSwapchain();
     createImages();
+    initFrames(device, graphicsQueueFamilyIndex);
+  }
+
+  /// Create everything that follows the swapchain images: depth buffer, render pass,
+  /// framebuffers, command buffers and per-frame sync objects.
+  void initFrames(const vk::Device &device, uint32_t graphicsQueueFamilyIndex) {
     createDepthStencil();
     createRenderPass();
     createFrameBuffers();
 
-    for (int i = 0; i != numImageIndices(); ++i) {
+    framesInFlight_ = options.framesInFlight ? options.framesInFlight : (uint32_t)numImageIndices();
+
+    // Per frame in flight: acquire and dynamic CB semaphores.
+    for (uint32_t i = 0; i != framesInFlight_; ++i) {
       vk::SemaphoreCreateInfo sci;
       imageAcquireSemaphore_.emplace_back(device.createSemaphoreUnique(sci));
-      commandCompleteSemaphore_.emplace_back(device.createSemaphoreUnique(sci));
       dynamicSemaphore_.emplace_back(device.createSemaphoreUnique(sci));
     }
 
@@ -380,44 +705,32 @@ public:
     vk::CommandPoolCreateInfo cpci{ ccbits::eTransient|ccbits::eResetCommandBuffer, graphicsQueueFamilyIndex };
     commandPool_ = device.createCommandPoolUnique(cpci);
 
-    // Create static draw buffers
-    vk::CommandBufferAllocateInfo cbai{ *commandPool_, vk::CommandBufferLevel::ePrimary, (uint32_t)framebuffers_.size() };
-    staticDrawBuffers_ = device.allocateCommandBuffersUnique(cbai);
-    dynamicDrawBuffers_ = device.allocateCommandBuffersUnique(cbai);
-
-    // Create a set of fences to protect the command buffers from re-writing.
-    for (int i = 0; i != (int)staticDrawBuffers_.size(); ++i) {
-      vk::FenceCreateInfo fci;
-      fci.flags = vk::FenceCreateFlagBits::eSignaled;
-      commandBufferFences_.emplace_back(device.createFence(fci));
-    }
+    createImageSync();
 
-    for (int i = 0; i != (int)staticDrawBuffers_.size(); ++i) {
-      vk::CommandBuffer cb = *staticDrawBuffers_[i];
-      vk::CommandBufferBeginInfo bi{};
-      cb.begin(bi);
-      cb.end();
-    }
+    // Dynamic command buffers are re-recorded every frame, so they come from
+    // per-frame pools that are reset whole rather than buffer by buffer.
+    frameCommands_ = FrameCommandAllocator(device, graphicsQueueFamilyIndex, framesInFlight_);
 
     // Create a set of fences to protect the dynamic command buffers from re-writing.
-    for (int i = 0; i != (int)dynamicDrawBuffers_.size(); ++i) {
+    for (uint32_t i = 0; i != framesInFlight_; ++i) {
       vk::FenceCreateInfo fci;
       fci.flags = vk::FenceCreateFlagBits::eSignaled;
       dynamicCommandBufferFences_.emplace_back(device.createFence(fci));
     }
 
-    for (int i = 0; i != (int)dynamicDrawBuffers_.size(); ++i) {
-      vk::CommandBuffer cb = *dynamicDrawBuffers_[i];
-      vk::CommandBufferBeginInfo bi{};
-      cb.begin(bi);
-      cb.end();
-    }
+    if (options.useTimelineSubmit && !timelineSubmitSupported()) options.useTimelineSubmit = false;
+    if (options.useTimelineSubmit) createTimeline();
+    if (headless_ && options.readbackInterval) createReadback();
 
     ok_ = true;
   }
 
 	/// Dump the capabilities of the physical device used by this window.
   void dumpCaps(std::ostream &os, vk::PhysicalDevice pd) const {
+    if (headless_) {
+      os << "Headless, no surface\n";
+      return;
+    }
     os << "Surface formats\n";
     auto fmts = pd.getSurfaceFormatsKHR(surface_.get());
     for (auto &fmt : fmts) {
@@ -448,8 +761,48 @@ public:
     buildStaticCBs();
   }
 
+  typedef void (segmentFunc_t)(vk::CommandBuffer cb, int imageIndex);
+  typedef uint32_t StaticSegment;
+
+  /// Add a segment of static draw commands, recorded into its own secondary
+  /// command buffer per swapchain image inside the window's render pass.
+  /// The static command buffers then just execute the segments in order.
+  /// Segments are re-recorded only when marked dirty and only once draw() has
+  /// waited for the image that uses them, so changing one draw is cheap.
+  /// Dynamic state such as the viewport is not inherited; set it in func.
+  /// Once a window has segments, setStaticCommands() is ignored.
+  StaticSegment addStaticSegment(const std::function<segmentFunc_t> &func) {
+    segments_.emplace_back();
+    setStaticSegment((StaticSegment)segments_.size() - 1, func);
+    return (StaticSegment)segments_.size() - 1;
+  }
+
+  /// Replace a segment's commands. It is re-recorded on the next draw of each image.
+  void setStaticSegment(StaticSegment segment, const std::function<segmentFunc_t> &func) {
+    segments_[segment].func = func;
+    markStaticSegmentDirty(segment);
+  }
+
+  /// Re-record a segment, eg. because something it captures has changed.
+  void markStaticSegmentDirty(StaticSegment segment) {
+    segments_[segment].dirty.assign(numImageIndices(), true);
+    staticDirty_.assign(numImageIndices(), true);
+  }
+
+  /// Stop drawing a segment. Its id is not reused.
+  void removeStaticSegment(StaticSegment segment) {
+    segments_[segment].func = nullptr;
+    staticDirty_.assign(numImageIndices(), true);
+  }
+
   void buildStaticCBs() {
-    if(func) {
+    if (!segments_.empty()) {
+      // New framebuffers: everything is recorded again as each image is drawn.
+      for (StaticSegment s = 0; s != segments_.size(); ++s) {
+        if (segments_[s].func) markStaticSegmentDirty(s);
+      }
+      staticDirty_.assign(numImageIndices(), true);
+    } else if(func) {
       for (int i = 0; i != (int)staticDrawBuffers_.size(); ++i) {
         vk::CommandBuffer cb = *staticDrawBuffers_[i];
 
@@ -472,18 +825,40 @@ public:
   /// for uploading textures, changing uniforms etc.
   void draw(const vk::Device &device, const vk::Queue &graphicsQueue, const std::function<void (vk::CommandBuffer cb, int currentFrame, vk::RenderPassBeginInfo &rpbi)> &dynamic = defaultRenderFunc) {
     auto umax = std::numeric_limits<uint64_t>::max();
-    static uint32_t currentFrame = 0;
+    uint32_t currentFrame = currentFrame_;
     uint32_t imageIndex = 0;
 
-    // currentFrame indexes the dynamic CB and semaphore ring — these are
-    // CPU-side cycling resources independent of which image we acquire.
+    typedef std::chrono::steady_clock clock;
+    auto ms = [](clock::time_point a, clock::time_point b) { return std::chrono::duration<double, std::milli>(b - a).count(); };
+    FrameTiming timing;
+    auto tStart = clock::now();
+    if (lastDrawStart_ != clock::time_point{}) timing.interval = ms(lastDrawStart_, tStart);
+    lastDrawStart_ = tStart;
+
+    // currentFrame indexes the dynamic CB and semaphore ring of framesInFlight() —
+    // these are CPU-side cycling resources independent of which image we acquire.
     // We can wait on the dynamic fence before acquiring since it doesn't
     // depend on imageIndex.
     vk::Fence &rpcbFence = dynamicCommandBufferFences_[currentFrame];
-    {vk::Result result = device.waitForFences(rpcbFence, 1, umax);} // TODO use result
+    if (timeline_) {
+      waitTimeline(device, frameValues_[currentFrame]);
+    } else {
+      check(device.waitForFences(rpcbFence, 1, umax), "waitForFences");
+    }
+    auto tWait = clock::now();
+    timing.fenceWait = ms(tStart, tWait);
 
     vk::Semaphore iaSema = *imageAcquireSemaphore_[currentFrame];
-    auto acquired = device.acquireNextImageKHR(*swapchain_, umax, iaSema, vk::Fence{}, &imageIndex);
+    vk::Result acquired = vk::Result::eSuccess;
+    if (headless_) {
+      // Offscreen images are used in turn. Waiting for the image below stands in for acquire.
+      imageIndex = headlessNext_;
+      headlessNext_ = (headlessNext_ + 1) % numImageIndices();
+    } else {
+      acquired = device.acquireNextImageKHR(*swapchain_, umax, iaSema, vk::Fence{}, &imageIndex);
+    }
+    auto tAcquire = clock::now();
+    timing.acquire = ms(tWait, tAcquire);
     if (acquired == vk::Result::eErrorOutOfDateKHR) {
       recreateSwapChain();
       return;
@@ -495,12 +870,32 @@ public:
     // to render into framebuffers_[imageIndex], so we must use imageIndex here —
     // not currentFrame — to avoid rendering into the wrong swapchain image.
     vk::Fence &cbFence = commandBufferFences_[imageIndex];
-    {vk::Result result = device.waitForFences(cbFence, 1, umax);} // TODO use result
+    if (timeline_) {
+      waitTimeline(device, imageValues_[imageIndex]);
+    } else {
+      check(device.waitForFences(cbFence, 1, umax), "waitForFences");
+    }
+    auto tRecord = clock::now();
+    timing.fenceWait += ms(tAcquire, tRecord);
 
-    device.resetFences(rpcbFence);
-    device.resetFences(cbFence);
+    if (!timeline_) {
+      device.resetFences(rpcbFence);
+      device.resetFences(cbFence);
+    }
+
+    // The copy of this image made last time round is now finished.
+    if (readbackPending_.size()) deliverReadback(device, imageIndex);
+    bool readback = readbackPending_.size() && frameNumber_ % options.readbackInterval == 0;
+
+    // Both command buffers that last used this image are done, so its arena region is free.
+    if (frameArena_) frameArena_->beginFrame(imageIndex);
 
-    vk::CommandBuffer pscb = *dynamicDrawBuffers_[currentFrame];
+    // The static CB for this image and its segments are idle; bring them up to date.
+    if (!segments_.empty()) updateStaticSegments(imageIndex);
+
+    // Everything this frame slot recorded last time has finished.
+    frameCommands_.beginFrame(currentFrame);
+    vk::CommandBuffer pscb = frameCommands_.allocate();
     vk::Semaphore psSema = *dynamicSemaphore_[currentFrame];
 
     vk::ClearDepthStencilValue clearDepthValue{ 1.0f, 0 };
@@ -512,63 +907,158 @@ public:
     rpbi.clearValueCount = (uint32_t)clearColours.size();
     rpbi.pClearValues = clearColours.data();
     dynamic(pscb, imageIndex, rpbi);
-
-    // Submit 1: dynamic CB (UBO transfers). Waits for image acquire only at
-    // eColorAttachmentOutput — the dynamic CB doesn't write to the swapchain image.
-    vk::PipelineStageFlags waitStagesAcquire = vk::PipelineStageFlagBits::eColorAttachmentOutput;
-    // Submit 2: static CB (rendering). Waits for dynamic CB at eTopOfPipe — the very first stage.
-    // This forces ALL stages in submit2 to wait for psSema without adding any access-mask
-    // dependency (which would conflict with existing barriers). Semaphore signal/wait already
-    // provides a full memory dependency (all prior writes visible), so UBO data written via
-    // cb.updateBuffer in submit1 is visible to vertex shader reads in submit2. Using eTopOfPipe
-    // also makes the ccSema→psSema→submit1 chain fully visible to sync-val, fixing
-    // SYNC-HAZARD-PRESENT-AFTER-WRITE when submit1 contains swapchain color writes.
-    vk::PipelineStageFlags waitStagesDynamic = vk::PipelineStageFlagBits::eTopOfPipe;
-
-    vk::SubmitInfo submit;
-    submit.waitSemaphoreCount = 1;
-    submit.pWaitSemaphores = &iaSema;
-    submit.pWaitDstStageMask = &waitStagesAcquire;
-    submit.commandBufferCount = 1;
-    submit.pCommandBuffers = &pscb;
-    submit.signalSemaphoreCount = 1;
-    submit.pSignalSemaphores = &psSema;
-
-    {vk::Result result = graphicsQueue.submit(1, &submit, rpcbFence);} // TODO use result
+    if (frameArena_) frameArena_->flush(device);
+    auto tSubmit = clock::now();
+    timing.record = ms(tRecord, tSubmit);
 
     vk::CommandBuffer cb = *staticDrawBuffers_[imageIndex];
-    vk::Semaphore ccSema = *commandCompleteSemaphore_[currentFrame];
-
-    submit.waitSemaphoreCount = 1;
-    submit.pWaitSemaphores = &psSema;
-    submit.pWaitDstStageMask = &waitStagesDynamic;
-    submit.commandBufferCount = 1;
-    submit.pCommandBuffers = &cb;
-    submit.signalSemaphoreCount = 1;
-    submit.pSignalSemaphores = &ccSema;
-
-    {vk::Result result = graphicsQueue.submit(1, &submit, cbFence);} // TODO use result
-
-    vk::PresentInfoKHR presentInfo;
-    vk::SwapchainKHR swapchain = *swapchain_;
-    presentInfo.pSwapchains = &swapchain;
-    presentInfo.swapchainCount = 1;
-    presentInfo.pImageIndices = &imageIndex;
-    presentInfo.waitSemaphoreCount = 1;
-    presentInfo.pWaitSemaphores = &ccSema;
-
-    vk::Result resultPresent;
-    try { resultPresent = presentQueue().presentKHR(presentInfo); }
-    catch (vk::OutOfDateKHRError err) { resultPresent = vk::Result::eErrorOutOfDateKHR; }
-    catch (...) { throw std::runtime_error("failed to present swap chain image!"); }
+    vk::Semaphore ccSema = *commandCompleteSemaphore_[imageIndex];
+
+    if (timeline_) {
+      // One batch: dynamic CB, a barrier making its writes visible, static CB.
+      // The timeline value retires this frame slot and this image together.
+      // Headless windows have no acquire or present semaphores.
+      uint64_t value = ++timelineValue_;
+      std::array<vk::CommandBufferSubmitInfo, 4> cbs{
+        vk::CommandBufferSubmitInfo{pscb}, vk::CommandBufferSubmitInfo{*bridgeBuffer_}, vk::CommandBufferSubmitInfo{cb},
+        vk::CommandBufferSubmitInfo{readback ? *readbackBuffers_[imageIndex] : vk::CommandBuffer{}}};
+      vk::SemaphoreSubmitInfo wait{iaSema, 0, vk::PipelineStageFlagBits2::eColorAttachmentOutput};
+      std::array<vk::SemaphoreSubmitInfo, 2> signal{
+        vk::SemaphoreSubmitInfo{*timeline_, value, vk::PipelineStageFlagBits2::eAllCommands},
+        vk::SemaphoreSubmitInfo{ccSema, 0, vk::PipelineStageFlagBits2::eAllCommands}};
+      vk::SubmitInfo2 submit2{{}, headless_ ? 0u : 1u, &wait, readback ? 4u : 3u, cbs.data(), headless_ ? 1u : 2u, signal.data()};
+      check(graphicsQueue.submit2(1, &submit2, vk::Fence{}), "submit2");
+      frameValues_[currentFrame] = value;
+      imageValues_[imageIndex] = value;
+    } else {
+      // Submit 1: dynamic CB (UBO transfers). Waits for image acquire only at
+      // eColorAttachmentOutput — the dynamic CB doesn't write to the swapchain image.
+      vk::PipelineStageFlags waitStagesAcquire = vk::PipelineStageFlagBits::eColorAttachmentOutput;
+      // Submit 2: static CB (rendering). Waits for dynamic CB at eTopOfPipe — the very first stage.
+      // This forces ALL stages in submit2 to wait for psSema without adding any access-mask
+      // dependency (which would conflict with existing barriers). Semaphore signal/wait already
+      // provides a full memory dependency (all prior writes visible), so UBO data written via
+      // cb.updateBuffer in submit1 is visible to vertex shader reads in submit2. Using eTopOfPipe
+      // also makes the ccSema→psSema→submit1 chain fully visible to sync-val, fixing
+      // SYNC-HAZARD-PRESENT-AFTER-WRITE when submit1 contains swapchain color writes.
+      vk::PipelineStageFlags waitStagesDynamic = vk::PipelineStageFlagBits::eTopOfPipe;
+
+      vk::SubmitInfo submit;
+      submit.waitSemaphoreCount = headless_ ? 0 : 1;
+      submit.pWaitSemaphores = &iaSema;
+      submit.pWaitDstStageMask = &waitStagesAcquire;
+      submit.commandBufferCount = 1;
+      submit.pCommandBuffers = &pscb;
+      submit.signalSemaphoreCount = 1;
+      submit.pSignalSemaphores = &psSema;
+
+      check(graphicsQueue.submit(1, &submit, rpcbFence), "submit");
+
+      std::array<vk::CommandBuffer, 2> cbs{cb, readback ? *readbackBuffers_[imageIndex] : vk::CommandBuffer{}};
+      submit.waitSemaphoreCount = 1;
+      submit.pWaitSemaphores = &psSema;
+      submit.pWaitDstStageMask = &waitStagesDynamic;
+      submit.commandBufferCount = readback ? 2 : 1;
+      submit.pCommandBuffers = cbs.data();
+      submit.signalSemaphoreCount = headless_ ? 0 : 1;
+      submit.pSignalSemaphores = &ccSema;
+
+      check(graphicsQueue.submit(1, &submit, cbFence), "submit");
+    }
+    auto tPresent = clock::now();
+    timing.submit = ms(tSubmit, tPresent);
+
+    if (readback) readbackPending_[imageIndex] = frameNumber_ + 1;
+    ++frameNumber_;
+
+    vk::Result resultPresent = vk::Result::eSuccess;
+    if (!headless_) {
+      vk::PresentInfoKHR presentInfo;
+      vk::SwapchainKHR swapchain = *swapchain_;
+      presentInfo.pSwapchains = &swapchain;
+      presentInfo.swapchainCount = 1;
+      presentInfo.pImageIndices = &imageIndex;
+      presentInfo.waitSemaphoreCount = 1;
+      presentInfo.pWaitSemaphores = &ccSema;
+
+      try { resultPresent = presentQueue().presentKHR(presentInfo); }
+      catch (vk::OutOfDateKHRError err) { resultPresent = vk::Result::eErrorOutOfDateKHR; }
+      catch (...) { throw std::runtime_error("failed to present swap chain image!"); }
+    }
+    auto tEnd = clock::now();
+    timing.present = ms(tPresent, tEnd);
+    timing.total = ms(tStart, tEnd);
+    recordTiming(timing);
+
     if (resultPresent == vk::Result::eErrorOutOfDateKHR || resultPresent == vk::Result::eSuboptimalKHR) {
       recreateSwapChain();
       return;
     }
 
-    ++currentFrame %= numImageIndices();
+    currentFrame_ = (currentFrame + 1) % framesInFlight_;
   }
 
+  /// Number of frames the CPU can record ahead of the GPU.
+  uint32_t framesInFlight() const { return framesInFlight_; }
+
+  /// Index of the frame in flight the next draw() will use.
+  uint32_t currentFrame() const { return currentFrame_; }
+
+  /// True if this window renders offscreen with no surface.
+  bool headless() const { return headless_; }
+
+  /// Number of frames drawn so far.
+  uint64_t frameNumber() const { return frameNumber_; }
+
+  typedef void (readbackFunc_t)(uint64_t frame, const void *pixels, uint32_t width, uint32_t height, vk::Format format);
+
+  /// Headless windows with options.readbackInterval: called with the pixels of every
+  /// readbackInterval'th frame, tightly packed rows of pixels in the window's format.
+  /// Results arrive a few frames late, when the image comes round again, or at waitIdle().
+  void setReadbackCallback(const std::function<readbackFunc_t> &callback) { readbackCallback_ = callback; }
+
+  /// Wait for the GPU to finish and deliver any outstanding readbacks.
+  void waitIdle() {
+    device_.waitIdle();
+    for (uint32_t i = 0; i != readbackPending_.size(); ++i) deliverReadback(device_, i);
+  }
+
+  /// The timeline semaphore signalled by each frame with useTimelineSubmit, else null.
+  vk::Semaphore timelineSemaphore() const { return *timeline_; }
+
+  /// The value the last submitted frame will signal on timelineSemaphore().
+  uint64_t timelineValue() const { return timelineValue_; }
+
+  /// Timing of the last frame drawn.
+  const FrameTiming &lastFrameTiming() const { return lastTiming_; }
+
+  /// p50/p95/p99 of each FrameTiming field over the recent frames.
+  FrameTimingStats frameTimingStats() const {
+    FrameTimingStats stats;
+    stats.frames = timings_.size();
+    if (timings_.empty()) return stats;
+    std::vector<double> v(timings_.size());
+    auto field = [&](double FrameTiming::*f) {
+      for (size_t i = 0; i != timings_.size(); ++i) v[i] = timings_[i].*f;
+      std::sort(v.begin(), v.end());
+      auto pct = [&](double p) { return v[std::min(v.size() - 1, (size_t)(p * v.size()))]; };
+      stats.p50.*f = pct(0.50);
+      stats.p95.*f = pct(0.95);
+      stats.p99.*f = pct(0.99);
+    };
+    field(&FrameTiming::fenceWait);
+    field(&FrameTiming::acquire);
+    field(&FrameTiming::record);
+    field(&FrameTiming::submit);
+    field(&FrameTiming::present);
+    field(&FrameTiming::total);
+    field(&FrameTiming::interval);
+    return stats;
+  }
+
+  /// Called at the end of every draw() with that frame's timing, eg. for telemetry.
+  void setFrameTimingCallback(const std::function<void (const FrameTiming &timing)> &callback) { frameTimingCallback_ = callback; }
+
   /// Return the queue family index used to present the surface to the display.
   uint32_t presentQueueFamily() const { return presentQueueFamily_; }
 
@@ -587,7 +1077,7 @@ public:
   /// Destroy resources when shutting down.
   ~Window() {
     for (auto &iv : imageViews_) {
-      device_.destroyImageView(iv);
+      if (!headless_) device_.destroyImageView(iv);
     }
     for (auto &f : commandBufferFences_) {
       device_.destroyFence(f);
@@ -625,9 +1115,12 @@ public:
   const std::vector<vk::UniqueCommandBuffer> &commandBuffers() const { return staticDrawBuffers_; }
 
   /// Return the fences used to control the static buffers.
+  /// With useTimelineSubmit these are never submitted and stay signalled;
+  /// use timelineSemaphore() and timelineValue() instead.
   const std::vector<vk::Fence> &commandBufferFences() const { return commandBufferFences_; }
 
   /// Return the fences used to control the dynamic buffers.
+  /// With useTimelineSubmit these are never submitted and stay signalled.
   const std::vector<vk::Fence> &dynamicCommandBufferFences() const { return dynamicCommandBufferFences_; }
 
   /// Return the semaphore signalled when an image is acquired.
@@ -642,9 +1135,20 @@ public:
   /// Return a default command pool to use to create new command buffers.
   vk::CommandPool commandPool() const { return *commandPool_; }
 
+  /// Per-frame command buffers. The dynamic callback can allocate more from this;
+  /// they are recycled when the frame slot comes round again.
+  FrameCommandAllocator &frameCommands() { return frameCommands_; }
+
   /// Return the number of swap chain images.
   int numImageIndices() const { return (int)images_.size(); }
 
+  /// Advance arena with draw(). Allocate from it in the dynamic callback.
+  /// The arena needs at least numImageIndices() frames, also after the swapchain is recreated.
+  void setFrameArena(FrameArena *arena) {
+    checkFrameArena(arena);
+    frameArena_ = arena;
+  }
+
   /// Create a new swapchain and destroy the previous one if any.
   void createSwapchain() {
     auto pms = physicalDevice_.getSurfacePresentModesKHR(surface_.get());
@@ -688,6 +1192,20 @@ public:
   }
 
   void createImages() {
+    if (headless_) {
+      // The images own their views.
+      auto memprops = physicalDevice_.getMemoryProperties();
+      headlessImages_.clear();
+      images_.clear();
+      imageViews_.clear();
+      for (uint32_t i = 0; i != std::max(options.headlessImages, 1u); ++i) {
+        headlessImages_.emplace_back(device_, memprops, width_, height_, swapchainImageFormat_);
+        images_.push_back(headlessImages_.back().image());
+        imageViews_.push_back(headlessImages_.back().imageView());
+      }
+      return;
+    }
+
     images_ = device_.getSwapchainImagesKHR(*swapchain_);
     for (auto &iv : imageViews_) {
       device_.destroyImageView(iv);
@@ -716,8 +1234,9 @@ public:
 
   void createDepthStencil() {
     auto memprops = physicalDevice_.getMemoryProperties();
+    // The depth buffer never leaves the render pass, so let it be lazily allocated.
     depthStencilImage_ =
-        vku::DepthStencilImage(device_, memprops, width_, height_);
+        vku::DepthStencilImage(device_, memprops, width_, height_, vk::Format::eD24UnormS8Uint, nullptr, true);
   }
 
   void createRenderPass() { // Build the renderpass using two attachments,
@@ -728,12 +1247,13 @@ public:
     rpm.attachmentBegin(swapchainImageFormat_);
     rpm.attachmentLoadOp(vk::AttachmentLoadOp::eClear);
     rpm.attachmentStoreOp(vk::AttachmentStoreOp::eStore);
-    rpm.attachmentFinalLayout(vk::ImageLayout::ePresentSrcKHR);
+    rpm.attachmentFinalLayout(headless_ ? vk::ImageLayout::eTransferSrcOptimal : vk::ImageLayout::ePresentSrcKHR);
 
     // The depth/stencil attachment.
     rpm.attachmentBegin(depthStencilImage_.format());
     rpm.attachmentLoadOp(vk::AttachmentLoadOp::eClear);
     rpm.attachmentStencilLoadOp(vk::AttachmentLoadOp::eDontCare);
+    rpm.attachmentTransient(depthStencilImage_.transient());
     rpm.attachmentFinalLayout(vk::ImageLayout::eDepthStencilAttachmentOptimal);
 
     // A subpass to render using the above two attachments.
@@ -765,14 +1285,28 @@ public:
     renderPass_ = rpm.createUnique(device_);
   }
 
+  /// Rebuild the swapchain and everything sized by it, eg. after a resize.
+  /// Headless windows have a fixed size, so this does nothing for them.
   void recreateSwapChain() {
+    if (headless_) return;
     device_.waitIdle();
 
+    int oldImages = numImageIndices();
     createSwapchain();
     createImages();
     createDepthStencil();
     createFrameBuffers();
+
+    // The new swapchain may have a different number of images.
+    // The number of frames in flight stays as it was.
+    if (numImageIndices() != oldImages) createImageSync();
     buildStaticCBs();
+
+    // The new swapchain may have more images than the arena has frames.
+    FrameArena *arena = frameArena_;
+    frameArena_ = nullptr;
+    checkFrameArena(arena);
+    frameArena_ = arena;
   }
 
   vk::Device device() const { return device_; }
@@ -780,6 +1314,182 @@ public:
   std::array<float,4> &clearColorValue() { return clearColorValue_; }
 
 private:
+  void checkFrameArena(FrameArena *arena) const {
+    if (arena && arena->numFrames() < (uint32_t)numImageIndices()) {
+      throw std::runtime_error("vku::Window: FrameArena has " + std::to_string(arena->numFrames()) + " frames, need " + std::to_string(numImageIndices()));
+    }
+  }
+
+  static void check(vk::Result result, const char *what) {
+    if (result != vk::Result::eSuccess) {
+      throw std::runtime_error(std::string("vku::Window: ") + what + " failed: " + vk::to_string(result));
+    }
+  }
+
+  // Per swapchain image: static command buffers, the fences that guard them
+  // and the semaphores that present waits on. Call with the device idle.
+  void createImageSync() {
+    uint32_t n = (uint32_t)numImageIndices();
+
+    // The present waits on this, so it can only be reused once the image has been acquired again.
+    commandCompleteSemaphore_.clear();
+    for (uint32_t i = 0; i != n; ++i) {
+      commandCompleteSemaphore_.emplace_back(device_.createSemaphoreUnique(vk::SemaphoreCreateInfo{}));
+    }
+
+    staticDrawBuffers_.clear();
+    vk::CommandBufferAllocateInfo cbai{ *commandPool_, vk::CommandBufferLevel::ePrimary, n };
+    staticDrawBuffers_ = device_.allocateCommandBuffersUnique(cbai);
+    for (auto &cb : staticDrawBuffers_) {
+      cb->begin(vk::CommandBufferBeginInfo{});
+      cb->end();
+    }
+
+    // Fences to protect the command buffers from re-writing.
+    for (auto &f : commandBufferFences_) device_.destroyFence(f);
+    commandBufferFences_.clear();
+    for (uint32_t i = 0; i != n; ++i) {
+      commandBufferFences_.emplace_back(device_.createFence(vk::FenceCreateInfo{vk::FenceCreateFlagBits::eSignaled}));
+    }
+
+    if (timeline_) imageValues_.assign(n, 0);
+    staticDirty_.assign(n, true);
+  }
+
+  // Check what useTimelineSubmit needs. The device can not be asked which features
+  // it was made with, so this catches unsupported hardware and a missing vkQueueSubmit2.
+  bool timelineSubmitSupported() const {
+    auto features = physicalDevice_.getFeatures2<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceTimelineSemaphoreFeatures, vk::PhysicalDeviceSynchronization2Features>();
+    const char *missing = nullptr;
+    if (!features.get<vk::PhysicalDeviceTimelineSemaphoreFeatures>().timelineSemaphore) missing = "timelineSemaphore";
+    else if (!features.get<vk::PhysicalDeviceSynchronization2Features>().synchronization2) missing = "synchronization2";
+    else if (!device_.getProcAddr("vkQueueSubmit2")) missing = "vkQueueSubmit2";
+    if (missing) std::cout << "useTimelineSubmit: " << missing << " is not supported, using fences\n";
+    return !missing;
+  }
+
+  void createTimeline() {
+    vk::SemaphoreTypeCreateInfo stci{vk::SemaphoreType::eTimeline, 0};
+    vk::SemaphoreCreateInfo sci{};
+    sci.pNext = &stci;
+    timeline_ = device_.createSemaphoreUnique(sci);
+    frameValues_.assign(framesInFlight_, 0);
+    imageValues_.assign(numImageIndices(), 0);
+
+    // The semaphore between the two submits used to order everything the dynamic
+    // CB did before everything the static CB does. In a single batch this full
+    // memory barrier does the same; the dynamic CB may write from any stage
+    // (eg. storage writes in a vertex shader) that any later stage reads.
+    vk::CommandBufferAllocateInfo cbai{*commandPool_, vk::CommandBufferLevel::ePrimary, 1};
+    bridgeBuffer_ = std::move(device_.allocateCommandBuffersUnique(cbai)[0]);
+    typedef vk::PipelineStageFlagBits2 ps;
+    typedef vk::AccessFlagBits2 af;
+    vk::MemoryBarrier2 mb{
+      ps::eAllCommands, af::eMemoryWrite,
+      ps::eAllCommands, af::eMemoryRead|af::eMemoryWrite};
+    vk::CommandBuffer cb = *bridgeBuffer_;
+    cb.begin(vk::CommandBufferBeginInfo{vk::CommandBufferUsageFlagBits::eSimultaneousUse});
+    cb.pipelineBarrier2(vk::DependencyInfo{{}, 1, &mb});
+    cb.end();
+  }
+
+  // Re-record the dirty segments of one image and, if anything changed, its static CB.
+  void updateStaticSegments(uint32_t image) {
+    if (staticDirty_.size() < (size_t)numImageIndices()) staticDirty_.resize(numImageIndices(), true);
+    bool changed = staticDirty_[image];
+    vk::CommandBufferInheritanceInfo inherit{*renderPass_, 0, *framebuffers_[image]};
+    for (auto &seg : segments_) {
+      if (!seg.func) continue;
+      if (seg.cbs.size() < (size_t)numImageIndices()) {
+        vk::CommandBufferAllocateInfo cbai{*commandPool_, vk::CommandBufferLevel::eSecondary, (uint32_t)(numImageIndices() - seg.cbs.size())};
+        for (auto &cb : device_.allocateCommandBuffersUnique(cbai)) seg.cbs.push_back(std::move(cb));
+        seg.dirty.resize(numImageIndices(), true);
+      }
+      if (!seg.dirty[image]) continue;
+      vk::CommandBuffer cb = *seg.cbs[image];
+      cb.begin(vk::CommandBufferBeginInfo{vk::CommandBufferUsageFlagBits::eRenderPassContinue, &inherit});
+      seg.func(cb, (int)image);
+      cb.end();
+      seg.dirty[image] = false;
+      changed = true;
+    }
+    if (!changed) return;
+
+    std::vector<vk::CommandBuffer> secondaries;
+    for (auto &seg : segments_) {
+      if (seg.func) secondaries.push_back(*seg.cbs[image]);
+    }
+
+    vk::CommandBuffer cb = *staticDrawBuffers_[image];
+    vk::ClearDepthStencilValue clearDepthValue{1.0f, 0};
+    std::array<vk::ClearValue, 2> clearColours{vk::ClearValue{clearColorValue()}, clearDepthValue};
+    vk::RenderPassBeginInfo rpbi{*renderPass_, *framebuffers_[image], vk::Rect2D{{0, 0}, {width_, height_}}, (uint32_t)clearColours.size(), clearColours.data()};
+    cb.begin(vk::CommandBufferBeginInfo{});
+    cb.beginRenderPass(rpbi, vk::SubpassContents::eSecondaryCommandBuffers);
+    if (!secondaries.empty()) cb.executeCommands(secondaries);
+    cb.endRenderPass();
+    cb.end();
+    staticDirty_[image] = false;
+  }
+
+  // One host visible buffer and a pre-recorded copy per offscreen image.
+  void createReadback() {
+    vk::CommandBufferAllocateInfo cbai{*commandPool_, vk::CommandBufferLevel::ePrimary, (uint32_t)numImageIndices()};
+    readbackBuffers_ = device_.allocateCommandBuffersUnique(cbai);
+    readbackPending_.assign(numImageIndices(), 0);
+    auto bp = vku::getBlockParams(swapchainImageFormat_);
+    if (bp.blockWidth != 1 || bp.blockHeight != 1 || !bp.bytesPerBlock) {
+      throw std::runtime_error("vku::Window: can't read back " + vk::to_string(swapchainImageFormat_));
+    }
+    vk::DeviceSize size = (vk::DeviceSize)width_ * height_ * bp.bytesPerBlock;
+    for (int i = 0; i != numImageIndices(); ++i) {
+      readbackData_.emplace_back(device_, physicalDevice_, vk::BufferUsageFlagBits::eTransferDst, size, vk::MemoryPropertyFlagBits::eHostVisible);
+
+      vk::CommandBuffer cb = *readbackBuffers_[i];
+      cb.begin(vk::CommandBufferBeginInfo{});
+      vk::ImageMemoryBarrier imb{vk::AccessFlagBits::eColorAttachmentWrite, vk::AccessFlagBits::eTransferRead,
+        vk::ImageLayout::eTransferSrcOptimal, vk::ImageLayout::eTransferSrcOptimal, VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED,
+        images_[i], {vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1}};
+      cb.pipelineBarrier(vk::PipelineStageFlagBits::eAllCommands, vk::PipelineStageFlagBits::eTransfer, {}, nullptr, nullptr, imb);
+      vk::BufferImageCopy region{0, 0, 0, {vk::ImageAspectFlagBits::eColor, 0, 0, 1}, {0, 0, 0}, {width_, height_, 1}};
+      cb.copyImageToBuffer(images_[i], vk::ImageLayout::eTransferSrcOptimal, readbackData_[i].buffer(), region);
+      vk::BufferMemoryBarrier bmb{vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eHostRead,
+        VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, readbackData_[i].buffer(), 0, VK_WHOLE_SIZE};
+      cb.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eHost, {}, nullptr, bmb, nullptr);
+      cb.end();
+    }
+  }
+
+  // Call once the image's last frame has finished on the GPU.
+  void deliverReadback(vk::Device device, uint32_t image) {
+    if (!readbackPending_[image]) return;
+    uint64_t frame = readbackPending_[image] - 1;
+    readbackPending_[image] = 0;
+    if (!readbackCallback_) return;
+    auto &buf = readbackData_[image];
+    buf.invalidate(device);
+    readbackCallback_(frame, buf.map(device), width_, height_, swapchainImageFormat_);
+  }
+
+  void waitTimeline(vk::Device device, uint64_t value) {
+    if (!value) return;
+    vk::Semaphore sema = *timeline_;
+    vk::SemaphoreWaitInfo swi{{}, 1, &sema, &value};
+    check(device.waitSemaphores(swi, std::numeric_limits<uint64_t>::max()), "waitSemaphores");
+  }
+
+  void recordTiming(const FrameTiming &timing) {
+    lastTiming_ = timing;
+    size_t window = std::max(options.frameTimingWindow, 1u);
+    if (timings_.size() < window) {
+      timings_.push_back(timing);
+    } else {
+      timings_[nextTiming_] = timing;
+      nextTiming_ = (nextTiming_ + 1) % window;
+    }
+    if (frameTimingCallback_) frameTimingCallback_(timing);
+  }
+
   vk::Instance instance_;
   vk::PhysicalDevice physicalDevice_;
   uint32_t graphicsQueueFamilyIndex_;
@@ -797,12 +1507,45 @@ private:
   std::vector<vk::Fence> dynamicCommandBufferFences_;
   std::vector<vk::UniqueFramebuffer> framebuffers_;
   std::vector<vk::UniqueCommandBuffer> staticDrawBuffers_;
-  std::vector<vk::UniqueCommandBuffer> dynamicDrawBuffers_;
+  FrameCommandAllocator frameCommands_;
+
+  struct Segment {
+    std::function<segmentFunc_t> func;
+    std::vector<vk::UniqueCommandBuffer> cbs; // per image
+    std::vector<bool> dirty;                  // per image
+  };
+  std::vector<Segment> segments_;
+  std::vector<bool> staticDirty_;             // per image: static CB must be re-recorded
+
   /// \brief Function called to recreate the static buffers on window size
   /// change.
   std::function<renderFunc_t> func;
 
   vku::DepthStencilImage depthStencilImage_;
+  FrameArena *frameArena_ = nullptr;
+  uint32_t framesInFlight_ = 1;
+  uint32_t currentFrame_ = 0;
+
+  bool headless_ = false;
+  uint32_t headlessNext_ = 0;
+  uint64_t frameNumber_ = 0;
+  std::vector<vku::ColorAttachmentImage> headlessImages_;
+  std::vector<vku::GenericBuffer> readbackData_;
+  std::vector<vk::UniqueCommandBuffer> readbackBuffers_;
+  std::vector<uint64_t> readbackPending_;  // frame number + 1 per image, 0 if none
+  std::function<readbackFunc_t> readbackCallback_;
+
+  vk::UniqueSemaphore timeline_;
+  vk::UniqueCommandBuffer bridgeBuffer_;
+  uint64_t timelineValue_ = 0;
+  std::vector<uint64_t> frameValues_;  // per frame in flight
+  std::vector<uint64_t> imageValues_;  // per swapchain image
+
+  std::chrono::steady_clock::time_point lastDrawStart_;
+  FrameTiming lastTiming_;
+  std::vector<FrameTiming> timings_;
+  size_t nextTiming_ = 0;
+  std::function<void (const FrameTiming &timing)> frameTimingCallback_;
 
   uint32_t presentQueueFamily_ = 0;
   uint32_t width_ = 0;